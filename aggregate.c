@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Reduction of a series of measurements for plotting.
+ *
+ * The window statistics are updated one value at a time, so that a
+ * query can stream through the samples without keeping them. The mean
+ * and the variance use Welford's recurrence, which does not lose
+ * precision on values with a large offset, such as resistances of a
+ * few kilohms varying by milliohms.
+ *
+ * The decimation is Sveinn Steinarsson's Largest-Triangle-Three-Buckets
+ * algorithm. The points between the first and the last one are split
+ * in points - 2 buckets of consecutive points. Going from left to
+ * right, each bucket contributes the point forming the largest triangle
+ * with the point selected in the previous bucket and the average point
+ * of the next bucket. Thus, the peaks and dips survive the decimation,
+ * which is not the case with plain averaging or with keeping every
+ * n-th point.
+ */
+
+#include <stddef.h>
+#include <strings.h>
+#include <math.h>
+#include "aggregate.h"
+
+static const char *const function_names[AGG_FUNCTIONS] = { "min", "max",
+    "mean", "stddev", "first", "last", "count" };
+
+int aggregate_function(const char *name)
+{
+    for (int i = 0; i < AGG_FUNCTIONS; i++)
+        if (strcasecmp(name, function_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+void window_clear(window_t *w)
+{
+    *w = (window_t) {0, INFINITY, -INFINITY, 0, 0, NAN, NAN};
+}
+
+void window_add(window_t *w, double value)
+{
+    if (w->count++ == 0) w->first = value;
+    w->last = value;
+    if (value < w->min) w->min = value;
+    if (value > w->max) w->max = value;
+    double delta = value - w->mean;
+    w->mean += delta / w->count;
+    w->m2 += delta * (value - w->mean);
+}
+
+double window_value(const window_t *w, int function)
+{
+    switch (function) {
+        case AGG_MIN:    return w->min;
+        case AGG_MAX:    return w->max;
+        case AGG_MEAN:   return w->mean;
+        case AGG_STDDEV: return sqrt(w->m2 / w->count);
+        case AGG_FIRST:  return w->first;
+        case AGG_LAST:   return w->last;
+        case AGG_COUNT:  return w->count;
+    }
+    return NAN;
+}
+
+size_t lttb(const double *x, const double *y, size_t n, size_t points,
+        size_t *selected)
+{
+    size_t count = 0;
+
+    if (points >= n) {
+        for (size_t i = 0; i < n; i++) selected[i] = i;
+        return n;
+    }
+    selected[count++] = 0;
+    if (points < 3) {
+        selected[count++] = n - 1;
+        return count;
+    }
+
+    /*
+     * Bucket b spans the points from bound(b) to bound(b + 1) - 1. As
+     * points < n, there is at least one point per bucket.
+     */
+    size_t buckets = points - 2;
+    double every = (double) (n - 2) / buckets;
+#define bound(b) ((b) == buckets ? n - 1 : (size_t) ((b) * every) + 1)
+    size_t a = 0;
+    for (size_t b = 0; b < buckets; b++) {
+
+        /* Average point of the next bucket, or the last point. */
+        size_t next = bound(b + 1);
+        size_t end = b + 1 < buckets ? bound(b + 2) : n;
+        double ax = 0, ay = 0;
+        for (size_t i = next; i < end; i++) {
+            ax += x[i];
+            ay += y[i];
+        }
+        ax /= end - next;
+        ay /= end - next;
+
+        /* Point of this bucket forming the largest triangle. */
+        size_t pick = bound(b);
+        double best = -1;
+        for (size_t i = bound(b); i < bound(b + 1); i++) {
+            double area = fabs((x[a] - ax) * (y[i] - y[a])
+                    - (x[a] - x[i]) * (ay - y[a]));
+            if (area > best) {
+                best = area;
+                pick = i;
+            }
+        }
+        selected[count++] = a = pick;
+    }
+#undef bound
+    selected[count++] = n - 1;
+    return count;
+}
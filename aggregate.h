@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Reduction of a series of measurements for plotting: statistics over
+ * time windows, and decimation keeping the visual shape of the curve.
+ * Include <stddef.h> before this.
+ */
+
+/* Functions computed over a window. */
+enum { AGG_MIN, AGG_MAX, AGG_MEAN, AGG_STDDEV, AGG_FIRST, AGG_LAST,
+    AGG_COUNT, AGG_FUNCTIONS };
+
+/* Get the function from its name, case-insensitively, or -1. */
+int aggregate_function(const char *name);
+
+/* Running statistics of the values of a window. */
+typedef struct {
+    long count;
+    double min, max;
+    double mean, m2;    /* Welford's: m2 is the sum of squared deviations */
+    double first, last;
+} window_t;
+
+void window_clear(window_t *w);
+void window_add(window_t *w, double value);
+
+/*
+ * Value of a function over the window; the standard deviation is that
+ * of the population. The window should not be empty.
+ */
+double window_value(const window_t *w, int function);
+
+/*
+ * Largest-Triangle-Three-Buckets decimation: select at most `points' of
+ * the n points (x[i], y[i]), x being increasing, so that a plot of the
+ * selection looks like a plot of them all. The first and last points
+ * are always selected, and the others are picked one per bucket of
+ * consecutive points. Stores the indices of the selected points, in
+ * increasing order, in `selected', which should have room for `points'
+ * of them, and returns their number. `points' should be at least 2.
+ */
+size_t lttb(const double *x, const double *y, size_t n, size_t points,
+        size_t *selected);
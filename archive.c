@@ -0,0 +1,756 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Archive of the measurements.
+ *
+ * Each channel has its own series of segment files in the archive
+ * directory, named channel<i>.<n>.log, n counting from 0. A segment is
+ * an array of fixed-size records, in time order, and holds at most
+ * SEGMENT_RECORDS of them. Only the last segment of a channel is
+ * appended to. A partial record at the end of a segment, left by a
+ * crash, is cut off at startup.
+ *
+ * The acquisition thread fills batches of records and hands them to the
+ * writer thread through a lock-free queue; the empty batches come back
+ * through another one. The writer appends the records with write(), and
+ * syncs the files with fdatasync() COMMIT_PERIOD after the first write
+ * not yet synced: all the records written in between share the sync
+ * (group commit). Should the writer fall behind by MAX_BATCHES, the new
+ * records are dropped: the acquisition never waits for the disk.
+ *
+ * Each segment has a sparse index in memory, the time of every
+ * INDEX_STRIDE-th record, rebuilt from the files at startup. A query
+ * bisects the index, then the few records it points to, which are
+ * mapped with mmap(). The segment tables are shared by the writer and
+ * the queries, under a mutex.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <Trmc.h>
+#include "io.h"
+#include "spsc.h"
+#include "archive.h"
+
+/* Channels that can be archived. */
+#define ARCHIVE_CHANNELS 256
+
+#define SEGMENT_RECORDS (1 << 20)   /* 56 MiB */
+#define INDEX_STRIDE 1024
+
+/* Records per batch, and batches in flight. */
+#define BATCH_RECORDS 1024
+#define MAX_BATCHES 64
+
+#define COMMIT_PERIOD 1000  /* ms */
+
+#ifdef __GNUC__
+# define unused(x) x __attribute__((unused))
+#else
+# define unused(x) x
+#endif
+
+typedef struct {
+    unsigned int count;
+    unsigned char channel[BATCH_RECORDS];
+    unsigned char records[BATCH_RECORDS][ARCHIVE_RECORD_SIZE];
+} batch_t;
+
+typedef struct {
+    unsigned int number;    /* in the file name */
+    size_t count;           /* records written */
+    int64_t first, last;    /* their times */
+    int64_t *index;         /* times of records 0, INDEX_STRIDE... */
+} log_segment_t;
+
+typedef struct {
+    log_segment_t *segments;
+    int segment_count, allocated;
+    int fd;                 /* on the last segment, or -1 */
+    int dirty;              /* written since the last sync */
+    unsigned char *pending; /* records to append */
+    size_t pending_count, pending_allocated;
+} log_channel_t;
+
+static char *directory;
+static log_channel_t channels[ARCHIVE_CHANNELS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static spsc_queue *full_batches;   /* acquisition -> writer */
+static spsc_queue *free_batches;   /* writer -> acquisition */
+static pthread_t writer_thread;
+static atomic_int stopping;
+
+/* Acquisition thread side. */
+static batch_t *batch;              /* being filled */
+static int batch_count;             /* allocated so far */
+static int64_t last_received[ARCHIVE_CHANNELS];
+static unsigned long dropped;
+
+/* Is the log kept? */
+int archive_enabled(void)
+{
+    return directory != NULL;
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (!p) {
+        syslog(LOG_ERR, "realloc: %m\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void segment_path(char *path, int index, unsigned int number)
+{
+    snprintf(path, PATH_MAX, "%s/channel%d.%06u.log", directory, index,
+            number);
+}
+
+/* Little-endian decoding. */
+static uint64_t get_u64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = v << 8 | p[i];
+    return v;
+}
+
+static int32_t get_i32(const unsigned char *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+        | (uint32_t) p[3] << 24;
+}
+
+static double get_f64(const unsigned char *p)
+{
+    uint64_t u = get_u64(p);
+    double d;
+    memcpy(&d, &u, sizeof d);
+    return d;
+}
+
+static int64_t record_time(const unsigned char *map, size_t record)
+{
+    return get_u64(map + record * ARCHIVE_RECORD_SIZE);
+}
+
+static void decode_record(const unsigned char *p, AMEASURE *m)
+{
+    p += 8;
+    m->MeasureRaw = get_f64(p);
+    m->Measure = get_f64(p + 8);
+    m->ValueRangeI = get_f64(p + 16);
+    m->ValueRangeV = get_f64(p + 24);
+    m->Time = get_i32(p + 32);
+    m->Status = get_i32(p + 36);
+    m->Number = get_i32(p + 40);
+    m->Nothing = 0;
+}
+
+/* Room for the index of a segment of `count' records. */
+static int64_t *new_index(size_t count)
+{
+    if (count < SEGMENT_RECORDS) count = SEGMENT_RECORDS;
+    int64_t *index = calloc((count + INDEX_STRIDE - 1) / INDEX_STRIDE,
+            sizeof *index);
+    if (!index) {
+        syslog(LOG_ERR, "calloc: %m\n");
+        exit(EXIT_FAILURE);
+    }
+    return index;
+}
+
+/* Add a segment to the channel's table. */
+static log_segment_t *add_segment(log_channel_t *ch, unsigned int number,
+        int64_t *index)
+{
+    if (ch->segment_count == ch->allocated) {
+        ch->allocated = ch->allocated ? 2 * ch->allocated : 16;
+        ch->segments = xrealloc(ch->segments,
+                ch->allocated * sizeof *ch->segments);
+    }
+    log_segment_t *seg = &ch->segments[ch->segment_count++];
+    *seg = (log_segment_t) {number, 0, 0, 0, index};
+    return seg;
+}
+
+
+/***********************************************************************
+ * Startup.
+ */
+
+/* Read the time of a record from the file. */
+static int64_t read_time(int fd, size_t record)
+{
+    unsigned char buffer[8];
+    if (pread(fd, buffer, sizeof buffer, record * ARCHIVE_RECORD_SIZE)
+            != sizeof buffer)
+        return 0;
+    return get_u64(buffer);
+}
+
+/* Load an existing segment: check its size and rebuild its index. */
+static int load_segment(int index, unsigned int number)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    segment_path(path, index, number);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        syslog(LOG_ERR, "%s: %m\n", path);
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    size_t count = st.st_size / ARCHIVE_RECORD_SIZE;
+    if (st.st_size % ARCHIVE_RECORD_SIZE) {
+        syslog(LOG_WARNING, "%s: partial record removed\n", path);
+        if (ftruncate(fd, count * ARCHIVE_RECORD_SIZE) == -1)
+            syslog(LOG_WARNING, "ftruncate: %m\n");
+    }
+    if (count == 0) {
+        close(fd);
+        unlink(path);
+        return 0;
+    }
+    int64_t *times = new_index(count);
+    for (size_t k = 0; k * INDEX_STRIDE < count; k++)
+        times[k] = read_time(fd, k * INDEX_STRIDE);
+    log_segment_t *seg = add_segment(&channels[index], number, times);
+    seg->count = count;
+    seg->first = times[0];
+    seg->last = read_time(fd, count - 1);
+    close(fd);
+    return 0;
+}
+
+static int by_number(const void *a, const void *b)
+{
+    const log_segment_t *sa = a, *sb = b;
+    return (sa->number > sb->number) - (sa->number < sb->number);
+}
+
+static void *writer_loop(void *arg);
+
+/* Open the log and start the writer thread. */
+int archive_init(const char *dir)
+{
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        syslog(LOG_ERR, "mkdir %s: %m\n", dir);
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (!d) {
+        syslog(LOG_ERR, "opendir %s: %m\n", dir);
+        return -1;
+    }
+    directory = strdup(dir);
+    if (!directory) {
+        syslog(LOG_ERR, "strdup: %m\n");
+        closedir(d);
+        return -1;
+    }
+
+    /* Load the segments: channel<i>.<n>.log */
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        int index, length = 0;
+        unsigned int number;
+        if (sscanf(e->d_name, "channel%d.%u.log%n", &index, &number,
+                    &length) != 2 || e->d_name[length]
+                || index < 0 || index >= ARCHIVE_CHANNELS)
+            continue;
+        if (load_segment(index, number) == -1) {
+            closedir(d);
+            return -1;
+        }
+    }
+    closedir(d);
+
+    /* Resume appending to the last segment of each channel. */
+    for (int i = 0; i < ARCHIVE_CHANNELS; i++) {
+        log_channel_t *ch = &channels[i];
+        ch->fd = -1;
+        if (!ch->segment_count) continue;
+        qsort(ch->segments, ch->segment_count, sizeof *ch->segments,
+                by_number);
+        log_segment_t *last = &ch->segments[ch->segment_count - 1];
+        last_received[i] = last->last;
+        if (last->count < SEGMENT_RECORDS) {
+            char path[PATH_MAX];
+            segment_path(path, i, last->number);
+            ch->fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+            if (ch->fd == -1)
+                syslog(LOG_WARNING, "%s: %m\n", path);
+        }
+    }
+
+    full_batches = spsc_new(MAX_BATCHES);
+    free_batches = spsc_new(MAX_BATCHES);
+    if (!full_batches || !free_batches) return -1;
+    int err = pthread_create(&writer_thread, NULL, writer_loop, NULL);
+    if (err) {
+        syslog(LOG_ERR, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+
+/***********************************************************************
+ * Acquisition thread side.
+ */
+
+/* Get an empty batch, or NULL if the writer is too far behind. */
+static batch_t *get_batch(void)
+{
+    batch_t *b = spsc_pop(free_batches);
+    if (!b && batch_count < MAX_BATCHES) {
+        b = malloc(sizeof *b);
+        if (!b) {
+            syslog(LOG_ERR, "malloc: %m\n");
+            exit(EXIT_FAILURE);
+        }
+        batch_count++;
+    }
+    if (!b) return NULL;
+    if (dropped) {
+        syslog(LOG_WARNING, "archive: %lu measurements dropped\n",
+                dropped);
+        dropped = 0;
+    }
+    b->count = 0;
+    return b;
+}
+
+/* Buffer a measurement. */
+void archive_store(int index, int64_t received, const AMEASURE *m)
+{
+    if (!directory || index < 0 || index >= ARCHIVE_CHANNELS) return;
+    if (!batch && !(batch = get_batch())) {
+        dropped++;
+        return;
+    }
+    if (received < last_received[index])
+        received = last_received[index];
+    last_received[index] = received;
+
+    unsigned char *p = batch->records[batch->count];
+    batch->channel[batch->count++] = index;
+    p = put_u64(p, received);
+    p = put_f64(p, m->MeasureRaw);
+    p = put_f64(p, m->Measure);
+    p = put_f64(p, m->ValueRangeI);
+    p = put_f64(p, m->ValueRangeV);
+    p = put_i32(p, m->Time);
+    p = put_i32(p, m->Status);
+    p = put_i32(p, m->Number);
+    put_i32(p, 0);
+    if (batch->count == BATCH_RECORDS)
+        archive_flush();
+}
+
+/* Hand the batch over: the queue can hold all the batches. */
+void archive_flush(void)
+{
+    if (!batch || !batch->count) return;
+    spsc_push(full_batches, batch);
+    spsc_notify(full_batches);
+    batch = NULL;
+}
+
+
+/***********************************************************************
+ * Writer thread.
+ */
+
+/* Make the creation of a file durable. */
+static void sync_directory(void)
+{
+    int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return;
+    if (fsync(fd) == -1)
+        syslog(LOG_WARNING, "fsync %s: %m\n", directory);
+    close(fd);
+}
+
+/* Close the last segment of the channel, if open, and start another. */
+static log_segment_t *new_segment(log_channel_t *ch, int index)
+{
+    char path[PATH_MAX];
+
+    if (ch->fd != -1) {
+        if (fdatasync(ch->fd) == -1)
+            syslog(LOG_WARNING, "fdatasync: %m\n");
+        close(ch->fd);
+        ch->fd = -1;
+        ch->dirty = 0;
+    }
+    unsigned int number = ch->segment_count
+        ? ch->segments[ch->segment_count - 1].number + 1 : 0;
+    segment_path(path, index, number);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        syslog(LOG_ERR, "%s: %m\n", path);
+        return NULL;
+    }
+    sync_directory();
+    int64_t *times = new_index(0);
+    pthread_mutex_lock(&lock);
+    log_segment_t *seg = add_segment(ch, number, times);
+    pthread_mutex_unlock(&lock);
+    ch->fd = fd;
+    return seg;
+}
+
+static int write_all(int fd, const unsigned char *p, size_t n)
+{
+    while (n) {
+        ssize_t ret = write(fd, p, n);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += ret;
+        n -= ret;
+    }
+    return 0;
+}
+
+/* Append the pending records of the channel to its segments. */
+static void write_pending(log_channel_t *ch, int index)
+{
+    const unsigned char *p = ch->pending;
+    size_t n = ch->pending_count;
+
+    ch->pending_count = 0;
+    while (n) {
+        log_segment_t *seg = ch->segment_count
+            ? &ch->segments[ch->segment_count - 1] : NULL;
+        if (ch->fd == -1 || seg->count >= SEGMENT_RECORDS)
+            seg = new_segment(ch, index);
+        if (!seg) return;   /* the records are lost */
+        size_t k = SEGMENT_RECORDS - seg->count;
+        if (k > n) k = n;
+        if (write_all(ch->fd, p, k * ARCHIVE_RECORD_SIZE) == -1) {
+
+            /* Cut a partial write off, and go on with a new segment. */
+            syslog(LOG_ERR, "archive write: %m\n");
+            if (ftruncate(ch->fd, seg->count * ARCHIVE_RECORD_SIZE) == -1)
+                syslog(LOG_WARNING, "ftruncate: %m\n");
+            close(ch->fd);
+            ch->fd = -1;
+            return;
+        }
+
+        /* Publish the records to the queries. */
+        pthread_mutex_lock(&lock);
+        for (size_t j = 0; j < k; j++) {
+            size_t r = seg->count + j;
+            if (r % INDEX_STRIDE == 0)
+                seg->index[r / INDEX_STRIDE] = record_time(p, j);
+        }
+        if (!seg->count) seg->first = record_time(p, 0);
+        seg->last = record_time(p, k - 1);
+        seg->count += k;
+        pthread_mutex_unlock(&lock);
+        ch->dirty = 1;
+        p += k * ARCHIVE_RECORD_SIZE;
+        n -= k;
+    }
+}
+
+/* Write the records of a batch, grouped by channel. */
+static void write_batch(const batch_t *b)
+{
+    for (unsigned int i = 0; i < b->count; i++) {
+        log_channel_t *ch = &channels[b->channel[i]];
+        if (ch->pending_count == ch->pending_allocated) {
+            ch->pending_allocated = ch->pending_allocated
+                ? 2 * ch->pending_allocated : 64;
+            ch->pending = xrealloc(ch->pending,
+                    ch->pending_allocated * ARCHIVE_RECORD_SIZE);
+        }
+        memcpy(ch->pending + ch->pending_count++ * ARCHIVE_RECORD_SIZE,
+                b->records[i], ARCHIVE_RECORD_SIZE);
+    }
+    for (int i = 0; i < ARCHIVE_CHANNELS; i++)
+        if (channels[i].pending_count)
+            write_pending(&channels[i], i);
+}
+
+/* Write the batches handed over. Returns whether anything was written. */
+static int write_batches(void)
+{
+    batch_t *b;
+    int written = 0;
+
+    while ((b = spsc_pop(full_batches))) {
+        write_batch(b);
+        spsc_push(free_batches, b);
+        written = 1;
+    }
+    return written;
+}
+
+/* Sync all the segments written since the last commit. */
+static void commit(void)
+{
+    for (int i = 0; i < ARCHIVE_CHANNELS; i++) {
+        log_channel_t *ch = &channels[i];
+        if (!ch->dirty) continue;
+        if (ch->fd != -1 && fdatasync(ch->fd) == -1)
+            syslog(LOG_WARNING, "fdatasync: %m\n");
+        ch->dirty = 0;
+    }
+}
+
+static long ms_until(const struct timespec *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (t->tv_sec - now.tv_sec) * 1000
+        + (t->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? ms : 0;
+}
+
+static void *writer_loop(unused(void *arg))
+{
+    struct timespec deadline;
+    int uncommitted = 0;
+
+    for (;;) {
+        struct pollfd pfd = {spsc_fd(full_batches), POLLIN, 0};
+        int timeout = uncommitted ? ms_until(&deadline) : -1;
+        if (poll(&pfd, 1, timeout) == -1 && errno != EINTR)
+            syslog(LOG_WARNING, "poll: %m\n");
+        spsc_clear(full_batches);
+        if (write_batches() && !uncommitted) {
+            uncommitted = 1;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += COMMIT_PERIOD / 1000;
+            deadline.tv_nsec += COMMIT_PERIOD % 1000 * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+        }
+        if (atomic_load(&stopping)) {
+            write_batches();
+            commit();
+            return NULL;
+        }
+        if (uncommitted && ms_until(&deadline) == 0) {
+            commit();
+            uncommitted = 0;
+        }
+    }
+}
+
+/* Write and sync everything, and stop the writer thread. */
+void archive_stop(void)
+{
+    if (!directory) return;
+    archive_flush();
+    atomic_store(&stopping, 1);
+    spsc_notify(full_batches);
+    pthread_join(writer_thread, NULL);
+}
+
+
+/***********************************************************************
+ * Queries, in the reader thread, which is not the acquisition thread:
+ * they wait for the disk.
+ */
+
+/*
+ * Records of a segment selected by a query. The first record after
+ * `since' is within [since_lo, since_hi], the first one after `until'
+ * within [until_lo, until_hi], as told by the index.
+ */
+typedef struct {
+    unsigned int number;
+    size_t count;
+    size_t since_lo, since_hi, until_lo, until_hi;
+} span_t;
+
+/* The records after this time are those at or after t. */
+static int64_t before(int64_t t)
+{
+    return t > INT64_MIN ? t - 1 : t;
+}
+
+/*
+ * Bounds of the first record with a time above t, from the index: it
+ * comes after the last indexed record at or before t, and at the
+ * latest with the next indexed record.
+ */
+static void narrow(const log_segment_t *seg, int64_t t, size_t *lo,
+        size_t *hi)
+{
+    size_t a = 0, b = (seg->count + INDEX_STRIDE - 1) / INDEX_STRIDE;
+    while (a < b) {
+        size_t mid = a + (b - a) / 2;
+        if (seg->index[mid] <= t)
+            a = mid + 1;
+        else
+            b = mid;
+    }
+    *lo = a ? (a - 1) * INDEX_STRIDE + 1 : 0;
+    *hi = a * INDEX_STRIDE < seg->count ? a * INDEX_STRIDE : seg->count;
+}
+
+/* Find the segments of the channel overlapping [since, until]. */
+static int locate(int index, int64_t since, int64_t until, span_t **spans)
+{
+    int n = 0;
+
+    *spans = NULL;
+    if (!directory || index < 0 || index >= ARCHIVE_CHANNELS
+            || since > until)
+        return 0;
+    pthread_mutex_lock(&lock);
+    log_channel_t *ch = &channels[index];
+    for (int i = 0; i < ch->segment_count; i++) {
+        log_segment_t *seg = &ch->segments[i];
+        if (!seg->count || seg->last < since || seg->first > until)
+            continue;
+        *spans = xrealloc(*spans, (n + 1) * sizeof **spans);
+        span_t *sp = &(*spans)[n++];
+        sp->number = seg->number;
+        sp->count = seg->count;
+        narrow(seg, before(since), &sp->since_lo, &sp->since_hi);
+        narrow(seg, until, &sp->until_lo, &sp->until_hi);
+    }
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+/* First record of [lo, hi) with a time above t, or hi if none. */
+static size_t first_after(const unsigned char *map, size_t lo, size_t hi,
+        int64_t t)
+{
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (record_time(map, mid) <= t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Map the segment of a span, and find its records [*start, *end).
+ * Returns the mapping, of sp->count records, or NULL on error. The
+ * file stays open in *fd.
+ */
+static unsigned char *map_span(int index, const span_t *sp,
+        int64_t since, int64_t until, size_t *start, size_t *end, int *fd)
+{
+    char path[PATH_MAX];
+
+    segment_path(path, index, sp->number);
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*fd == -1) {
+        syslog(LOG_WARNING, "%s: %m\n", path);
+        return NULL;
+    }
+    unsigned char *map = mmap(NULL, sp->count * ARCHIVE_RECORD_SIZE,
+            PROT_READ, MAP_SHARED, *fd, 0);
+    if (map == MAP_FAILED) {
+        syslog(LOG_WARNING, "mmap: %m\n");
+        close(*fd);
+        return NULL;
+    }
+    *start = first_after(map, sp->since_lo, sp->since_hi,
+            before(since));
+    *end = first_after(map, sp->until_lo, sp->until_hi, until);
+    return map;
+}
+
+/* Pass the records of a time range to fn(). */
+size_t archive_query(int index, int64_t since, int64_t until,
+        archive_fn *fn, void *arg)
+{
+    span_t *spans;
+    int n = locate(index, since, until, &spans);
+    size_t total = 0;
+
+    for (int i = 0; i < n; i++) {
+        size_t start, end;
+        int fd;
+        unsigned char *map = map_span(index, &spans[i], since, until,
+                &start, &end, &fd);
+        if (!map) continue;
+        for (size_t r = start; r < end; r++) {
+            AMEASURE m;
+            const unsigned char *p = map + r * ARCHIVE_RECORD_SIZE;
+            decode_record(p, &m);
+            fn(arg, get_u64(p), &m);
+        }
+        total += end - start;
+        munmap(map, spans[i].count * ARCHIVE_RECORD_SIZE);
+        close(fd);
+    }
+    free(spans);
+    return total;
+}
+
+/* Locate the records of a time range and read them in. */
+int archive_export(int index, int64_t since, int64_t until,
+        size_t max_bytes, archive_range_t **ranges)
+{
+    span_t *spans;
+    int n = locate(index, since, until, &spans);
+    int count = 0;
+    long page = sysconf(_SC_PAGESIZE);
+
+    *ranges = n ? xrealloc(NULL, n * sizeof **ranges) : NULL;
+    for (int i = 0; i < n && max_bytes; i++) {
+        size_t start, end;
+        int fd;
+        unsigned char *map = map_span(index, &spans[i], since, until,
+                &start, &end, &fd);
+        if (!map) continue;
+        size_t offset = start * ARCHIVE_RECORD_SIZE;
+        size_t length = (end - start) * ARCHIVE_RECORD_SIZE;
+        if (length > max_bytes)
+            length = max_bytes / ARCHIVE_RECORD_SIZE * ARCHIVE_RECORD_SIZE;
+
+        /* Fault the pages in, so that sending them does not block. */
+        if (length) {
+            size_t first_page = offset / page * page;
+            madvise(map + first_page, offset + length - first_page,
+                    MADV_WILLNEED);
+            volatile unsigned char sink = 0;
+            for (size_t o = first_page; o < offset + length; o += page)
+                sink += map[o];
+            (void) sink;
+        }
+        munmap(map, spans[i].count * ARCHIVE_RECORD_SIZE);
+        if (!length) {
+            close(fd);
+            continue;
+        }
+        (*ranges)[count++] = (archive_range_t) {fd, offset, length};
+        max_bytes -= length;
+    }
+    free(spans);
+    return count;
+}
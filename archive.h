@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Archive of the measurements: every sample read from each channel is
+ * appended to a log on disk, which survives the restarts of trmc2d.
+ * The disk is only touched by a dedicated writer thread, and by the
+ * queries in the archive reader thread of interpreter.c. Include <stddef.h>, <stdint.h> and
+ * <Trmc.h> before this.
+ */
+
+/*
+ * A record of the log: the receive time in ns since the epoch (int64),
+ * MeasureRaw, Measure, ValueRangeI, ValueRangeV (four doubles), Time,
+ * Status, Number and a zero (four int32), all little-endian.
+ */
+#define ARCHIVE_RECORD_SIZE (8 + 4 * 8 + 4 * 4)
+
+/*
+ * Open the log in the given directory, creating it if needed, and start
+ * the writer thread. Returns -1 on error.
+ */
+int archive_init(const char *dir);
+
+/* Is the log kept? */
+int archive_enabled(void);
+
+/*
+ * Acquisition thread: buffer a measurement received at the given time.
+ * A time earlier than the previous one of the channel is stored as that
+ * one. If the writer thread lags too far behind, the measurement is
+ * dropped rather than waited for.
+ */
+void archive_store(int index, int64_t received, const AMEASURE *m);
+
+/* Acquisition thread: hand the buffered measurements to the writer. */
+void archive_flush(void);
+
+/*
+ * Write the measurements handed over, sync them, and stop the writer
+ * thread. Call this once the acquisition thread has stopped.
+ */
+void archive_stop(void);
+
+/*
+ * Reader thread: call fn() on each sample of the channel received between `since' and
+ * `until' (ns since the epoch, inclusive) that has been written to the
+ * log. Returns the number of samples.
+ */
+typedef void archive_fn(void *arg, int64_t received, const AMEASURE *m);
+size_t archive_query(int index, int64_t since, int64_t until,
+        archive_fn *fn, void *arg);
+
+/* A range of a segment file, holding consecutive records. */
+typedef struct {
+    int fd;             /* open on the file, for the caller to close */
+    size_t offset;
+    size_t length;
+} archive_range_t;
+
+/*
+ * Reader thread: locate the records of a time range, for sending them
+ * as they are.
+ * Their pages are read into the page cache beforehand. Stores in
+ * *ranges a malloc()ed array of ranges, at most `max_bytes' long in
+ * total, and returns their number.
+ */
+int archive_export(int index, int64_t since, int64_t until,
+        size_t max_bytes, archive_range_t **ranges);
@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Benchmark of the measurement history of history.c: fill it with the
+ * samples of several channels over some days, as the simulated TRMC2
+ * would produce them, then report the memory used per sample and the
+ * throughput of time-range queries.
+ *
+ * The samples are a slowly drifting noisy resistance, read every
+ * 100 ms with a few tens of microseconds of jitter on the receive time.
+ * Thus, there is at most one sample per read, at 10 Hz.
+ * The converted value is a function of the raw one, and the ranges, the
+ * status and the TRMC2 time step do not change, as with a real channel.
+ *
+ * The queries are timed with a callback that only counts the samples.
+ * Then they are run again, and every sample read back is checked
+ * against the one that was stored: the program fails on any
+ * discrepancy.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <Trmc.h>
+#include "../history.h"
+
+static const char usage[] =
+"Usage: histbench [-c channels] [-r rate] [-d days] [-m megabytes]\n"
+"                 [-q queries] [-w seconds]\n"
+"Options:\n"
+"    -c count    number of channels (default: 8)\n"
+"    -r rate     samples per second per channel, up to 10 (default: 10)\n"
+"    -d days     duration of the history (default: 7)\n"
+"    -m size     memory budget, in megabytes (default: 4096)\n"
+"    -q count    number of queries (default: 1000)\n"
+"    -w seconds  time range of each query (default: 3600)\n";
+
+#define unused(x) x __attribute__((unused))
+
+/* Receive time of the first sample: 2026-01-01, in ns. */
+#define START INT64_C(1767225600000000000)
+
+static int channels = 8;
+static double rate = 10;
+
+/* A hash of the sample, giving reproducible noise. */
+static uint64_t mix(uint64_t x)
+{
+    x += UINT64_C(0x9e3779b97f4a7c15);
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+}
+
+static double uniform(uint64_t x)
+{
+    return (mix(x) >> 11) * 0x1p-53;
+}
+
+/* The i-th sample of the channel, and its receive time. */
+static int64_t make_sample(int channel, long i, AMEASURE *m)
+{
+    uint64_t key = (uint64_t) channel << 40 | i;
+    double t = i / rate;
+    double base = 1000.0 * (channel + 1);
+    double raw = base * (1 + 0.01 * sin(2 * M_PI * t / 600))
+        + base * 1e-4 * (uniform(key) - 0.5);
+
+    m->MeasureRaw = raw;
+    m->Measure = 1 / log(raw);
+    m->ValueRangeI = 1e-9;
+    m->ValueRangeV = 2e-3;
+    m->Time = (long) (t * 1000);
+    m->Status = 0;
+    m->Number = i + 1;
+    m->Nothing = 0;
+
+    /* Read at the next 100 ms tick, plus some jitter. */
+    int64_t tick = ceil(t * 10) * 100000000;
+    return START + tick + (int64_t) (uniform(~key) * 50000) * 1000;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Check the samples returned by a query against the stored ones. */
+typedef struct {
+    int channel;
+    long next;          /* index of the expected sample */
+    long errors;
+} check_t;
+
+static void check_sample(void *arg, int64_t received, const AMEASURE *m)
+{
+    check_t *c = arg;
+    AMEASURE expected;
+    int64_t t = make_sample(c->channel, c->next++, &expected);
+
+    if (received != t / 1000 * 1000
+            || memcmp(m, &expected, sizeof expected) != 0)
+        c->errors++;
+}
+
+static void count_sample(void *arg, unused(int64_t received),
+        unused(const AMEASURE *m))
+{
+    ++*(long *) arg;
+}
+
+/* Run the queries, checking the samples if asked. Returns the errors. */
+static long run_queries(long queries, long first, long last, long span,
+        int check_samples, long *returned)
+{
+    long errors = 0;
+
+    srand(1);
+    for (long q = 0; q < queries; q++) {
+        check_t check;
+        AMEASURE m;
+        long count = 0;
+        check.channel = rand() % channels;
+        check.next = first + (long) ((double) rand() / RAND_MAX
+                * (last - first - span));
+        check.errors = 0;
+        int64_t since = make_sample(check.channel, check.next, &m);
+        int64_t until = make_sample(check.channel, check.next + span - 1,
+                &m);
+        size_t n = history_query(check.channel, since / 1000 * 1000,
+                until / 1000 * 1000,
+                check_samples ? check_sample : count_sample,
+                check_samples ? (void *) &check : &count);
+        *returned += n;
+        if (check.errors || n != (size_t) span) errors++;
+    }
+    return errors;
+}
+
+int main(int argc, char *argv[])
+{
+    double days = 7, megabytes = 4096, window = 3600;
+    long queries = 1000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:r:d:m:q:w:h")) != -1) switch (opt) {
+        case 'c': channels = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': days = atof(optarg); break;
+        case 'm': megabytes = atof(optarg); break;
+        case 'q': queries = atol(optarg); break;
+        case 'w': window = atof(optarg); break;
+        case 'h':
+            fputs(usage, stdout);
+            return EXIT_SUCCESS;
+        default:
+            fputs(usage, stderr);
+            return EXIT_FAILURE;
+    }
+    if (channels < 1 || rate <= 0 || rate > 10 || days <= 0
+            || megabytes <= 0 || queries < 1 || window <= 0) {
+        fputs(usage, stderr);
+        return EXIT_FAILURE;
+    }
+
+    /* Store the samples in time order, interleaving the channels. */
+    long per_channel = days * 86400 * rate;
+    history_init(megabytes * 1e6);
+    double t0 = now();
+    for (long i = 0; i < per_channel; i++)
+        for (int c = 0; c < channels; c++) {
+            AMEASURE m;
+            int64_t received = make_sample(c, i, &m);
+            history_store(c, received, &m);
+        }
+    double store_time = now() - t0;
+    uint64_t held = history_samples();
+    size_t memory = history_memory();
+
+    printf("%d channels at %g Hz for %g days: %ld samples stored, "
+            "%" PRIu64 " held\n", channels, rate, days,
+            per_channel * channels, held);
+    printf("memory: %.1f MB, %.2f bytes/sample "
+            "(%zu bytes uncompressed)\n", memory / 1e6,
+            (double) memory / held, sizeof (int64_t) + sizeof (AMEASURE));
+    printf("store: %.1f ns/sample\n",
+            store_time * 1e9 / (per_channel * channels));
+
+    /* Random time ranges among the samples held. */
+    long first = per_channel - held / channels;
+    long span = window * rate;
+    if (span > per_channel - first) span = per_channel - first;
+    long returned = 0;
+    t0 = now();
+    run_queries(queries, first, per_channel, span, 0, &returned);
+    double query_time = now() - t0;
+    printf("query of %g s: %.1f us/query, %.1f Msamples/s\n", window,
+            query_time * 1e6 / queries, returned / query_time / 1e6);
+    long errors = run_queries(queries, first, per_channel, span, 1,
+            &returned);
+
+    if (errors) {
+        printf("%ld queries returned wrong samples\n", errors);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
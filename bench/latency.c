@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Latency test of trmc2d: check that the commands that do not call
+ * libtrmc2 are not held up by the ones that do.
+ *
+ * Opens two connections to a daemon whose libtrmc2 calls are slow. On
+ * the first one, a thread keeps `depth' raw ReadValue commands in
+ * flight, so that the acquisition thread is always busy. On the second
+ * one, once the first of them is answered, *idn? is sent repeatedly,
+ * waiting for each answer. The test fails if the 99th percentile of
+ * the *idn? round trips exceeds the limit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const char usage[] =
+"Usage: latency -u name [-n count] [-d depth] [-l limit] [-T]\n"
+"Options:\n"
+"    -u name     connect to the Unix domain socket with that name\n"
+"    -n count    number of *idn? commands (default: 100)\n"
+"    -d depth    ReadValue commands in flight (default: 4)\n"
+"    -l limit    maximum 99th percentile of the *idn? round trips, in\n"
+"                microseconds (default: 2000)\n"
+"    -T          terminate the daemon at the end\n";
+
+static int depth = 4;
+static atomic_long answered;
+
+/* Connect to the daemon, giving it some time to listen(). */
+static int connect_to(const char *socket_name)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, socket_name, sizeof addr.sun_path - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) { perror("socket"); return -1; }
+    for (int tries = 0;; tries++) {
+        if (connect(fd, (struct sockaddr *) &addr, sizeof addr) == 0)
+            return fd;
+        if ((errno != ENOENT && errno != ECONNREFUSED) || tries == 50)
+            break;
+        nanosleep(&(struct timespec) {0, 20000000}, NULL);
+    }
+    perror(socket_name);
+    close(fd);
+    return -1;
+}
+
+/* Keep the acquisition thread busy until the connection is shut down. */
+static void *keep_busy(void *arg)
+{
+    int fd = *(int *) arg;
+    char buffer[4096];
+
+    for (int i = 0; i < depth; i++)
+        dprintf(fd, "ReadValue 1,0\n");
+    for (;;) {
+        ssize_t n = read(fd, buffer, sizeof buffer);
+        if (n <= 0) return NULL;
+        for (ssize_t i = 0; i < n; i++)
+            if (buffer[i] == '\n') {
+                atomic_fetch_add(&answered, 1);
+                dprintf(fd, "ReadValue 1,0\n");
+            }
+    }
+}
+
+/* Send *idn? and wait for the answer. Returns the round trip in us. */
+static double probe(int fd)
+{
+    struct timespec sent, received;
+    char c;
+
+    clock_gettime(CLOCK_MONOTONIC, &sent);
+    dprintf(fd, "*idn?\n");
+    do {
+        if (read(fd, &c, 1) != 1) {
+            fputs("Connection closed by trmc2d\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+    } while (c != '\n');
+    clock_gettime(CLOCK_MONOTONIC, &received);
+    return (received.tv_sec - sent.tv_sec) * 1e6
+        + (received.tv_nsec - sent.tv_nsec) * 1e-3;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *socket_name = NULL;
+    int count = 100, terminate = 0;
+    double limit = 2000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:n:d:l:Th")) != -1) switch (opt) {
+        case 'u': socket_name = optarg; break;
+        case 'n': count = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        case 'l': limit = atof(optarg); break;
+        case 'T': terminate = 1; break;
+        case 'h':
+            fputs(usage, stdout);
+            return EXIT_SUCCESS;
+        default:
+            fputs(usage, stderr);
+            return EXIT_FAILURE;
+    }
+    if (!socket_name || count < 1 || depth < 1 || limit <= 0) {
+        fputs(usage, stderr);
+        return EXIT_FAILURE;
+    }
+
+    int busy = connect_to(socket_name);
+    int fd = busy == -1 ? -1 : connect_to(socket_name);
+    if (fd == -1) return EXIT_FAILURE;
+    pthread_t thread;
+    pthread_create(&thread, NULL, keep_busy, &busy);
+    while (atomic_load(&answered) == 0)
+        nanosleep(&(struct timespec) {0, 1000000}, NULL);
+
+    /* Probe every 5 ms while the reads go on. */
+    double *latencies = malloc(count * sizeof *latencies);
+    if (!latencies) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    long answered_before = atomic_load(&answered);
+    for (int i = 0; i < count; i++) {
+        latencies[i] = probe(fd);
+        nanosleep(&(struct timespec) {0, 5000000}, NULL);
+    }
+    long answered_during = atomic_load(&answered) - answered_before;
+
+    if (terminate) dprintf(fd, "terminate\n");
+    shutdown(busy, SHUT_RDWR);
+    pthread_join(thread, NULL);
+
+    qsort(latencies, count, sizeof *latencies, compare_doubles);
+    double p99 = latencies[(int) (0.99 * (count - 1))];
+    printf("*idn?: p50 %.1f us, p99 %.1f us, max %.1f us; "
+            "%ld ReadValue answered meanwhile\n", latencies[count / 2],
+            p99, latencies[count - 1], answered_during);
+    if (p99 > limit) {
+        printf("p99 above the limit of %.1f us\n", limit);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,441 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Load generator for trmc2d.
+ *
+ * Opens several connections to a running trmc2d and, on each of them,
+ * keeps sending commands drawn at random from a weighted mix, with up
+ * to `depth' commands in flight. Every command is tagged (see "Tagged
+ * commands" in doc/protocol.html), which is how the replies are
+ * matched to the requests, even if they come back out of order. At the
+ * end, it reports the throughput and the latency percentiles of each
+ * command class.
+ *
+ * Only commands with single-line replies are used: a tagged command is
+ * complete when a line carrying its tag comes back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const char usage[] =
+"Usage: loadgen [-u name | [-H host] [-p port]] [-c count] [-d depth]\n"
+"               [-t seconds] [-k channels] [-m mix] [-i command] [-T]\n"
+"Options:\n"
+"    -u name     connect to the Unix domain socket with that name\n"
+"    -H host     connect to that host (default: localhost)\n"
+"    -p port     connect to that TCP port (default: 5025)\n"
+"    -c count    number of connections (default: 1)\n"
+"    -d depth    commands in flight per connection (default: 1, i.e.\n"
+"                no pipelining)\n"
+"    -t seconds  duration of the test (default: 5)\n"
+"    -k count    number of channels addressed (default: 8)\n"
+"    -m mix      weights of the command classes, e.g. idn=1,measure=4\n"
+"                classes: idn, measure, config, set, raw\n"
+"    -i command  send this command before the test (can be repeated)\n"
+"    -T          terminate the daemon at the end\n";
+
+/* Command classes. */
+enum { IDN, MEASURE, CONFIG, SET, RAW, CLASS_COUNT };
+
+static const struct {
+    const char *name;       /* for -m and the report */
+    const char *format;     /* %d is the channel index */
+    int weight;             /* default */
+} classes[CLASS_COUNT] = {
+    [IDN]     = {"idn",     "*idn?",                    1},
+    [MEASURE] = {"measure", "channel%d:measure?",       4},
+    [CONFIG]  = {"config",  "channel%d:config?",        2},
+    [SET]     = {"set",     "channel%d:polling 1",      1},
+    [RAW]     = {"raw",     "ReadValue 1,%d",           2},
+};
+
+#define MAX_DEPTH 64
+#define BUFFER_SIZE 65536
+
+/* A command waiting for its reply. */
+typedef struct {
+    unsigned int tag;
+    int class;
+    struct timespec sent;
+} request_t;
+
+/* A connection to the daemon. */
+typedef struct {
+    int fd;
+    unsigned int next_tag;
+    int in_flight;
+    request_t pending[MAX_DEPTH];
+    char output[BUFFER_SIZE];
+    size_t output_len;
+    char input[BUFFER_SIZE];
+    size_t input_len;
+} connection_t;
+
+/* Latencies, in microseconds, per command class. */
+static struct {
+    double *samples;
+    size_t count;
+    size_t allocated;
+    size_t errors;
+} stats[CLASS_COUNT];
+
+static int weights[CLASS_COUNT];
+static int total_weight;
+static int channel_count = 8;
+
+static double elapsed_us(const struct timespec *from,
+        const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1e6
+        + (to->tv_nsec - from->tv_nsec) * 1e-3;
+}
+
+static void record(int class, double latency, int error)
+{
+    if (stats[class].count == stats[class].allocated) {
+        stats[class].allocated = stats[class].allocated ?
+            2 * stats[class].allocated : 4096;
+        stats[class].samples = realloc(stats[class].samples,
+                stats[class].allocated * sizeof(double));
+        if (!stats[class].samples) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    stats[class].samples[stats[class].count++] = latency;
+    if (error) stats[class].errors++;
+}
+
+/* Parse the -m option. Returns -1 on error. */
+static int parse_mix(char *mix)
+{
+    for (int i = 0; i < CLASS_COUNT; i++) weights[i] = 0;
+    for (char *item = strtok(mix, ","); item; item = strtok(NULL, ",")) {
+        char *value = strchr(item, '=');
+        int i;
+        if (!value) return -1;
+        *value++ = '\0';
+        for (i = 0; i < CLASS_COUNT; i++)
+            if (strcmp(item, classes[i].name) == 0) break;
+        if (i == CLASS_COUNT) return -1;
+        weights[i] = atoi(value);
+    }
+    return 0;
+}
+
+/* Connect to the daemon. Returns -1 on error. */
+static int connect_to(const char *socket_name, const char *host,
+        const char *port)
+{
+    int fd;
+
+    if (socket_name) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        strncpy(addr.sun_path, socket_name, sizeof addr.sun_path - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) { perror("socket"); return -1; }
+
+        /* Give a daemon that was just started some time to listen(). */
+        for (int tries = 0;; tries++) {
+            if (connect(fd, (struct sockaddr *) &addr, sizeof addr) == 0)
+                return fd;
+            if ((errno != ENOENT && errno != ECONNREFUSED) || tries == 50)
+                break;
+            nanosleep(&(struct timespec) {0, 20000000}, NULL);
+        }
+        perror(socket_name);
+        close(fd);
+        return -1;
+    }
+
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *res;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd == -1) {
+        perror("socket");
+    } else if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+        perror(host);
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/* Queue a tagged command in the connection output buffer. */
+static void queue_command(connection_t *c, int class)
+{
+    request_t *r = &c->pending[c->in_flight++];
+    char command[64];
+
+    snprintf(command, sizeof command, classes[class].format,
+            rand() % channel_count);
+    r->tag = c->next_tag++;
+    r->class = class;
+    clock_gettime(CLOCK_MONOTONIC, &r->sent);
+    c->output_len += snprintf(c->output + c->output_len,
+            BUFFER_SIZE - c->output_len, "#%u %s\n", r->tag, command);
+}
+
+/* Pick a command class at random, as per the weights. */
+static int random_class(void)
+{
+    int n = rand() % total_weight;
+    int i = 0;
+    while (n >= weights[i]) n -= weights[i++];
+    return i;
+}
+
+/* Handle a reply line. Returns 0 if it does not match a request. */
+static int handle_line(connection_t *c, const char *line,
+        const struct timespec *now)
+{
+    char *end;
+    unsigned long tag;
+
+    if (line[0] != '#') return 0;
+    tag = strtoul(line + 1, &end, 10);
+    for (int i = 0; i < c->in_flight; i++) {
+        request_t *r = &c->pending[i];
+        if (r->tag != tag) continue;
+        record(r->class, elapsed_us(&r->sent, now),
+                strncmp(end, " ERROR:", 7) == 0);
+        *r = c->pending[--c->in_flight];
+        return 1;
+    }
+    return 0;
+}
+
+/* Send as much output as the socket accepts. Returns -1 on error. */
+static int flush_output(connection_t *c)
+{
+    while (c->output_len) {
+        ssize_t n = write(c->fd, c->output, c->output_len);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            perror("write");
+            return -1;
+        }
+        memmove(c->output, c->output + n, c->output_len - n);
+        c->output_len -= n;
+    }
+    return 0;
+}
+
+/* Read and handle the replies. Returns -1 on error or disconnect. */
+static int read_replies(connection_t *c)
+{
+    for (;;) {
+        ssize_t n = read(c->fd, c->input + c->input_len,
+                BUFFER_SIZE - c->input_len - 1);
+        if (n == 0) {
+            fputs("Connection closed by trmc2d\n", stderr);
+            return -1;
+        }
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            perror("read");
+            return -1;
+        }
+        c->input_len += n;
+        c->input[c->input_len] = '\0';
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        char *line = c->input, *eol;
+        while ((eol = strchr(line, '\n'))) {
+            *eol = '\0';
+            if (eol > line && eol[-1] == '\r') eol[-1] = '\0';
+            handle_line(c, line, &now);
+            line = eol + 1;
+        }
+        c->input_len -= line - c->input;
+        memmove(c->input, line, c->input_len);
+    }
+}
+
+/* Send a command and wait for its reply, before the test starts. */
+static int run_setup_command(int fd, const char *command)
+{
+    char buffer[BUFFER_SIZE];
+    size_t len = 0;
+
+    dprintf(fd, "#setup %s\n", command);
+    for (;;) {
+        ssize_t n = read(fd, buffer + len, sizeof buffer - len - 1);
+        if (n <= 0) {
+            perror("read");
+            return -1;
+        }
+        len += n;
+        buffer[len] = '\0';
+        if (strstr(buffer, "\n")) break;
+    }
+    if (strstr(buffer, "ERROR"))
+        fprintf(stderr, "%s: %s", command, buffer + strlen("#setup "));
+    return 0;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Percentile of sorted samples. */
+static double percentile(const double *v, size_t n, double p)
+{
+    size_t i = p * n;
+    if (i >= n) i = n - 1;
+    return v[i];
+}
+
+static void report(double seconds, int connection_count, int depth)
+{
+    size_t total = 0, errors = 0;
+
+    printf("%d connection(s), pipeline depth %d, %.1f s\n",
+            connection_count, depth, seconds);
+    printf("%-8s %10s %8s %10s %10s %10s %10s\n", "command", "count",
+            "errors", "p50 (us)", "p99 (us)", "p999 (us)", "max (us)");
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        size_t n = stats[i].count;
+        double *v = stats[i].samples;
+        if (!n) continue;
+        qsort(v, n, sizeof *v, compare_doubles);
+        printf("%-8s %10zu %8zu %10.1f %10.1f %10.1f %10.1f\n",
+                classes[i].name, n, stats[i].errors,
+                percentile(v, n, 0.5), percentile(v, n, 0.99),
+                percentile(v, n, 0.999), v[n - 1]);
+        total += n;
+        errors += stats[i].errors;
+    }
+    printf("%-8s %10zu %8zu   throughput: %.0f commands/s\n", "total",
+            total, errors, total / seconds);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *socket_name = NULL, *host = "localhost", *port = "5025";
+    int connection_count = 1, depth = 1, terminate = 0;
+    double duration = 5;
+    const char *setup[16];
+    int setup_count = 0;
+    int opt;
+
+    for (int i = 0; i < CLASS_COUNT; i++) weights[i] = classes[i].weight;
+    while ((opt = getopt(argc, argv, "u:H:p:c:d:t:k:m:i:Th")) != -1)
+            switch (opt) {
+        case 'u': socket_name = optarg; break;
+        case 'H': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'c': connection_count = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        case 't': duration = atof(optarg); break;
+        case 'k': channel_count = atoi(optarg); break;
+        case 'm':
+            if (parse_mix(optarg) == -1) {
+                fprintf(stderr, "Invalid mix\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            if (setup_count < 16) setup[setup_count++] = optarg;
+            break;
+        case 'T': terminate = 1; break;
+        case 'h':
+            fputs(usage, stdout);
+            return EXIT_SUCCESS;
+        default:
+            fputs(usage, stderr);
+            return EXIT_FAILURE;
+    }
+    total_weight = 0;
+    for (int i = 0; i < CLASS_COUNT; i++) total_weight += weights[i];
+    if (connection_count < 1 || depth < 1 || depth > MAX_DEPTH
+            || channel_count < 1 || total_weight <= 0 || duration <= 0) {
+        fputs(usage, stderr);
+        return EXIT_FAILURE;
+    }
+
+    /* Connect. */
+    connection_t *connections = calloc(connection_count,
+            sizeof *connections);
+    int ep = epoll_create1(0);
+    if (!connections || ep == -1) {
+        perror("setup");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < connection_count; i++) {
+        connection_t *c = &connections[i];
+        c->fd = connect_to(socket_name, host, port);
+        if (c->fd == -1) return EXIT_FAILURE;
+    }
+    for (int i = 0; i < setup_count; i++)
+        if (run_setup_command(connections[0].fd, setup[i]) == -1)
+            return EXIT_FAILURE;
+    for (int i = 0; i < connection_count; i++) {
+        connection_t *c = &connections[i];
+        struct epoll_event ev = {EPOLLIN | EPOLLOUT | EPOLLET, {.ptr = c}};
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+            perror("epoll_ctl");
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Run. */
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int sending = 1, in_flight = 0;
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (elapsed_us(&start, &now) >= duration * 1e6) sending = 0;
+        for (int i = 0; i < connection_count; i++) {
+            connection_t *c = &connections[i];
+            while (sending && c->in_flight < depth)
+                queue_command(c, random_class());
+            if (flush_output(c) == -1) return EXIT_FAILURE;
+        }
+
+        struct epoll_event events[64];
+        int n = epoll_wait(ep, events, 64, 100);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            return EXIT_FAILURE;
+        }
+        if (n == 0 && !sending) break;  /* replies lost */
+        for (int i = 0; i < n; i++)
+            if (read_replies(events[i].data.ptr) == -1)
+                return EXIT_FAILURE;
+        in_flight = 0;
+        for (int i = 0; i < connection_count; i++)
+            in_flight += connections[i].in_flight;
+    } while (sending || in_flight);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    report(elapsed_us(&start, &now) * 1e-6, connection_count, depth);
+    if (in_flight)
+        printf("%d command(s) never answered\n", in_flight);
+
+    if (terminate) {
+        connection_t *c = &connections[0];
+        c->output_len = snprintf(c->output, BUFFER_SIZE, "terminate\n");
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+        flush_output(c);
+    }
+    return EXIT_SUCCESS;
+}
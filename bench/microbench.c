@@ -0,0 +1,557 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Microbenchmarks of the per-command path of trmc2d: framing by
+ * get_command(), parsing by parse(), execution of the handlers, and
+ * formatting of the measurements by queue_measurement().
+ *
+ * The interpreter is included rather than linked, in order to reach
+ * its static functions, and the handlers are run inline, as in the
+ * acquisition thread. libtrmc2 is replaced by trivial stubs returning
+ * fixed values, so that only the cost of trmc2d itself is measured.
+ *
+ * Each benchmark runs for about 0.1 s, five times, and the best time is
+ * reported in nanoseconds per operation. With -b file, the results are
+ * compared to a baseline written earlier with -w file, and the program
+ * fails if any benchmark is slower than the baseline by more than the
+ * tolerance (-t percent, default 20).
+ *
+ * The heap allocations are counted too, through the linker's --wrap
+ * option. The program fails if any of the benchmarks that should not
+ * allocate in the steady state (marked below) does.
+ *
+ * The number conversions of number.c are timed against printf() and
+ * strtod(). Beforehand, they are checked against them on random
+ * doubles, and the program fails on any discrepancy.
+ */
+
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include "../interpreter.c"
+
+static const char usage[] =
+"Usage: microbench [-b baseline] [-w baseline] [-t percent] [-f filter]\n"
+"Options:\n"
+"    -b file     compare with the baseline stored in that file\n"
+"    -w file     store the results as a baseline in that file\n"
+"    -t percent  tolerance before flagging a regression (default: 20)\n"
+"    -f text     only run the benchmarks whose name contains text\n";
+
+
+/***********************************************************************
+ * Allocation counting.
+ */
+
+static atomic_long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_realloc(p, size);
+}
+
+
+/***********************************************************************
+ * libtrmc2 stubs.
+ */
+
+static const AMEASURE stub_measure = {
+    1234.56789, 0.0123456789, 1e-9, 2e-3, 123456, 0, 42, 0
+};
+
+int StartTRMC(unused(INITSTRUCTURE *init)) { return 0; }
+int StopTRMC(void) { return 0; }
+
+int GetSynchroneousErrorTRMC(ERRORS *errors)
+{
+    memset(errors, 0, sizeof *errors);
+    return 0;
+}
+
+int GetNumberOfChannelTRMC(int *count) { *count = 8; return 0; }
+int GetNumberOfBoardTRMC(int *count) { *count = 4; return 0; }
+
+int GetChannelTRMC(unused(int bywhat), CHANNELPARAMETER *channel)
+{
+    int index = channel->Index;
+    memset(channel, 0, sizeof *channel);
+    channel->Index = index;
+    channel->ValueRangeI = 1e-9;
+    channel->ValueRangeV = 2e-3;
+    channel->PreAveraging = 1;
+    channel->FifoSize = 16;
+    return 0;
+}
+
+int SetChannelTRMC(unused(CHANNELPARAMETER *channel)) { return 0; }
+
+int GetRegulationTRMC(REGULPARAMETER *regul)
+{
+    int index = regul->Index;
+    memset(regul, 0, sizeof *regul);
+    regul->Index = index;
+    for (int i = 0; i < _NB_REGULATING_CHANNEL; i++)
+        regul->IndexofChannel[i] = _EMPTY_CHANNEL;
+    return 0;
+}
+
+int SetRegulationTRMC(unused(REGULPARAMETER *regul)) { return 0; }
+
+int GetBoardTRMC(unused(int bywhat), BOARDPARAMETER *board)
+{
+    int index = board->Index;
+    memset(board, 0, sizeof *board);
+    board->Index = index;
+    return 0;
+}
+
+int SetBoardTRMC(unused(BOARDPARAMETER *board)) { return 0; }
+
+int ReadValueTRMC(unused(int index), AMEASURE *measure)
+{
+    *measure = stub_measure;
+    return 2;
+}
+
+int FlushFifoTRMC(unused(int index)) { return 0; }
+
+
+/***********************************************************************
+ * Benchmarks.
+ */
+
+/* Client receiving all the output, which is discarded periodically. */
+static client_t *client;
+
+static void discard_output(void)
+{
+    static char *sink;
+    static size_t sink_size;
+
+    if (client->output_pending > sink_size) {
+        sink_size = 2 * client->output_pending;
+        sink = realloc(sink, sink_size);
+        if (!sink) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    take_output(client, sink);
+}
+
+/* Batch of pipelined commands, as received by a single read(). */
+#define BATCH 1000
+static char *batch;
+static size_t batch_size;
+
+static void bench_get_command(long n, unused(const void *arg))
+{
+    long done = 0;
+    while (done < n) {
+        memcpy(client->input_buffer, batch, batch_size + 1);
+        client->input_start = client->input_scan = 0;
+        client->input_end = batch_size;
+        while (get_command(client)) done++;
+    }
+}
+
+/* Copy of trmc2_syntax with all the handlers doing nothing. */
+static syntax_tree *noop_syntax;
+
+static int noop(unused(void *data), unused(int cmd_data),
+        unused(parsed_command *cmd))
+{
+    return 0;
+}
+
+static syntax_tree *copy_syntax(const syntax_tree *tree)
+{
+    int n = 0;
+    while (tree[n].name) n++;
+    syntax_tree *copy = malloc((n + 1) * sizeof *copy);
+    if (!copy) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i <= n; i++) {
+        copy[i] = tree[i];
+        if (tree[i].handler) copy[i].handler = noop;
+        if (tree[i].child) copy[i].child = copy_syntax(tree[i].child);
+    }
+    return copy;
+}
+
+/* parse() modifies the command: work on a fresh copy each time. */
+static void bench_parse(long n, const void *arg)
+{
+    char line[256];
+    size_t len = strlen(arg) + 1;
+    for (long i = 0; i < n; i++) {
+        memcpy(line, arg, len);
+        parse(line, noop_syntax, client);
+    }
+}
+
+static void bench_execute(long n, const void *arg)
+{
+    char line[256];
+    size_t len = strlen(arg) + 1;
+    for (long i = 0; i < n; i++) {
+        memcpy(line, arg, len);
+        execute_command(client, line);
+        if (client->output_pending > 65536) discard_output();
+    }
+    discard_output();
+}
+
+/* Execute through the acquisition thread, waiting for each reply. */
+static void bench_roundtrip(long n, const void *arg)
+{
+    char line[256];
+    size_t len = strlen(arg) + 1;
+
+    in_acquisition_thread = 0;
+    for (long i = 0; i < n; i++) {
+        memcpy(line, arg, len);
+        execute_command(client, line);
+        while (client->in_flight) {
+            struct pollfd pfd = {acquisition_fd(), POLLIN, 0};
+            poll(&pfd, 1, -1);
+            deliver_results(NULL);
+        }
+        if (client->output_pending > 65536) discard_output();
+    }
+    discard_output();
+    in_acquisition_thread = 1;
+}
+
+static const char format_full[] = { RAW, MEAS, TIME, STATUS, NUMBER, 0 };
+
+static void bench_measurement(long n, const void *arg)
+{
+    AMEASURE m = stub_measure;
+    for (long i = 0; i < n; i++) {
+        queue_measurement(client, 3, arg, &m, 2);
+        if (client->output_pending > 65536) discard_output();
+    }
+    discard_output();
+}
+
+/* Doubles and their text, for the conversion benchmarks. */
+#define SAMPLES 1024
+static double samples[SAMPLES];
+static char sample_text[SAMPLES][NUMBER_LENGTH];
+static volatile long sink;
+
+static const int shortest = 0, six_digits = 6;
+
+static void bench_format_double(long n, const void *arg)
+{
+    const int *precision = arg;
+    char text[NUMBER_LENGTH];
+    long total = 0;
+    for (long i = 0; i < n; i++)
+        total += format_double(text, samples[i % SAMPLES], *precision);
+    sink = total;
+}
+
+static void bench_snprintf(long n, const void *arg)
+{
+    char text[NUMBER_LENGTH];
+    long total = 0;
+    for (long i = 0; i < n; i++)
+        total += snprintf(text, sizeof text, arg, samples[i % SAMPLES]);
+    sink = total;
+}
+
+static void bench_parse_double(long n, unused(const void *arg))
+{
+    double total = 0;
+    for (long i = 0; i < n; i++)
+        total += parse_double(sample_text[i % SAMPLES]);
+    sink = total;
+}
+
+static void bench_strtod(long n, unused(const void *arg))
+{
+    double total = 0;
+    for (long i = 0; i < n; i++)
+        total += strtod(sample_text[i % SAMPLES], NULL);
+    sink = total;
+}
+
+static void set_binary(int on) { client->binary = on; }
+
+static const struct {
+    const char *name;
+    void (*run)(long n, const void *arg);
+    const void *arg;
+    int binary;
+    int no_alloc;       /* should not allocate in the steady state */
+} benchmarks[] = {
+    {"get_command", bench_get_command, NULL, 0, 1},
+    {"parse *idn?", bench_parse, "*idn?", 0, 1},
+    {"parse channel3:measure?", bench_parse, "channel3:measure?", 0, 1},
+    {"parse channel3:voltage:range 0.01", bench_parse,
+        "channel3:voltage:range 0.01", 0, 1},
+    {"parse regulation0:setpoint?", bench_parse,
+        "regulation0:setpoint?", 0, 1},
+    {"parse ReadValue 1,3", bench_parse, "ReadValue 1,3", 0, 1},
+    {"execute *idn?", bench_execute, "*idn?", 0, 1},
+    {"execute channel3:measure?", bench_execute, "channel3:measure?", 0, 1},
+    {"execute channel3:config?", bench_execute, "channel3:config?", 0, 1},
+    {"execute channel3:voltage:range 0.01", bench_execute,
+        "channel3:voltage:range 0.01", 0, 1},
+    {"execute regulation0:setpoint?", bench_execute,
+        "regulation0:setpoint?", 0, 1},
+    {"execute ReadValue 1,3", bench_execute, "ReadValue 1,3", 0, 1},
+    {"execute #7 channel3:measure?", bench_execute,
+        "#7 channel3:measure?", 0, 1},
+    {"roundtrip channel3:measure?", bench_roundtrip,
+        "channel3:measure?", 0, 1},
+    {"roundtrip #7 channel3:measure?", bench_roundtrip,
+        "#7 channel3:measure?", 0, 1},
+    {"queue_measurement raw", bench_measurement, format_raw, 0, 1},
+    {"queue_measurement raw,converted,time,status,number",
+        bench_measurement, format_full, 0, 1},
+    {"queue_measurement binary", bench_measurement, format_raw, 1, 1},
+    {"format_double shortest", bench_format_double, &shortest, 0, 1},
+    {"snprintf %.17g", bench_snprintf, "%.17g", 0, 1},
+    {"format_double precision 6", bench_format_double, &six_digits, 0, 1},
+    {"snprintf %g", bench_snprintf, "%g", 0, 1},
+    {"parse_double", bench_parse_double, NULL, 0, 1},
+    {"strtod", bench_strtod, NULL, 0, 1},
+};
+
+#define BENCHMARK_COUNT ((int) (sizeof benchmarks / sizeof *benchmarks))
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Best time of five runs of about 0.1 s each, in ns per operation.
+ * Also count the allocations of those runs, which come after the
+ * calibration has warmed up the caches and pools.
+ */
+static double measure_benchmark(int b, long *allocs)
+{
+    long n = 1000;
+    double best = 0;
+
+    set_binary(benchmarks[b].binary);
+
+    /* Calibrate. */
+    for (;;) {
+        double t = now_ns();
+        benchmarks[b].run(n, benchmarks[b].arg);
+        t = now_ns() - t;
+        if (t > 1e7) {
+            n = n * 1e8 / t;
+            break;
+        }
+        n *= 10;
+    }
+
+    long before = atomic_load(&allocations);
+    for (int run = 0; run < 5; run++) {
+        double t = now_ns();
+        benchmarks[b].run(n, benchmarks[b].arg);
+        t = (now_ns() - t) / n;
+        if (run == 0 || t < best) best = t;
+    }
+    *allocs = atomic_load(&allocations) - before;
+    return best;
+}
+
+/* xorshift64: reproducible random numbers. */
+static uint64_t random_bits(void)
+{
+    static uint64_t x = 88172645463325252u;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+/*
+ * Make the samples, which look like measurements, and check the
+ * conversions on them and on random doubles. Returns the number of
+ * discrepancies, which are printed.
+ */
+static int check_numbers(void)
+{
+    char text[NUMBER_LENGTH], reference[NUMBER_LENGTH];
+    int errors = 0;
+
+    for (int i = 0; i < SAMPLES; i++) {
+        samples[i] = (random_bits() % 100000000) * 1e-4
+            / (1 << random_bits() % 24);
+        snprintf(sample_text[i], NUMBER_LENGTH, "%.*g",
+                (int) (1 + random_bits() % MAX_PRECISION), samples[i]);
+    }
+    for (long i = 0; i < 1000000 && errors < 10; i++) {
+        uint64_t bits = random_bits();
+        double value;
+        if (i < SAMPLES) value = samples[i];
+        else memcpy(&value, &bits, sizeof value);
+        if (!isfinite(value)) continue;
+
+        /* The shortest text reads back exactly. */
+        format_double(text, value, 0);
+        double back = strtod(text, NULL);
+        if (memcmp(&back, &value, sizeof value) != 0) {
+            printf("format_double(%.17g) = %s\n", value, text);
+            errors++;
+        }
+
+        /* Rounded, it is printf's, at least for normal numbers. */
+        int precision = 1 + random_bits() % 15;
+        format_double(text, value, precision);
+        snprintf(reference, sizeof reference, "%.*g", precision, value);
+        if (isnormal(value) && strcmp(text, reference) != 0) {
+            printf("format_double(%.17g, %d) = %s, not %s\n",
+                    value, precision, text, reference);
+            errors++;
+        }
+
+        /* Reading gives strtod()'s result. */
+        snprintf(text, sizeof text, "%.*g",
+                (int) (1 + random_bits() % MAX_PRECISION), value);
+        double fast = parse_double(text), slow = strtod(text, NULL);
+        if (memcmp(&fast, &slow, sizeof fast) != 0) {
+            printf("parse_double(%s) = %.17g, not %.17g\n",
+                    text, fast, slow);
+            errors++;
+        }
+    }
+    return errors;
+}
+
+/* Look up a benchmark in the baseline file. Returns -1 if absent. */
+static double baseline_value(FILE *f, const char *name)
+{
+    char line[256];
+
+    rewind(f);
+    while (fgets(line, sizeof line, f)) {
+        char *tab = strrchr(line, '\t');
+        if (!tab) continue;
+        *tab = '\0';
+        if (strcmp(line, name) == 0) return atof(tab + 1);
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *baseline_name = NULL, *output_name = NULL;
+    const char *filter = NULL;
+    double tolerance = 20;
+    FILE *baseline = NULL, *output = NULL;
+    int regressions = 0, allocating = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:w:t:f:h")) != -1) switch (opt) {
+        case 'b': baseline_name = optarg; break;
+        case 'w': output_name = optarg; break;
+        case 't': tolerance = atof(optarg); break;
+        case 'f': filter = optarg; break;
+        case 'h':
+            fputs(usage, stdout);
+            return EXIT_SUCCESS;
+        default:
+            fputs(usage, stderr);
+            return EXIT_FAILURE;
+    }
+    if (baseline_name && !(baseline = fopen(baseline_name, "r"))) {
+        perror(baseline_name);
+        return EXIT_FAILURE;
+    }
+    if (output_name && !(output = fopen(output_name, "w"))) {
+        perror(output_name);
+        return EXIT_FAILURE;
+    }
+
+    /*
+     * Run the handlers inline, except for the roundtrip benchmarks, and
+     * record errors on the stack.
+     */
+    openlog("microbench", LOG_PERROR, LOG_USER);
+    if (start_acquisition() == -1) return EXIT_FAILURE;
+    in_acquisition_thread = 1;
+    client = new_client(-1, open("/dev/null", O_WRONLY));
+    noop_syntax = copy_syntax(trmc2_syntax);
+    if (!client) return EXIT_FAILURE;
+
+    /* A read()'s worth of pipelined measure commands. */
+    static const char command[] = "channel3:measure?\r\n";
+    batch_size = BATCH * (sizeof command - 1);
+    batch = malloc(batch_size + 1);
+    client->input_buffer = realloc(client->input_buffer, batch_size + 1);
+    if (!batch || !client->input_buffer) return EXIT_FAILURE;
+    client->input_size = batch_size + 1;
+    for (int i = 0; i < BATCH; i++)
+        memcpy(batch + i * (sizeof command - 1), command,
+                sizeof command - 1);
+    batch[batch_size] = '\0';
+
+    if (check_numbers()) {
+        printf("number conversions are wrong\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-52s %9s %9s %8s\n", "benchmark", "ns/op", "baseline",
+            "change");
+    for (int b = 0; b < BENCHMARK_COUNT; b++) {
+        const char *name = benchmarks[b].name;
+        if (filter && !strstr(name, filter)) continue;
+        long allocs;
+        double t = measure_benchmark(b, &allocs);
+        printf("%-52s %9.1f", name, t);
+        if (output) fprintf(output, "%s\t%.1f\n", name, t);
+        double ref = baseline ? baseline_value(baseline, name) : -1;
+        if (ref > 0) {
+            double change = 100 * (t - ref) / ref;
+            printf(" %9.1f %+7.1f%%", ref, change);
+            if (change > tolerance) {
+                printf("  REGRESSION");
+                regressions++;
+            }
+        }
+        if (allocs && benchmarks[b].no_alloc) {
+            printf("  ALLOCATES (%ld)", allocs);
+            allocating++;
+        }
+        putchar('\n');
+    }
+    stop_acquisition();
+
+    if (output) fclose(output);
+    if (regressions)
+        printf("%d regression(s) over %g%%\n", regressions, tolerance);
+    if (allocating)
+        printf("%d benchmark(s) allocating memory\n", allocating);
+    if (regressions || allocating)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Stress test of the sequence lock of the shared-memory table of shm.c.
+ *
+ * A writer thread publishes measurements with shm_publish() as fast as
+ * it can, going round a few channels, while reader threads copy them
+ * with trmc2d_shm_read() from a mapping of their own. All the fields of
+ * the n-th measurement of a channel are functions of n, which is also
+ * the sequence number of the slot: a copy mixing two measurements, or
+ * going back in time, is caught and counted. The program fails if
+ * there is any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <Trmc.h>
+#include "../trmc2d-shm.h"
+#include "../shm.h"
+
+static const char usage[] =
+"Usage: shmstress [-c channels] [-r readers] [-t seconds]\n"
+"Options:\n"
+"    -c count    number of channels written (default: 2)\n"
+"    -r count    number of reader threads (default: 3)\n"
+"    -t seconds  duration of the test (default: 5)\n";
+
+static int channels = 2;
+static atomic_int stop;
+static const char *name;
+
+/* The n-th measurement of a channel. */
+static void make_sample(int n, AMEASURE *m)
+{
+    m->MeasureRaw = n;
+    m->Measure = -n;
+    m->ValueRangeI = n * 0.5;
+    m->ValueRangeV = n + 0.25;
+    m->Time = n;
+    m->Status = ~n;
+    m->Number = n;
+    m->Nothing = 0;
+}
+
+/* Is the copy the n-th measurement of a channel, n being its sequence? */
+static int consistent(const trmc2d_sample *s)
+{
+    double n = s->sequence;
+    return s->raw == n && s->converted == -n && s->range_i == n * 0.5
+        && s->range_v == n + 0.25 && s->time == (int32_t) s->sequence
+        && s->status == ~(int32_t) s->sequence
+        && s->number == (int32_t) s->sequence;
+}
+
+static void *writer(void *arg)
+{
+    long *published = arg;
+    int n = 0;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)
+            && n < 0x7fffffff) {
+        AMEASURE m;
+        make_sample(++n, &m);
+        for (int c = 0; c < channels; c++)
+            shm_publish(c, &m);
+        *published += channels;
+    }
+    return NULL;
+}
+
+/* Reader thread: counts in result[0] the copies, in result[1] the bad. */
+static void *reader(void *arg)
+{
+    long *result = arg;
+    uint32_t last[TRMC2D_SHM_CHANNELS] = {0};
+    const trmc2d_shm *shm = trmc2d_shm_open(name);
+
+    if (!shm) {
+        perror(name);
+        result[1]++;
+        return NULL;
+    }
+    for (unsigned i = 0;
+            !atomic_load_explicit(&stop, memory_order_relaxed); i++) {
+        int c = i % channels;
+        trmc2d_sample s = {0};
+        long sequence = trmc2d_shm_read(shm, c, &s);
+        result[0]++;
+        if (sequence == 0) continue;
+        if (!consistent(&s) || s.sequence < last[c]) result[1]++;
+        last[c] = s.sequence;
+    }
+    trmc2d_shm_close(shm);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int readers = 3;
+    double duration = 5;
+    char buffer[64];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:r:t:h")) != -1) switch (opt) {
+        case 'c': channels = atoi(optarg); break;
+        case 'r': readers = atoi(optarg); break;
+        case 't': duration = atof(optarg); break;
+        case 'h':
+            fputs(usage, stdout);
+            return EXIT_SUCCESS;
+        default:
+            fputs(usage, stderr);
+            return EXIT_FAILURE;
+    }
+    if (channels < 1 || channels > TRMC2D_SHM_CHANNELS || readers < 1
+            || duration <= 0) {
+        fputs(usage, stderr);
+        return EXIT_FAILURE;
+    }
+
+    /* A name of our own, unlinked at exit by shm.c. */
+    snprintf(buffer, sizeof buffer, "/trmc2d-shmstress-%d", (int) getpid());
+    name = buffer;
+    if (shm_init(name) == -1) {
+        fprintf(stderr, "%s: cannot create the table\n", name);
+        return EXIT_FAILURE;
+    }
+
+    pthread_t threads[readers + 1];
+    long results[readers][2];
+    long published = 0;
+    for (int i = 0; i < readers; i++) {
+        results[i][0] = results[i][1] = 0;
+        pthread_create(&threads[i], NULL, reader, results[i]);
+    }
+    pthread_create(&threads[readers], NULL, writer, &published);
+    struct timespec ts = {duration, (duration - (long) duration) * 1e9};
+    while (nanosleep(&ts, &ts) == -1)
+        ;
+    atomic_store(&stop, 1);
+    long copied = 0, bad = 0;
+    for (int i = 0; i <= readers; i++)
+        pthread_join(threads[i], NULL);
+    for (int i = 0; i < readers; i++) {
+        copied += results[i][0];
+        bad += results[i][1];
+    }
+
+    printf("%d channel(s), %d reader(s), %g s\n", channels, readers,
+            duration);
+    printf("published: %.1f M/s, copied: %.1f M/s\n",
+            published / duration / 1e6, copied / duration / 1e6);
+    if (bad) {
+        printf("%ld inconsistent copies\n", bad);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
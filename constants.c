@@ -110,7 +110,7 @@ define const parse_errors[] = {
 const char *const_name(int value, const define *table)
 {
     int i;
-    static char buffer[256];
+    static __thread char buffer[256];  /* both threads use this */
 
     for (i = 0; table[i].name; i++)
         if (table[i].value == value) return table[i].name;
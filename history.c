@@ -0,0 +1,419 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * History of the measurements.
+ *
+ * The samples of a channel are stored in blocks of BLOCK_SAMPLES. A
+ * block is a structure of arrays: each field of the samples has its own
+ * column, a bit stream compressed as in Facebook's Gorilla:
+ *
+ *   - Integers (receive time, Time, Status, Number) are stored as the
+ *     difference between consecutive differences, in a variable-length
+ *     code: `0' for no change, then `10', `110', `1110', `11110' and
+ *     `11111' followed by 7, 9, 12, 32 and 64 bits.
+ *
+ *   - Doubles are XORed with the previous value: `0' if equal, `10' and
+ *     the meaningful bits if they fit in the window of the previous
+ *     XOR, else `11', 5 bits of leading zeros, 6 bits of length and the
+ *     meaningful bits.
+ *
+ * The first sample of a block is coded against zero, so that every
+ * block can be decoded on its own. A channel's block being filled lives
+ * in a scratch buffer large enough for the worst case; when full, it is
+ * copied to an allocation of its exact size. The headers of the full
+ * blocks, in time order, are searched by bisection to answer a query.
+ *
+ * When the memory used exceeds the budget, the oldest full block of all
+ * the channels is dropped.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <Trmc.h>
+#include "history.h"
+
+/* Channels that can have a history. */
+#define HISTORY_CHANNELS 256
+
+#define BLOCK_SAMPLES 1024
+
+/* Columns of a block: integers first, then doubles. */
+enum { COL_RECEIVED, COL_TIME, COL_STATUS, COL_NUMBER,
+    COL_RAW, COL_MEAS, COL_RANGEI, COL_RANGEV, COLUMNS };
+
+/* Worst case of a column, in 64-bit words: 77 bits per sample. */
+#define COLUMN_WORDS ((BLOCK_SAMPLES * 77 + 63) / 64)
+
+/* A column being written or read. */
+typedef struct {
+    uint64_t *words;
+    size_t bits;            /* position */
+} stream_t;
+
+/* State of the coder of a column, reset at the start of each block. */
+typedef struct {
+    uint64_t value;         /* previous value, or bits of the double */
+    uint64_t delta;         /* previous difference of the integers */
+    int leading, trailing;  /* window of the previous XOR */
+} coder_t;
+
+typedef struct {
+    int64_t first, last;        /* receive times, in us */
+    unsigned int count;
+    uint32_t offset[COLUMNS+1]; /* start of each column, in words */
+    uint64_t *data;
+} block_t;
+
+typedef struct {
+    block_t *blocks;        /* full blocks, from blocks[head] on */
+    size_t head, count, allocated;
+    block_t open;           /* block being filled, in `scratch' */
+    uint64_t *scratch;      /* COLUMN_WORDS per column */
+    stream_t streams[COLUMNS];
+    coder_t coders[COLUMNS];
+} history_t;
+
+static size_t budget;
+static size_t memory;       /* bytes allocated */
+static uint64_t samples;    /* samples held */
+static history_t histories[HISTORY_CHANNELS];
+
+/* Set the memory budget. */
+void history_init(size_t size)
+{
+    budget = size;
+}
+
+/* Is the history kept? */
+int history_enabled(void)
+{
+    return budget != 0;
+}
+
+size_t history_memory(void)
+{
+    return memory;
+}
+
+uint64_t history_samples(void)
+{
+    return samples;
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (!p) {
+        syslog(LOG_ERR, "realloc: %m\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+
+/***********************************************************************
+ * Bit streams and coders.
+ */
+
+/* Append the n low bits of v, 1 <= n <= 64, the others being zero. */
+static void put_bits(stream_t *s, uint64_t v, int n)
+{
+    size_t w = s->bits >> 6;
+    int room = 64 - (s->bits & 63);
+
+    if (room == 64) s->words[w] = 0;
+    if (n <= room) {
+        s->words[w] |= v << (room - n);
+    } else {
+        s->words[w] |= v >> (n - room);
+        s->words[w+1] = v << (64 - (n - room));
+    }
+    s->bits += n;
+}
+
+/* Read n bits, 1 <= n <= 64. */
+static uint64_t get_bits(stream_t *s, int n)
+{
+    size_t w = s->bits >> 6;
+    int left = 64 - (s->bits & 63);
+    uint64_t v;
+
+    if (n <= left) {
+        v = s->words[w] << (64 - left) >> (64 - n);
+    } else {
+        int more = n - left;
+        v = (s->words[w] & ((UINT64_C(1) << left) - 1)) << more
+            | s->words[w+1] >> (64 - more);
+    }
+    s->bits += n;
+    return v;
+}
+
+static void reset_coders(coder_t *coders)
+{
+    for (int i = 0; i < COLUMNS; i++)
+        coders[i] = (coder_t) {0, 0, 64, 64};
+}
+
+/* Sizes of the delta-of-delta codes after 1 to 5 leading ones. */
+static const int dod_bits[] = {7, 9, 12, 32, 64};
+
+static void encode_int(stream_t *s, coder_t *c, int64_t v)
+{
+    uint64_t delta = (uint64_t) v - c->value;
+    int64_t dod = delta - c->delta;
+    c->value = v;
+    c->delta = delta;
+
+    if (dod == 0) {
+        put_bits(s, 0, 1);
+        return;
+    }
+    for (int k = 1; k <= 5; k++) {
+        int n = dod_bits[k-1];
+        if (n < 64 && (dod < -(INT64_C(1) << (n-1))
+                    || dod >= INT64_C(1) << (n-1)))
+            continue;
+        if (k < 5)
+            put_bits(s, ((1 << k) - 1) << 1, k + 1);
+        else
+            put_bits(s, 0x1f, 5);
+        put_bits(s, n < 64 ? (uint64_t) dod & ((UINT64_C(1) << n) - 1)
+                : (uint64_t) dod, n);
+        return;
+    }
+}
+
+static int64_t decode_int(stream_t *s, coder_t *c)
+{
+    int k = 0;
+    while (k < 5 && get_bits(s, 1)) k++;
+    if (k) {
+        int n = dod_bits[k-1];
+        uint64_t v = get_bits(s, n);
+        int64_t dod = n < 64 ? (int64_t) (v << (64 - n)) >> (64 - n)
+            : (int64_t) v;
+        c->delta += dod;
+    }
+    c->value += c->delta;
+    return c->value;
+}
+
+static void encode_double(stream_t *s, coder_t *c, double d)
+{
+    uint64_t v;
+    memcpy(&v, &d, sizeof v);
+    uint64_t x = v ^ c->value;
+    c->value = v;
+
+    if (!x) {
+        put_bits(s, 0, 1);
+        return;
+    }
+    int leading = __builtin_clzll(x), trailing = __builtin_ctzll(x);
+    if (leading > 31) leading = 31;
+    if (leading >= c->leading && trailing >= c->trailing) {
+        put_bits(s, 2, 2);
+        put_bits(s, x >> c->trailing, 64 - c->leading - c->trailing);
+    } else {
+        int n = 64 - leading - trailing;
+        put_bits(s, 3, 2);
+        put_bits(s, leading, 5);
+        put_bits(s, n & 63, 6);
+        put_bits(s, x >> trailing, n);
+        c->leading = leading;
+        c->trailing = trailing;
+    }
+}
+
+static double decode_double(stream_t *s, coder_t *c)
+{
+    if (get_bits(s, 1)) {
+        if (get_bits(s, 1)) {
+            c->leading = get_bits(s, 5);
+            int n = get_bits(s, 6);
+            if (!n) n = 64;
+            c->trailing = 64 - c->leading - n;
+        }
+        int n = 64 - c->leading - c->trailing;
+        c->value ^= get_bits(s, n) << c->trailing;
+    }
+    double d;
+    memcpy(&d, &c->value, sizeof d);
+    return d;
+}
+
+
+/***********************************************************************
+ * Blocks.
+ */
+
+/* Start filling a new block. */
+static void open_block(history_t *h)
+{
+    h->open.count = 0;
+    for (int i = 0; i < COLUMNS; i++) {
+        h->streams[i].words = h->scratch + i * COLUMN_WORDS;
+        h->streams[i].bits = 0;
+    }
+    reset_coders(h->coders);
+}
+
+/* Move the full block out of the scratch buffer. */
+static void close_block(history_t *h)
+{
+    block_t *b = &h->open;
+    size_t words = 0;
+    for (int i = 0; i < COLUMNS; i++) {
+        b->offset[i] = words;
+        words += (h->streams[i].bits + 63) / 64;
+    }
+    b->offset[COLUMNS] = words;
+    b->data = xrealloc(NULL, words * sizeof *b->data);
+    for (int i = 0; i < COLUMNS; i++)
+        memcpy(b->data + b->offset[i], h->streams[i].words,
+                (b->offset[i+1] - b->offset[i]) * sizeof *b->data);
+    memory += words * sizeof *b->data;
+
+    /* Append the header, reclaiming the room of the dropped ones. */
+    if (h->head + h->count == h->allocated) {
+        if (h->head > h->allocated / 2) {
+            memmove(h->blocks, h->blocks + h->head,
+                    h->count * sizeof *h->blocks);
+            h->head = 0;
+        } else {
+            size_t n = h->allocated ? 2 * h->allocated : 64;
+            h->blocks = xrealloc(h->blocks, n * sizeof *h->blocks);
+            memory += (n - h->allocated) * sizeof *h->blocks;
+            h->allocated = n;
+        }
+    }
+    h->blocks[h->head + h->count++] = *b;
+    open_block(h);
+}
+
+/* Drop the oldest full blocks until the memory fits the budget. */
+static void enforce_budget(void)
+{
+    while (memory > budget) {
+        history_t *oldest = NULL;
+        for (int i = 0; i < HISTORY_CHANNELS; i++) {
+            history_t *h = &histories[i];
+            if (h->count && (!oldest || h->blocks[h->head].first
+                        < oldest->blocks[oldest->head].first))
+                oldest = h;
+        }
+        if (!oldest) return;
+        block_t *b = &oldest->blocks[oldest->head++];
+        oldest->count--;
+        memory -= b->offset[COLUMNS] * sizeof *b->data;
+        samples -= b->count;
+        free(b->data);
+    }
+}
+
+/* Store a measurement. */
+void history_store(int index, int64_t received, const AMEASURE *m)
+{
+    if (!budget || index < 0 || index >= HISTORY_CHANNELS) return;
+    history_t *h = &histories[index];
+    if (!h->scratch) {
+        h->scratch = xrealloc(NULL,
+                COLUMNS * COLUMN_WORDS * sizeof *h->scratch);
+        memory += COLUMNS * COLUMN_WORDS * sizeof *h->scratch;
+        open_block(h);
+    }
+
+    /* Keep the times ordered, even if the clock is set back. */
+    int64_t t = received / 1000;
+    int64_t last = h->open.count ? h->open.last
+        : h->count ? h->blocks[h->head + h->count - 1].last : t;
+    if (t < last) t = last;
+
+    stream_t *s = h->streams;
+    coder_t *c = h->coders;
+    encode_int(&s[COL_RECEIVED], &c[COL_RECEIVED], t);
+    encode_int(&s[COL_TIME], &c[COL_TIME], m->Time);
+    encode_int(&s[COL_STATUS], &c[COL_STATUS], m->Status);
+    encode_int(&s[COL_NUMBER], &c[COL_NUMBER], m->Number);
+    encode_double(&s[COL_RAW], &c[COL_RAW], m->MeasureRaw);
+    encode_double(&s[COL_MEAS], &c[COL_MEAS], m->Measure);
+    encode_double(&s[COL_RANGEI], &c[COL_RANGEI], m->ValueRangeI);
+    encode_double(&s[COL_RANGEV], &c[COL_RANGEV], m->ValueRangeV);
+    if (!h->open.count) h->open.first = t;
+    h->open.last = t;
+    h->open.count++;
+    samples++;
+
+    if (h->open.count == BLOCK_SAMPLES) {
+        close_block(h);
+        enforce_budget();
+    }
+}
+
+/* Decode a block, passing the samples within the range to fn(). */
+static size_t scan_block(uint64_t *const columns[COLUMNS],
+        unsigned int count, int64_t since, int64_t until,
+        history_fn *fn, void *arg)
+{
+    stream_t s[COLUMNS];
+    coder_t c[COLUMNS];
+    AMEASURE m = {0};
+    size_t n = 0;
+
+    for (int i = 0; i < COLUMNS; i++)
+        s[i] = (stream_t) {columns[i], 0};
+    reset_coders(c);
+    for (unsigned int i = 0; i < count; i++) {
+        int64_t t = decode_int(&s[COL_RECEIVED], &c[COL_RECEIVED]) * 1000;
+        if (t > until) break;
+        m.Time = decode_int(&s[COL_TIME], &c[COL_TIME]);
+        m.Status = decode_int(&s[COL_STATUS], &c[COL_STATUS]);
+        m.Number = decode_int(&s[COL_NUMBER], &c[COL_NUMBER]);
+        m.MeasureRaw = decode_double(&s[COL_RAW], &c[COL_RAW]);
+        m.Measure = decode_double(&s[COL_MEAS], &c[COL_MEAS]);
+        m.ValueRangeI = decode_double(&s[COL_RANGEI], &c[COL_RANGEI]);
+        m.ValueRangeV = decode_double(&s[COL_RANGEV], &c[COL_RANGEV]);
+        if (t >= since) {
+            fn(arg, t, &m);
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Pass the samples of a time range to fn(). */
+size_t history_query(int index, int64_t since, int64_t until,
+        history_fn *fn, void *arg)
+{
+    uint64_t *columns[COLUMNS];
+    size_t n = 0;
+
+    if (index < 0 || index >= HISTORY_CHANNELS) return 0;
+    history_t *h = &histories[index];
+
+    /* The first block that ends after `since'. */
+    size_t lo = h->head, hi = h->head + h->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (h->blocks[mid].last * 1000 < since)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < h->head + h->count; lo++) {
+        block_t *b = &h->blocks[lo];
+        if (b->first * 1000 > until) return n;
+        for (int i = 0; i < COLUMNS; i++)
+            columns[i] = b->data + b->offset[i];
+        n += scan_block(columns, b->count, since, until, fn, arg);
+    }
+    if (h->open.count && h->open.last * 1000 >= since
+            && h->open.first * 1000 <= until) {
+        for (int i = 0; i < COLUMNS; i++)
+            columns[i] = h->streams[i].words;
+        n += scan_block(columns, h->open.count, since, until, fn, arg);
+    }
+    return n;
+}
@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * History of the measurements: every sample read from each channel,
+ * with its receive time, kept compressed in memory within a budget.
+ * Only the acquisition thread uses it. Include <stddef.h>, <stdint.h>
+ * and <Trmc.h> before this.
+ */
+
+/*
+ * Keep the history of the channels in at most `budget' bytes. Without
+ * this call, the history is disabled and nothing is stored.
+ */
+void history_init(size_t budget);
+
+/* Is the history kept? */
+int history_enabled(void);
+
+/*
+ * Store a measurement received at the given time, in ns since the
+ * epoch. Times are kept to the microsecond, and a time earlier than the
+ * previous one of the channel is stored as that one. If the budget is
+ * exceeded, the oldest samples of all the channels go.
+ */
+void history_store(int index, int64_t received, const AMEASURE *m);
+
+/*
+ * Call fn() on each sample of the channel received between `since' and
+ * `until', inclusive, in the order they were stored. Returns the number
+ * of samples.
+ */
+typedef void history_fn(void *arg, int64_t received, const AMEASURE *m);
+size_t history_query(int index, int64_t since, int64_t until,
+        history_fn *fn, void *arg);
+
+/* Memory used, and number of samples held, over all the channels. */
+size_t history_memory(void);
+uint64_t history_samples(void);
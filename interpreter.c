@@ -10,8 +10,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <math.h>
+#include <limits.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <syslog.h>
 #include <Trmc.h>
 #include "parse.h"
@@ -19,6 +29,13 @@
 #include "io.h"
 #include "interpreter.h"
 #include "plugin.h"
+#include "shm.h"
+#include "ring.h"
+#include "history.h"
+#include "archive.h"
+#include "aggregate.h"
+#include "spsc.h"
+#include "number.h"
 
 /* Instrument identification. */
 #define IDN "trmc2d temperature server, Institut NEEL, version " VERSION
@@ -29,8 +46,28 @@
 # define unused(x) x
 #endif
 
-/* Convenience macro: the client parameter comes as (void *). */
+/* Convenience macros: the client parameter comes as (void *). */
 #define VERBOSE(client) (((client_t *) client)->verbose)
+#define PRECISION(client) (((client_t *) client)->precision)
+
+/*
+ * Handlers return this when they hand the command over to the
+ * acquisition thread, which will send the reply.
+ */
+#define DEFERRED 2
+
+static int defer_command(client_t *client, command_handler handler,
+        int cmd_data, parsed_command *cmd);
+
+/*
+ * Handlers that call libtrmc2 start with this. In the network thread,
+ * it hands the command over to the acquisition thread, where the
+ * handler is invoked again, and this time goes on.
+ */
+#define RUN_IN_ACQUISITION_THREAD(handler) do { \
+        int deferred = defer_command(client, handler, cmd_data, cmd); \
+        if (deferred) return deferred; \
+    } while (0)
 
 
 /***********************************************************************
@@ -39,6 +76,8 @@
 
 #define MAX_ERRORS 256
 
+/* Both threads report errors. */
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
 static const char *error_stack[MAX_ERRORS];
 static int error_sp = 0;
 
@@ -49,30 +88,81 @@ static int error_sp = 0;
  */
 void report_error(client_t *client, const char *err)
 {
-    if (client->verbose) {
-        /* In verbose mode, the error is reported immediately. */
+    if (client->verbose || client->tag) {
+        /*
+         * In verbose mode, the error is reported immediately. So it is
+         * for tagged commands, as the stack would lose the tag.
+         */
         queue_output(client, "ERROR: %s\r\n", err);
     } else {
         /* Otherwise it is sent to the error stack. */
+        pthread_mutex_lock(&error_lock);
         assert(error_sp >= 0 && error_sp <= MAX_ERRORS);
         if (error_sp == MAX_ERRORS)
             error_stack[error_sp-1] = "Error stack overflow";
         else
             error_stack[error_sp++] = err;
+        pthread_mutex_unlock(&error_lock);
+    }
+}
+
+/*
+ * Execute a command. A command starting with "#tag " is a tagged
+ * command: its reply carries the tag, and an empty reply is still
+ * acknowledged, so that the client can match replies to requests
+ * without waiting for each one in turn. The replies to the untagged
+ * commands of a compound line are joined into a single line. What is
+ * left of an over-long command only gets an error.
+ */
+int execute_command(client_t *client, char *line)
+{
+    const char *tag = NULL;
+    int overlong = client->overlong;
+    int joined = 0;
+    int ret;
+
+    client->overlong = 0;
+    if (line[0] == '#' && !overlong) {
+        tag = ++line;
+        line += strcspn(line, " \t");
+        if (*line) *line++ = '\0';
+        begin_tagged_reply(client, tag);
+    } else if (!client->binary && in_compound_line(client)) {
+        joined = 1;
+        begin_joined_reply(client);
     }
+    if (overlong) {
+        report_error(client, "Command too long");
+        ret = 1;
+    } else {
+        ret = parse(line, trmc2_syntax, client);
+        if (ret < 0)
+            report_error(client, const_name(ret, parse_errors));
+    }
+    if (ret == DEFERRED) {
+        /* The acquisition thread will reply. */
+        client->tag = NULL;
+        client->joining = 0;
+    } else if (tag)
+        end_tagged_reply(client);
+    else if (joined)
+        end_joined_reply(client);
+    return ret;
 }
 
 static int get_error(void *client,
         unused(int cmd_data), parsed_command *cmd)
 {
     assert(client != NULL);
-    assert(error_sp >= 0 && error_sp <= MAX_ERRORS);
     if (!cmd->query || cmd->suffix[0] != -1 || cmd->n_param != 0) {
         report_error(client, "Malformed error command");
         return 1;
     }
-    queue_output(client, "%s\r\n",
-            error_sp ? error_stack[--error_sp] : "No errors");
+    pthread_mutex_lock(&error_lock);
+    assert(error_sp >= 0 && error_sp <= MAX_ERRORS);
+    const char *err = error_sp ? error_stack[--error_sp] : "No errors";
+    pthread_mutex_unlock(&error_lock);
+    queue_output(client, "%s\r\n", err);
     return 0;
 }
 
@@ -86,7 +176,10 @@ static int error_count(void *client,
         report_error(client, "Malformed error command");
         return 1;
     }
-    queue_output(client, "%d\r\n", error_sp);
+    pthread_mutex_lock(&error_lock);
+    int count = error_sp;
+    pthread_mutex_unlock(&error_lock);
+    queue_output(client, "%d\r\n", count);
     return 0;
 }
 
@@ -101,11 +194,40 @@ static int clear_errors(void *client,
     }
     if (VERBOSE(client))
         queue_output(client, "Error stack cleared\r\n");
+    pthread_mutex_lock(&error_lock);
     error_sp = 0;
+    pthread_mutex_unlock(&error_lock);
     return 0;
 }
 
 
+/***********************************************************************
+ * Numbers. Doubles are sent with the precision chosen by the client,
+ * the 6 digits of printf's %g by default.
+ */
+
+/* Send a double, as per the client's precision, on a line by itself. */
+static void queue_value(void *client, double value)
+{
+    char text[NUMBER_LENGTH + 2];
+    int n = format_double(text, value, PRECISION(client));
+    memcpy(text + n, "\r\n", 2);
+    queue_text(client, text, n + 2);
+}
+
+/* Send a list of doubles, separated by commas, on a line by itself. */
+static void queue_values(void *client, const double *values, int n)
+{
+    char text[NUMBER_LENGTH];
+    for (int i = 0; i < n; i++) {
+        if (i > 0) queue_text(client, ",", 1);
+        queue_text(client, text,
+                format_double(text, values[i], PRECISION(client)));
+    }
+    queue_text(client, "\r\n", 2);
+}
+
+
 /***********************************************************************
  * Get number of boards or channels.
  */
@@ -114,7 +236,9 @@ static int clear_errors(void *client,
 enum {nb_boards, nb_channels, b_type, b_address, b_status,
     b_calibration, b_vranges_cnt, b_vranges, b_iranges_cnt, b_iranges,
     c_vrange, c_irange, c_address, c_type, c_mode, c_avg, c_polling,
-    c_priority, c_fifosz, c_config, c_conversion, format, measure, flush};
+    c_priority, c_fifosz, c_config, c_conversion, format, measure, flush,
+    measure_all, subscribe, unsubscribe, cursor, measure_next, history,
+    archive, aggregate, decimate};
 
 static int get_number(void *client, int cmd_data, parsed_command *cmd)
 {
@@ -124,6 +248,7 @@ static int get_number(void *client, int cmd_data, parsed_command *cmd)
     assert(client != NULL);
     assert(cmd->n_tok == 2);
     assert(cmd_data == nb_boards || cmd_data == nb_channels);
+    RUN_IN_ACQUISITION_THREAD(get_number);
     if (cmd->query != 1 || cmd->suffix[0] != -1
             || cmd->suffix[1] != -1 || cmd->n_param != 0) {
         report_error(client, "Malformed count command");
@@ -142,6 +267,88 @@ static int get_number(void *client, int cmd_data, parsed_command *cmd)
 }
 
 
+/***********************************************************************
+ * Parameter cache. The parameters of the channels, boards and
+ * regulations are read from the TRMC2 once, then served from memory, as
+ * they only change when we set them. A successful Set*TRMC() stores
+ * the values just set in the cache, without reading them back. A
+ * failed one invalidates the entry, as the TRMC2 may have taken part of
+ * the values, and starting the TRMC2 invalidates them all. Numbers beyond the sanity limits
+ * below are not cached, they only get the TRMC2's error message.
+ */
+
+#define MAX_CHANNELS    256
+#define MAX_BOARDS      32
+#define MAX_REGULATIONS 16
+
+static struct {
+    int cached;
+    BOARDPARAMETER parameters;
+} boards[MAX_BOARDS];
+
+static struct {
+    int cached;
+    REGULPARAMETER parameters;
+} regulations[MAX_REGULATIONS];
+
+/* Get the parameters of a board. Returns 0 or a libtrmc2 error code. */
+static int get_board_parameters(int index, BOARDPARAMETER *board)
+{
+    if (index < 0 || index >= MAX_BOARDS) {
+        board->Index = index;
+        return GetBoardTRMC(_BYINDEX, board);
+    }
+    if (!boards[index].cached) {
+        boards[index].parameters.Index = index;
+        int ret = GetBoardTRMC(_BYINDEX, &boards[index].parameters);
+        if (ret) return ret;
+        boards[index].cached = 1;
+    }
+    *board = boards[index].parameters;
+    return 0;
+}
+
+/* Get the parameters of a regulation. Returns 0 or an error code. */
+static int get_regulation_parameters(int index, REGULPARAMETER *regul)
+{
+    if (index < 0 || index >= MAX_REGULATIONS) {
+        regul->Index = index;
+        return GetRegulationTRMC(regul);
+    }
+    if (!regulations[index].cached) {
+        regulations[index].parameters.Index = index;
+        int ret = GetRegulationTRMC(&regulations[index].parameters);
+        if (ret) return ret;
+        regulations[index].cached = 1;
+    }
+    *regul = regulations[index].parameters;
+    return 0;
+}
+
+/* Set the parameters of a regulation, and cache them. */
+static int set_regulation_parameters(REGULPARAMETER *regul)
+{
+    int index = regul->Index;
+    int ret = SetRegulationTRMC(regul);
+    if (index < 0 || index >= MAX_REGULATIONS) return ret;
+    regulations[index].cached = !ret;
+    if (!ret) regulations[index].parameters = *regul;
+    return ret;
+}
+
+/* Forget the cached parameters of a board or a regulation. */
+static void forget_board(int index)
+{
+    if (index >= 0 && index < MAX_BOARDS) boards[index].cached = 0;
+}
+
+static void forget_regulation(int index)
+{
+    if (index >= 0 && index < MAX_REGULATIONS)
+        regulations[index].cached = 0;
+}
+
+
 /***********************************************************************
  * Manage boards.
  */
@@ -155,6 +362,7 @@ static int board_handler(void *client, int cmd_data, parsed_command *cmd)
     assert(client != NULL);
     assert(((cmd_data == b_vranges_cnt || cmd_data == b_iranges_cnt)
             && cmd->n_tok == 3) || cmd->n_tok == 2);
+    RUN_IN_ACQUISITION_THREAD(board_handler);
     index = cmd->suffix[0];
     if (index == -1 || cmd->suffix[1] != -1
             || (cmd->query && cmd->n_param != 0)
@@ -166,8 +374,7 @@ static int board_handler(void *client, int cmd_data, parsed_command *cmd)
         report_error(client, "Read-only parameter");
         return 1;
     }
-    board.Index = index;
-    ret =  GetBoardTRMC(_BYINDEX, &board);
+    ret = get_board_parameters(index, &board);
     if (ret) {
         report_error(client, const_name(ret, error_codes));
         return 1;
@@ -197,20 +404,12 @@ static int board_handler(void *client, int cmd_data, parsed_command *cmd)
             queue_output(client, "%d\r\n", board.NumberofIRanges);
             break;
         case b_vranges:
-            for (int i=0; i<board.NumberofVRanges; i++) {
-                queue_output(client, "%g", board.VRangesTable[i]);
-                if (i < board.NumberofVRanges - 1)
-                    queue_output(client, ",");
-            }
-            queue_output(client, "\r\n");
+            queue_values(client, board.VRangesTable,
+                    board.NumberofVRanges);
             break;
         case b_iranges:
-            for (int i=0; i<board.NumberofIRanges; i++) {
-                queue_output(client, "%g", board.IRangesTable[i]);
-                if (i < board.NumberofIRanges - 1)
-                    queue_output(client, ",");
-            }
-            queue_output(client, "\r\n");
+            queue_values(client, board.IRangesTable,
+                    board.NumberofIRanges);
     }
 
     return 0;
@@ -221,48 +420,90 @@ static int board_handler(void *client, int cmd_data, parsed_command *cmd)
  * Manage channels.
  */
 
+/* A client receiving a channel's measurements as they come. */
+typedef struct {
+    client_t *client;
+    int decimation;     /* push one sample out of that many */
+    int countdown;      /* samples to skip before the next push */
+} subscriber_t;
+
+/* A client's position in a channel's ring. */
+typedef struct {
+    client_t *client;
+    uint64_t next;      /* sequence number of its next measurement */
+    uint64_t lost;      /* measurements it missed, not reported yet */
+} reader_t;
+
+/* Maximum number of items in a measurement format. */
+#define MAX_FORMAT 16
+
 /*
- * Extra data we have to keep for channels, not present in
- * CHANNELPARAMETER.
+ * What we keep about a channel: the cache of its CHANNELPARAMETER, and
+ * extra data not present there.
  */
 typedef struct {
     int index;
+    int cached;                 /* `parameters' is up to date */
+    CHANNELPARAMETER parameters;
     char *conversion;
-    char *format;
+    char format[MAX_FORMAT+1];  /* empty if not defined */
+    int subscriber_count;
+    subscriber_t *subscribers;
+    int reader_count;
+    reader_t *readers;
 } channel_t;
 
+/* The channel table, indexed by channel number, up to the last used. */
+static channel_t channels[MAX_CHANNELS];
+static int channel_count;
+
 /*
- * Return a pointer to the channel_t struct associated to this channel.
- * Allocate memory if needed.
- *
- * Warning: the data structure may be moved around by subsequent calls
- * to this function.
+ * Return a pointer to the channel_t struct associated to this channel,
+ * or NULL if the channel number is out of range. The struct never
+ * moves.
  */
 static channel_t *get_channel_extras(int index)
 {
-    static channel_t *channels;
-    static int allocated;
-    static int count;
-
-    /* See if we already have a slot allocated to this channel. */
-    for (int i = 0; i < count; i++) {
-        if (channels[i].index == index)
-            return &channels[i];
+    if (index < 0 || index >= MAX_CHANNELS) return NULL;
+    if (index >= channel_count) {
+        for (int i = channel_count; i <= index; i++)
+            channels[i].index = i;
+        channel_count = index + 1;
     }
+    return &channels[index];
+}
 
-    /* Add an extra element to the array. */
-    if (count == allocated) {
-        allocated += 16;
-        channels = realloc(channels, allocated * sizeof *channels);
-        if (!channels) {
-            syslog(LOG_ERR, "realloc: %m\n");
-            exit(EXIT_FAILURE);
-        }
+/* Get the parameters of a channel. Returns 0 or a libtrmc2 error code. */
+static int get_channel_parameters(channel_t *ch, CHANNELPARAMETER *channel)
+{
+    if (!ch->cached) {
+        ch->parameters.Index = ch->index;
+        int ret = GetChannelTRMC(_BYINDEX, &ch->parameters);
+        if (ret) return ret;
+        ch->cached = 1;
     }
-    channels[count].index = index;
-    channels[count].conversion = NULL;
-    channels[count].format = NULL;
-    return &channels[count++];
+    *channel = ch->parameters;
+    return 0;
+}
+
+/* Set the parameters of a channel, and cache them. */
+static int set_channel_parameters(channel_t *ch, CHANNELPARAMETER *channel)
+{
+    int ret = SetChannelTRMC(channel);
+    ch->cached = !ret;
+    if (!ret) ch->parameters = *channel;
+    return ret;
+}
+
+/* Forget all the cached parameters, e.g. when the TRMC2 restarts. */
+static void forget_parameters(void)
+{
+    for (int i = 0; i < channel_count; i++)
+        channels[i].cached = 0;
+    for (int i = 0; i < MAX_BOARDS; i++)
+        boards[i].cached = 0;
+    for (int i = 0; i < MAX_REGULATIONS; i++)
+        regulations[i].cached = 0;
 }
 
 /*
@@ -278,6 +519,20 @@ enum { RAW = 1, MEAS, RANGEI, RANGEV, TIME, STATUS, NUMBER, COUNT };
 const char format_raw_meas[] = { RAW, MEAS, 0 };
 const char format_raw[]      = { RAW, 0 };
 
+/*
+ * Return the measurement format of the channel. The default format is
+ * only known after we have read the channel parameters: it depends on
+ * whether a conversion function is set. Returns NULL on error.
+ */
+static const char *measurement_format(channel_t *ch)
+{
+    CHANNELPARAMETER channel;
+
+    if (ch->format[0]) return ch->format;
+    if (get_channel_parameters(ch, &channel)) return NULL;
+    return channel.Etalon ? format_raw_meas : format_raw;
+}
+
 /*
  * Convert a single item of a user-supplied format specifier (a string)
  * to our internal representation (a char). Returns 0 if invalid.
@@ -295,45 +550,1428 @@ static char parse_format_item(const char *fmt)
     return 0;  /* invalid */
 }
 
-/* Convert a format to a printable string and send it to the client. */
-static void queue_format(client_t *cl, const char *format)
+/* Convert a format to a printable string and send it to the client. */
+static void queue_format(client_t *cl, const char *format)
+{
+    size_t n = strlen(format);
+    for (size_t i = 0; i < n; i++) {
+        switch (format[i]) {
+            case RAW:    queue_output(cl, "raw");       break;
+            case MEAS:   queue_output(cl, "converted"); break;
+            case RANGEI: queue_output(cl, "range_i");   break;
+            case RANGEV: queue_output(cl, "range_v");   break;
+            case TIME:   queue_output(cl, "time");      break;
+            case STATUS: queue_output(cl, "status");    break;
+            case NUMBER: queue_output(cl, "number");    break;
+            case COUNT:  queue_output(cl, "count");     break;
+        }
+        if (i < n - 1) queue_output(cl, ",");
+    }
+    queue_output(cl, "\r\n");
+}
+
+/* Binary form of a measurement: four doubles and four int32. */
+#define MEASURE_RECORD_SIZE (4 * 8 + 4 * 4)
+
+static unsigned char *encode_measurement(unsigned char *p,
+        const AMEASURE *m, int count)
+{
+    p = put_f64(p, m->MeasureRaw);
+    p = put_f64(p, m->Measure);
+    p = put_f64(p, m->ValueRangeI);
+    p = put_f64(p, m->ValueRangeV);
+    p = put_i32(p, m->Time);
+    p = put_i32(p, m->Status);
+    p = put_i32(p, m->Number);
+    return put_i32(p, count);
+}
+
+/*
+ * Write the fields of a measurement, without line terminator, to a
+ * buffer of FIELDS_LENGTH bytes. Returns the length of the text.
+ */
+#define FIELDS_LENGTH (MAX_FORMAT * NUMBER_LENGTH)
+static int format_fields(char *buffer, const client_t *cl,
+        const char *format, AMEASURE *m, int count)
+{
+    int precision = cl->precision;
+    char *p = buffer;
+    for (const char *f = format; *f; f++) {
+        if (f != format) *p++ = ',';
+        switch (*f) {
+            case RAW:    p += format_double(p, m->MeasureRaw, precision);
+                         break;
+            case MEAS:   p += format_double(p, m->Measure, precision);
+                         break;
+            case RANGEI: p += format_double(p, m->ValueRangeI, precision);
+                         break;
+            case RANGEV: p += format_double(p, m->ValueRangeV, precision);
+                         break;
+            case TIME:   p += format_int(p, m->Time);   break;
+            case STATUS: p += format_int(p, m->Status); break;
+            case NUMBER: p += format_int(p, m->Number); break;
+            case COUNT:  p += format_int(p, count);     break;
+        }
+    }
+    return p - buffer;
+}
+
+/* Send the fields of a measurement, without line terminator. */
+static void queue_fields(client_t *cl, const char *format, AMEASURE *m,
+        int count)
+{
+    char text[FIELDS_LENGTH];
+    queue_text(cl, text, format_fields(text, cl, format, m, count));
+}
+
+/*
+ * Send a measurement as per the requested format. Binary clients get a
+ * RECORD_MEASURE record with all the fields instead.
+ */
+static void queue_measurement(client_t *cl, int index,
+        const char *format, AMEASURE *m, int count)
+{
+    if (cl->binary) {
+        unsigned char record[MEASURE_RECORD_SIZE];
+        encode_measurement(record, m, count);
+        queue_record(cl, RECORD_MEASURE, index, record, sizeof record);
+        return;
+    }
+    char text[FIELDS_LENGTH + 2];
+    int n = format_fields(text, cl, format, m, count);
+    memcpy(text + n, "\r\n", 2);
+    queue_text(cl, text, n + 2);
+}
+
+/*
+ * Acquisition thread. All the libtrmc2 calls happen in a dedicated
+ * thread, so that a slow serial transaction does not stall the
+ * clients. The handlers of the hardware commands hand the parsed
+ * command over to that thread through a lock-free queue, and the thread
+ * invokes them again on a stand-in client that captures the reply. The
+ * replies, as well as the samples pushed to subscribers, come back to
+ * the network thread through another queue, and deliver_results()
+ * copies them to the clients.
+ *
+ * The acquisition thread owns the channel table; the network thread
+ * owns the clients. The client pointers only cross over as
+ * identifiers. A leaving client is retired through the acquisition
+ * thread, and can be deleted when that comes back: all its pending
+ * results have then been delivered.
+ *
+ * An untagged command holds the following commands of its client until
+ * its reply comes back, which keeps the untagged replies in order.
+ * Tagged commands can pile up, to at most MAX_IN_FLIGHT per client.
+ *
+ * A job goes back to the network thread with its reply, and from there
+ * to a pool of free jobs: its arena holds a copy of the command, then
+ * the reply. Thus, a command with a short reply does not touch the
+ * heap on its way through the acquisition thread.
+ *
+ * The queries of the archive read the disk, which would hold the
+ * acquisition up: once the acquisition thread has checked the command,
+ * it forwards the job to the archive reader thread. The reader runs the
+ * query on a stand-in client of its own, and gives the job back to the
+ * acquisition thread, which posts the reply as its own.
+ */
+
+#define MAX_IN_FLIGHT 16
+
+/* Room for MAX_IN_FLIGHT commands plus the retirement of every client. */
+#define JOB_QUEUE_SIZE 32768
+#define RESULT_QUEUE_SIZE 4096
+
+/* Size of the arena of the pooled jobs, and size of the pool. */
+#define JOB_ARENA_SIZE 1024
+#define JOB_POOL_SIZE 256
+
+/* A sample pushed to subscribers. */
+typedef struct {
+    AMEASURE meas;
+    int count;
+} sample_t;
+
+enum { RESULT_REPLY, RESULT_PUSH, RESULT_RETIRED };
+
+/* Something for the network thread to deliver to a client. */
+typedef struct {
+    int type;
+    client_t *client;
+    unsigned int untagged: 1;   /* reply to an untagged command */
+    int index;                  /* channel of the pushed samples */
+    int n;                      /* number of pushed samples */
+    sample_t *samples;          /* pushed samples... */
+    const char *format;         /* ... and the channel's format */
+    size_t size;                /* size of the reply... */
+    char *data;                 /* ... which is right after this struct */
+    char *allocated;            /* data if it had to be malloc()ed */
+    archive_range_t *ranges;    /* files to send after the data */
+    int range_count;
+} result_t;
+
+/*
+ * A command for the acquisition thread. It comes back as a result of
+ * type RESULT_REPLY or RESULT_RETIRED.
+ */
+typedef struct job {
+    result_t result;            /* first, for casting between the two */
+    client_t *client;           /* NULL to stop the thread */
+    command_handler handler;    /* NULL to retire the client */
+    int cmd_data;
+    unsigned int verbose: 1;    /* client settings when the command */
+    unsigned int binary: 1;     /*   was sent */
+    unsigned int precision: 5;
+    const char *tag;            /* NULL if untagged */
+    parsed_command cmd;         /* pointing into the arena */
+    int index;                  /* channel of an archive query */
+    char format[MAX_FORMAT+1];  /* and its format */
+    struct job *next;           /* in the pool */
+    size_t arena_size;          /* the arena is right after this struct */
+    size_t arena_used;          /* by the copy of the command */
+} job_t;
+
+static spsc_queue *jobs;        /* network -> acquisition */
+static spsc_queue *results;     /* acquisition -> network */
+static pthread_t acquisition_thread;
+static __thread int in_acquisition_thread;
+
+/* Archive reader thread, with -a only. */
+static spsc_queue *reads;       /* acquisition -> reader */
+static spsc_queue *reads_done;  /* reader -> acquisition */
+static pthread_t reader_thread;
+static client_t *reader_capture;
+
+/* Stand-in for the clients in the acquisition thread. */
+static client_t *capture;
+
+/* The client on whose behalf the acquisition thread runs a handler. */
+static client_t *requester;
+
+/* Files the handler wants sent after its reply. */
+static __thread archive_range_t *reply_ranges;
+static __thread int reply_range_count;
+
+/* Set by a handler for the archive reader to answer the job. */
+static int forwarded;
+static int forward_index;
+static const char *forward_format;
+
+/* Have results been posted since the last notification? */
+static int results_posted;
+
+/* Set when the daemon exits: nobody will take further results. */
+static atomic_int stopping;
+
+/* Free jobs, only used by the network thread. */
+static job_t *free_jobs;
+static int free_job_count;
+
+/*
+ * Get a job with an arena of at least `size' bytes, from the pool if
+ * possible.
+ */
+static job_t *get_job(size_t size)
+{
+    job_t *job = free_jobs;
+    if (job && size <= JOB_ARENA_SIZE) {
+        free_jobs = job->next;
+        free_job_count--;
+    } else {
+        if (size < JOB_ARENA_SIZE) size = JOB_ARENA_SIZE;
+        job = malloc(sizeof *job + size);
+        if (!job) {
+            syslog(LOG_ERR, "malloc: %m\n");
+            exit(EXIT_FAILURE);
+        }
+        job->arena_size = size;
+    }
+    job->result.allocated = NULL;
+    job->result.ranges = NULL;
+    job->result.range_count = 0;
+    job->arena_used = 0;
+    return job;
+}
+
+/* Close the files a result has not sent. */
+static void drop_ranges(result_t *result)
+{
+    for (int i = 0; i < result->range_count; i++)
+        if (result->ranges[i].fd != -1) close(result->ranges[i].fd);
+    free(result->ranges);
+    result->ranges = NULL;
+    result->range_count = 0;
+}
+
+/* Give a job back to the pool. */
+static void release_job(job_t *job)
+{
+    free(job->result.allocated);
+    drop_ranges(&job->result);
+    if (job->arena_size != JOB_ARENA_SIZE
+            || free_job_count >= JOB_POOL_SIZE) {
+        free(job);
+        return;
+    }
+    job->next = free_jobs;
+    free_jobs = job;
+    free_job_count++;
+}
+
+/*
+ * Hand the command over to the acquisition thread. Returns 0 if we are
+ * already in that thread, DEFERRED on success, or 1 if an error has
+ * been reported.
+ */
+static int defer_command(client_t *client, command_handler handler,
+        int cmd_data, parsed_command *cmd)
+{
+    if (in_acquisition_thread) return 0;
+
+    /* Copy the command into the arena. */
+    size_t tok_len[cmd->n_tok + 1], param_len[cmd->n_param + 1];
+    size_t tag_len = client->tag ? strlen(client->tag) + 1 : 0;
+    size_t size = (cmd->n_tok + cmd->n_param) * sizeof(char *)
+        + cmd->n_tok * sizeof(int) + tag_len;
+    for (int i = 0; i < cmd->n_tok; i++)
+        size += tok_len[i] = strlen(cmd->tok[i]) + 1;
+    for (int i = 0; i < cmd->n_param; i++)
+        size += param_len[i] = strlen(cmd->param[i]) + 1;
+    job_t *job = get_job(size);
+    job->arena_used = size;
+    job->client = client;
+    job->handler = handler;
+    job->cmd_data = cmd_data;
+    job->verbose = client->verbose;
+    job->binary = client->binary;
+    job->precision = client->precision;
+    job->cmd = *cmd;
+    job->cmd.tok = (char **) (job + 1);
+    job->cmd.param = job->cmd.tok + cmd->n_tok;
+    job->cmd.suffix = (int *) (job->cmd.param + cmd->n_param);
+    char *p = (char *) (job->cmd.suffix + cmd->n_tok);
+    for (int i = 0; i < cmd->n_tok; i++) {
+        job->cmd.tok[i] = memcpy(p, cmd->tok[i], tok_len[i]);
+        p += tok_len[i];
+        job->cmd.suffix[i] = cmd->suffix[i];
+    }
+    for (int i = 0; i < cmd->n_param; i++) {
+        job->cmd.param[i] = memcpy(p, cmd->param[i], param_len[i]);
+        p += param_len[i];
+    }
+    job->tag = tag_len ? memcpy(p, client->tag, tag_len) : NULL;
+
+    if (!spsc_push(jobs, job)) {
+        release_job(job);
+        report_error(client, "Too many pending commands");
+        return 1;
+    }
+    spsc_notify(jobs);
+    client->in_flight++;
+    if (!client->tag) client->waiting = 1;
+    return DEFERRED;
+}
+
+/* Allocate a result with room for `size' bytes of data. */
+static result_t *new_result(int type, client_t *client, size_t size)
+{
+    result_t *result = malloc(sizeof *result + size);
+    if (!result) {
+        syslog(LOG_ERR, "malloc: %m\n");
+        exit(EXIT_FAILURE);
+    }
+    result->type = type;
+    result->client = client;
+    result->untagged = 0;
+    result->size = size;
+    result->data = (char *) (result + 1);
+    result->allocated = NULL;
+    result->ranges = NULL;
+    result->range_count = 0;
+    return result;
+}
+
+/* Free a result, or the job it is part of, from any thread. */
+static void free_result(result_t *result)
+{
+    free(result->allocated);
+    drop_ranges(result);
+    free(result);
+}
+
+/*
+ * Hand a result over to the network thread. If the queue is full, the
+ * network thread is busy emptying it: just wait.
+ */
+static void post_result(result_t *result)
+{
+    while (!spsc_push(results, result)) {
+        if (atomic_load(&stopping)) {
+            free_result(result);
+            return;
+        }
+        spsc_notify(results);
+        nanosleep(&(struct timespec) {0, 1000000}, NULL);
+    }
+    results_posted = 1;
+}
+
+/*
+ * Periodic acquisition, in the acquisition thread. Every
+ * ACQUISITION_PERIOD, the FIFOs of the channels having subscribers are
+ * drained, and each sample is pushed to the subscribers as a
+ * "channel<i>:measure data" line. A subscriber that does not read its
+ * output fast enough misses samples. If the shared memory table is
+ * published, or if the measurements are kept in rings, in the history
+ * or in the archive, all the channels are drained.
+ *
+ * With rings, the clients read the measurements at their own cursors
+ * rather than from the FIFOs, thus they do not steal each other's
+ * measurements, and a client falling behind by more than a ring's size
+ * is told how many it missed.
+ */
+
+#define ACQUISITION_PERIOD 100  /* ms */
+
+/* Max number of samples read from one channel per period. */
+#define MAX_BURST 1024
+
+static int subscription_count;  /* total over all channels */
+static struct timespec next_acquisition;
+
+/* Samples read from the channel being drained. */
+static sample_t burst[MAX_BURST];
+
+/* Milliseconds elapsed from `from' to `to'. */
+static long elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000
+        + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/*
+ * Return the subscriber slot of the client for this channel, or NULL
+ * if it is not subscribed.
+ */
+static subscriber_t *find_subscriber(channel_t *ch, client_t *cl)
+{
+    for (int i = 0; i < ch->subscriber_count; i++)
+        if (ch->subscribers[i].client == cl)
+            return &ch->subscribers[i];
+    return NULL;
+}
+
+/* Subscribe the client to the channel, or update its decimation. */
+static void add_subscriber(channel_t *ch, client_t *cl, int decimation)
+{
+    subscriber_t *sub = find_subscriber(ch, cl);
+    if (!sub) {
+        ch->subscribers = realloc(ch->subscribers,
+                (ch->subscriber_count + 1) * sizeof *ch->subscribers);
+        if (!ch->subscribers) {
+            syslog(LOG_ERR, "realloc: %m\n");
+            exit(EXIT_FAILURE);
+        }
+        sub = &ch->subscribers[ch->subscriber_count++];
+        sub->client = cl;
+        if (subscription_count++ == 0)
+            clock_gettime(CLOCK_MONOTONIC, &next_acquisition);
+    }
+    sub->decimation = decimation;
+    sub->countdown = 0;
+}
+
+/* Unsubscribe the client from the channel, if it was subscribed. */
+static void remove_subscriber(channel_t *ch, client_t *cl)
+{
+    subscriber_t *sub = find_subscriber(ch, cl);
+    if (!sub) return;
+    *sub = ch->subscribers[--ch->subscriber_count];
+    subscription_count--;
+}
+
+/*
+ * Return the client's cursor in the channel's ring, starting it at the
+ * oldest measurement held if the client has none yet.
+ */
+static reader_t *get_reader(channel_t *ch, client_t *cl)
+{
+    for (int i = 0; i < ch->reader_count; i++)
+        if (ch->readers[i].client == cl)
+            return &ch->readers[i];
+    ch->readers = realloc(ch->readers,
+            (ch->reader_count + 1) * sizeof *ch->readers);
+    if (!ch->readers) {
+        syslog(LOG_ERR, "realloc: %m\n");
+        exit(EXIT_FAILURE);
+    }
+    reader_t *rd = &ch->readers[ch->reader_count++];
+    rd->client = cl;
+    rd->next = ring_first(ch->index);
+    rd->lost = 0;
+    return rd;
+}
+
+/* Move the cursor past the measurements overwritten before it read them. */
+static void skip_lost(reader_t *rd, int index)
+{
+    uint64_t first = ring_first(index);
+    if (rd->next < first) {
+        rd->lost += first - rd->next;
+        rd->next = first;
+    }
+}
+
+/* Cancel the subscriptions and drop the cursors of a leaving client. */
+static void forget_client(client_t *cl)
+{
+    for (int i = 0; i < channel_count; i++) {
+        channel_t *ch = &channels[i];
+        remove_subscriber(ch, cl);
+        for (int j = 0; j < ch->reader_count; j++)
+            if (ch->readers[j].client == cl) {
+                ch->readers[j] = ch->readers[--ch->reader_count];
+                break;
+            }
+    }
+}
+
+/* Is there any channel to drain periodically? */
+static int acquisition_active(void)
+{
+    return subscription_count || shm_enabled() || ring_enabled()
+        || history_enabled() || archive_enabled();
+}
+
+/* Milliseconds until the next acquisition, or -1 if there is none. */
+static int acquisition_timeout(void)
+{
+    struct timespec now;
+
+    if (!acquisition_active()) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long timeout = elapsed_ms(&now, &next_acquisition);
+    return timeout < 0 ? 0 : timeout;
+}
+
+/* Post the first n samples of the burst to the subscribers that want them. */
+static void fan_out(channel_t *ch, const char *format, int n)
+{
+    static int picked[MAX_BURST];
+    size_t format_size = strlen(format) + 1;
+
+    for (int i = 0; i < ch->subscriber_count; i++) {
+        subscriber_t *sub = &ch->subscribers[i];
+        int count = 0;
+        for (int j = 0; j < n; j++) {
+            if (sub->countdown-- > 0) continue;
+            sub->countdown = sub->decimation - 1;
+            picked[count++] = j;
+        }
+        if (!count) continue;
+        result_t *result = new_result(RESULT_PUSH, sub->client,
+                count * sizeof(sample_t) + format_size);
+        result->index = ch->index;
+        result->n = count;
+        result->samples = (sample_t *) result->data;
+        for (int j = 0; j < count; j++)
+            result->samples[j] = burst[picked[j]];
+        result->format = memcpy(result->samples + count, format,
+                format_size);
+        post_result(result);
+    }
+}
+
+/*
+ * Keep a measurement just read from the channel: publish it in shared
+ * memory, and store it in the ring, the history and the archive,
+ * whichever is enabled.
+ */
+static void keep_measurement(int index, const AMEASURE *m)
+{
+    struct timespec now;
+
+    shm_publish(index, m);
+    if (!ring_enabled() && !history_enabled() && !archive_enabled())
+        return;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t received = now.tv_sec * INT64_C(1000000000) + now.tv_nsec;
+    ring_store(index, received, m);
+    history_store(index, received, m);
+    archive_store(index, received, m);
+}
+
+/*
+ * Read all the new measurements of a channel and distribute them.
+ * Returns the number of measurements read, or the error code of the
+ * first read.
+ */
+static int drain_channel(int index)
+{
+    const char *format = NULL;
+    channel_t *ch = get_channel_extras(index);
+
+    if (!ch) return _NO_SUCH_CHANNEL;
+    if (ch->subscriber_count) {
+        format = measurement_format(ch);
+        if (!format) return 0;
+    }
+
+    /* Drain the FIFO: the returned value is the count before read. */
+    int ret;
+    int n = 0;
+    do {
+        ret = ReadValueTRMC(index, &burst[n].meas);
+        if (ret <= 0) break;
+        keep_measurement(index, &burst[n].meas);
+        burst[n++].count = ret;
+    } while (ret > 1 && n < MAX_BURST);
+    if (format && n) fan_out(ch, format, n);
+    return n ? n : ret;
+}
+
+/* Drain the channels that need it, if it is time to. */
+static void acquire_measurements(void)
+{
+    struct timespec now;
+
+    if (!acquisition_active()) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (elapsed_ms(&now, &next_acquisition) > 0) return;
+    next_acquisition.tv_sec = now.tv_sec + ACQUISITION_PERIOD / 1000;
+    next_acquisition.tv_nsec = now.tv_nsec
+        + ACQUISITION_PERIOD % 1000 * 1000000;
+    if (next_acquisition.tv_nsec >= 1000000000) {
+        next_acquisition.tv_sec++;
+        next_acquisition.tv_nsec -= 1000000000;
+    }
+
+    if (shm_enabled() || ring_enabled() || history_enabled()
+            || archive_enabled()) {
+        int n;
+        if (GetNumberOfChannelTRMC(&n)) return;
+        for (int i = 0; i < n; i++)
+            drain_channel(i);
+    } else {
+        for (int i = 0; i < channel_count; i++)
+            if (channels[i].subscriber_count)
+                drain_channel(channels[i].index);
+    }
+}
+
+/* Set a stand-in client up for running a job's command. */
+static void begin_reply(client_t *cap, job_t *job)
+{
+    cap->verbose = job->verbose;
+    cap->binary = job->binary;
+    cap->precision = job->precision;
+    if (job->tag) begin_tagged_reply(cap, job->tag);
+}
+
+/* Move the reply captured on the stand-in client into the job's result. */
+static void end_reply(client_t *cap, job_t *job)
+{
+    result_t *result = &job->result;
+
+    if (job->tag) end_tagged_reply(cap);
+    result->type = RESULT_REPLY;
+    result->untagged = !job->tag;
+    result->size = cap->output_pending;
+    if (result->size <= job->arena_size - job->arena_used) {
+        result->data = (char *) (job + 1) + job->arena_used;
+    } else {
+        result->data = result->allocated = malloc(result->size);
+        if (!result->data) {
+            syslog(LOG_ERR, "malloc: %m\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    take_output(cap, result->data);
+    result->ranges = reply_ranges;
+    result->range_count = reply_range_count;
+    reply_ranges = NULL;
+    reply_range_count = 0;
+}
+
+/*
+ * Acquisition thread: have the archive reader answer the current job,
+ * a query of the given channel. The handler should not reply anything.
+ */
+static void forward_to_reader(int index, const char *format)
+{
+    forwarded = 1;
+    forward_index = index;
+    forward_format = format ? format : format_raw;
+}
+
+/* Run a command in the acquisition thread and post the reply. */
+static void run_job(job_t *job)
+{
+    result_t *result = &job->result;
+
+    result->client = job->client;
+    result->size = 0;
+    if (!job->handler) {
+        forget_client(job->client);
+        result->type = RESULT_RETIRED;
+    } else {
+        requester = job->client;
+        begin_reply(capture, job);
+        job->handler(capture, job->cmd_data, &job->cmd);
+        if (forwarded) {
+
+            /* The queues are as large as the jobs queue: no overflow. */
+            forwarded = 0;
+            capture->tag = NULL;
+            job->index = forward_index;
+            strcpy(job->format, forward_format);
+            spsc_push(reads, job);
+            spsc_notify(reads);
+            return;
+        }
+        end_reply(capture, job);
+    }
+    post_result(result);
+
+    /* Do not hold the reply back until the end of the batch. */
+    spsc_notify(results);
+    results_posted = 0;
+}
+
+static int queue_range_query(client_t *cl, int index, const char *format,
+        int cmd_data, parsed_command *cmd);
+
+/* Archive reader thread: answer the queries forwarded to it. */
+static void *reader_loop(unused(void *arg))
+{
+    job_t *job;
+
+    for (;;) {
+        struct pollfd pfd = {spsc_fd(reads), POLLIN, 0};
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+            syslog(LOG_WARNING, "poll: %m\n");
+        spsc_clear(reads);
+        while ((job = spsc_pop(reads))) {
+            if (!job->client) {
+                free(job);
+                return NULL;
+            }
+            begin_reply(reader_capture, job);
+            queue_range_query(reader_capture, job->index, job->format,
+                    job->cmd_data, &job->cmd);
+            end_reply(reader_capture, job);
+            spsc_push(reads_done, job);
+            spsc_notify(reads_done);
+        }
+    }
+}
+
+static void *acquisition_loop(unused(void *arg))
+{
+    job_t *job;
+
+    in_acquisition_thread = 1;
+    for (;;) {
+        struct pollfd pfd[2] = {{spsc_fd(jobs), POLLIN, 0},
+            {reads_done ? spsc_fd(reads_done) : -1, POLLIN, 0}};
+        if (poll(pfd, 2, acquisition_timeout()) == -1 && errno != EINTR)
+            syslog(LOG_WARNING, "poll: %m\n");
+        spsc_clear(jobs);
+        while ((job = spsc_pop(jobs))) {
+            if (!job->client) {
+
+                /* Stop the archive reader too, with the same job. */
+                if (!reads) {
+                    free(job);
+                } else {
+                    spsc_push(reads, job);
+                    spsc_notify(reads);
+                    pthread_join(reader_thread, NULL);
+                }
+                return NULL;
+            }
+            run_job(job);
+        }
+        if (reads_done) {
+            spsc_clear(reads_done);
+            while ((job = spsc_pop(reads_done)))
+                post_result(&job->result);
+        }
+        acquire_measurements();
+        archive_flush();
+        if (results_posted) {
+            spsc_notify(results);
+            results_posted = 0;
+        }
+    }
+}
+
+/* Start the acquisition thread. Returns -1 on error. */
+int start_acquisition(void)
+{
+    jobs = spsc_new(JOB_QUEUE_SIZE);
+    results = spsc_new(RESULT_QUEUE_SIZE);
+    capture = new_client(-1, -1);
+    if (!jobs || !results || !capture) return -1;
+    if (archive_enabled()) {
+        reads = spsc_new(JOB_QUEUE_SIZE);
+        reads_done = spsc_new(JOB_QUEUE_SIZE);
+        reader_capture = new_client(-1, -1);
+        if (!reads || !reads_done || !reader_capture) return -1;
+        int err = pthread_create(&reader_thread, NULL, reader_loop, NULL);
+        if (err) {
+            syslog(LOG_ERR, "pthread_create: %s\n", strerror(err));
+            return -1;
+        }
+    }
+    int err = pthread_create(&acquisition_thread, NULL,
+            acquisition_loop, NULL);
+    if (err) {
+        syslog(LOG_ERR, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Stop the acquisition thread once it is done with the queued jobs.
+ * Their results are dropped.
+ */
+void stop_acquisition(void)
+{
+    job_t *job = get_job(0);
+    job->client = NULL;
+    atomic_store(&stopping, 1);
+    while (!spsc_push(jobs, job))
+        nanosleep(&(struct timespec) {0, 1000000}, NULL);
+    spsc_notify(jobs);
+    pthread_join(acquisition_thread, NULL);
+}
+
+/* File descriptor that becomes readable when there are results. */
+int acquisition_fd(void)
+{
+    return spsc_fd(results);
+}
+
+/* Start retiring a leaving client. */
+void retire_client(client_t *cl)
+{
+    job_t *job = get_job(0);
+    job->client = cl;
+    job->handler = NULL;
+    if (!spsc_push(jobs, job)) {  /* JOB_QUEUE_SIZE is too small */
+        syslog(LOG_ERR, "Acquisition queue full\n");
+        exit(EXIT_FAILURE);
+    }
+    spsc_notify(jobs);
+    cl->retired = 1;
+    cl->in_flight++;
+}
+
+/* Should the client wait for its commands before sending new ones? */
+int client_waiting(const client_t *cl)
+{
+    return cl->waiting || cl->in_flight >= MAX_IN_FLIGHT;
+}
+
+/* Deliver the results that came back from the acquisition thread. */
+void deliver_results(void (*resume)(client_t *cl))
+{
+    result_t *result;
+
+    spsc_clear(results);
+    while ((result = spsc_pop(results))) {
+        client_t *cl = result->client;
+        int type = result->type;
+        switch (type) {
+            case RESULT_REPLY:
+                if (!cl->quitting && result->untagged && !cl->binary
+                        && in_compound_line(cl)) {
+                    begin_joined_reply(cl);
+                    queue_text(cl, result->data, result->size);
+                    end_joined_reply(cl);
+                } else if (!cl->quitting) {
+                    end_joined_line(cl);
+                    queue_bytes(cl, result->data, result->size);
+                    for (int i = 0; i < result->range_count; i++) {
+                        archive_range_t *r = &result->ranges[i];
+                        queue_file(cl, r->fd, r->offset, r->length);
+                        r->fd = -1;
+                    }
+                }
+                if (result->untagged) cl->waiting = 0;
+                cl->in_flight--;
+                break;
+            case RESULT_PUSH:
+                if (!cl->quitting) end_joined_line(cl);
+                for (int i = 0; i < result->n; i++) {
+                    if (cl->quitting || output_congested(cl)) break;
+                    if (!cl->binary)
+                        queue_output(cl, "channel%d:measure ",
+                                result->index);
+                    queue_measurement(cl, result->index, result->format,
+                            &result->samples[i].meas,
+                            result->samples[i].count);
+                }
+                break;
+            case RESULT_RETIRED:
+                cl->in_flight--;
+                break;
+        }
+        if (type == RESULT_PUSH)
+            free_result(result);
+        else
+            release_job((job_t *) result);
+
+        /* Send now: the socket may be idle and not report being ready. */
+        if (cl->output_pending && !cl->quitting)
+            process_output(cl);
+        if (type != RESULT_PUSH && resume)
+            resume(cl);
+    }
+}
+
+/*
+ * Read the requester's next measurement of a channel. Without rings, it
+ * is taken from the FIFO. With rings, it is taken at the requester's
+ * cursor, the FIFO being drained first if the cursor has caught up with
+ * it. Returns, like ReadValueTRMC(), the number of measurements that
+ * were available before the read, 0 if none, or an error code.
+ */
+static int read_measurement(channel_t *ch, AMEASURE *meas)
+{
+    int index = ch->index;
+
+    if (!ring_enabled()) {
+        int ret = ReadValueTRMC(index, meas);
+        if (ret > 0) keep_measurement(index, meas);
+        return ret;
+    }
+    reader_t *rd = get_reader(ch, requester);
+    if (rd->next >= ring_end(index)) {
+        int ret = drain_channel(index);
+        if (ret < 0) return ret;
+    }
+    skip_lost(rd, index);
+    const ring_sample_t *sample = ring_get(index, rd->next);
+    if (!sample) return 0;
+    *meas = sample->meas;
+    return ring_end(index) - rd->next++;
+}
+
+/* Report the measurements the requester missed since the last report. */
+static void report_lost(client_t *cl, channel_t *ch)
+{
+    if (!ring_enabled()) return;
+    reader_t *rd = get_reader(ch, requester);
+    if (rd->lost) {
+        report_error(cl, "Measurements lost");
+        rd->lost = 0;
+    }
+}
+
+/*
+ * Answer "measure:all? [max]": read up to `max' measurements (default:
+ * all of them) from the channel and send them as a block. In ASCII
+ * mode, the block is a line with the number of measurements followed
+ * by one line per measurement. In binary mode, it is a single
+ * RECORD_MEASURE_BLOCK record. Returns 0 or an error code.
+ */
+static int queue_all_measurements(client_t *cl, channel_t *ch,
+        const char *format, int max)
+{
+    int index = ch->index;
+    static AMEASURE *samples;
+    static int *counts;
+    static int allocated;
+    int n = 0;
+    int ret;
+
+    /* The first read tells how many measurements are available. */
+    do {
+        if (n == allocated) {
+            allocated = allocated ? 2 * allocated : 64;
+            samples = realloc(samples, allocated * sizeof *samples);
+            counts = realloc(counts, allocated * sizeof *counts);
+            if (!samples || !counts) {
+                syslog(LOG_ERR, "realloc: %m\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ret = read_measurement(ch, &samples[n]);
+        if (ret < 0 && n == 0) return ret;
+        if (ret <= 0) break;
+        if (n == 0 && ret < max) max = ret;
+        counts[n++] = ret;
+    } while (n < max);
+
+    if (cl->binary) {
+        queue_record_header(cl, RECORD_MEASURE_BLOCK, index,
+                (size_t) n * MEASURE_RECORD_SIZE);
+        for (int i = 0; i < n; i++)
+            encode_measurement(reserve_output(cl, MEASURE_RECORD_SIZE),
+                    &samples[i], counts[i]);
+        end_record(cl);
+    } else {
+        queue_output(cl, "%d\r\n", n);
+        for (int i = 0; i < n; i++)
+            queue_measurement(cl, index, format, &samples[i], counts[i]);
+    }
+    return 0;
+}
+
+/*
+ * Answer "measure:next? [max]": send up to `max' measurements (default:
+ * all of them) from the requester's cursor in the channel's ring, with
+ * their sequence numbers and receive times. In ASCII mode, a line "seq,
+ * n, lost" gives the sequence number of the first measurement, the
+ * number of measurements, and how many were missed just before the
+ * first one. Then comes one line per measurement, starting with its
+ * receive time. In binary mode, it is a single RECORD_SEQUENCE record.
+ * Returns 0 or an error code.
+ */
+static int queue_next_measurements(client_t *cl, channel_t *ch,
+        const char *format, int max)
+{
+    int index = ch->index;
+    reader_t *rd = get_reader(ch, requester);
+
+    int ret = drain_channel(index);
+    if (ret < 0) return ret;
+    skip_lost(rd, index);
+    uint64_t first = rd->next, lost = rd->lost;
+    uint64_t end = ring_end(index);
+    int n = end - first < (uint64_t) max ? (int) (end - first) : max;
+    rd->next += n;
+    rd->lost = 0;
+
+    if (cl->binary) {
+        queue_record_header(cl, RECORD_SEQUENCE, index,
+                16 + (size_t) n * (8 + MEASURE_RECORD_SIZE));
+        put_u64(put_u64(reserve_output(cl, 16), first), lost);
+        for (int i = 0; i < n; i++) {
+            const ring_sample_t *sample = ring_get(index, first + i);
+            unsigned char *p = reserve_output(cl, 8 + MEASURE_RECORD_SIZE);
+            encode_measurement(put_u64(p, sample->received), &sample->meas,
+                    end - first - i);
+        }
+        end_record(cl);
+    } else {
+        queue_output(cl, "%" PRIu64 ", %d, %" PRIu64 "\r\n",
+                first, n, lost);
+        for (int i = 0; i < n; i++) {
+            const ring_sample_t *sample = ring_get(index, first + i);
+            AMEASURE meas = sample->meas;
+            queue_output(cl, "%" PRId64 ".%09d,",
+                    sample->received / 1000000000,
+                    (int) (sample->received % 1000000000));
+            queue_measurement(cl, index, format, &meas, end - first - i);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Samples of a history query, gathered before the answer is sent. The
+ * acquisition thread and the archive reader each have their own.
+ */
+typedef struct {
+    int64_t received;
+    AMEASURE meas;
+} stamped_t;
+
+static __thread stamped_t *gathered;
+static __thread size_t gathered_size;
+
+static void gather_sample(void *arg, int64_t received, const AMEASURE *m)
+{
+    size_t *n = arg;
+    if (*n == gathered_size) {
+        gathered_size = gathered_size ? 2 * gathered_size
+            : 1024;
+        gathered = realloc(gathered,
+                gathered_size * sizeof *gathered);
+        if (!gathered) {
+            syslog(LOG_ERR, "realloc: %m\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    gathered[*n].received = received;
+    gathered[(*n)++].meas = *m;
+}
+
+/*
+ * Send the n gathered samples. In ASCII mode, this is a line with their
+ * number followed by one line per sample, starting with its receive
+ * time. In binary mode, this is a single RECORD_HISTORY record.
+ */
+static void queue_gathered(client_t *cl, int index, const char *format,
+        size_t n)
+{
+    if (cl->binary) {
+        queue_record_header(cl, RECORD_HISTORY, index,
+                n * (8 + MEASURE_RECORD_SIZE));
+        for (size_t i = 0; i < n; i++) {
+            unsigned char *p = reserve_output(cl, 8 + MEASURE_RECORD_SIZE);
+            encode_measurement(put_u64(p, gathered[i].received),
+                    &gathered[i].meas, n - i);
+        }
+        end_record(cl);
+        return;
+    }
+    queue_output(cl, "%zu\r\n", n);
+    for (size_t i = 0; i < n; i++) {
+        stamped_t *sample = &gathered[i];
+        queue_output(cl, "%" PRId64 ".%06d,",
+                sample->received / 1000000000,
+                (int) (sample->received % 1000000000 / 1000));
+        queue_measurement(cl, index, format, &sample->meas, n - i);
+    }
+}
+
+/*
+ * Answer "history? since [, until]": send the measurements of the
+ * channel received between these times, in seconds since the epoch,
+ * from the history.
+ */
+static void queue_history(client_t *cl, int index, const char *format,
+        int64_t since, int64_t until)
+{
+    size_t n = 0;
+
+    history_query(index, since, until, gather_sample, &n);
+    queue_gathered(cl, index, format, n);
+}
+
+/*
+ * Answer "archive? since [, until]": send the measurements of the
+ * channel received between these times from the archive. The ASCII
+ * answer is the same as for "history?". The binary answer is a single
+ * RECORD_ARCHIVE record, whose payload is sent straight from the files
+ * of the archive once this reply has reached the network thread.
+ */
+static void queue_archive(client_t *cl, int index, const char *format,
+        int64_t since, int64_t until)
+{
+    if (cl->binary) {
+        size_t size = 0;
+        reply_range_count = archive_export(index, since, until,
+                UINT32_MAX, &reply_ranges);
+        for (int i = 0; i < reply_range_count; i++)
+            size += reply_ranges[i].length;
+        queue_record_header(cl, RECORD_ARCHIVE, index, size);
+    } else {
+        size_t n = 0;
+        archive_query(index, since, until, gather_sample, &n);
+        queue_gathered(cl, index, format, n);
+    }
+}
+
+/*
+ * The aggregation queries read the archive if it is kept, as it holds
+ * all the measurements, and the history otherwise.
+ */
+static size_t query_samples(int index, int64_t since, int64_t until,
+        history_fn *fn, void *arg)
+{
+    if (archive_enabled())
+        return archive_query(index, since, until, fn, arg);
+    return history_query(index, since, until, fn, arg);
+}
+
+/*
+ * The aggregation queries work on the converted value if the channel's
+ * format shows it, and on the raw value otherwise.
+ */
+static double sample_value(const char *format, const AMEASURE *m)
+{
+    return strchr(format, MEAS) ? m->Measure : m->MeasureRaw;
+}
+
+/* Windows of an aggregation query, filled as the samples stream by. */
+typedef struct {
+    int64_t start;
+    window_t stats;
+} aggregated_t;
+
+static __thread aggregated_t *windows;
+static __thread size_t windows_size;
+
+typedef struct {
+    const char *format;
+    int64_t since, width;
+    size_t n;               /* windows so far */
+} aggregation_t;
+
+static void aggregate_sample(void *arg, int64_t received, const AMEASURE *m)
+{
+    aggregation_t *ag = arg;
+    uint64_t offset = (uint64_t) received - ag->since;
+    int64_t start = ag->since + offset / ag->width * ag->width;
+
+    if (!ag->n || windows[ag->n - 1].start != start) {
+        if (ag->n == windows_size) {
+            windows_size = windows_size ? 2 * windows_size : 256;
+            windows = realloc(windows, windows_size * sizeof *windows);
+            if (!windows) {
+                syslog(LOG_ERR, "realloc: %m\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        windows[ag->n].start = start;
+        window_clear(&windows[ag->n++].stats);
+    }
+    window_add(&windows[ag->n - 1].stats, sample_value(ag->format, m));
+}
+
+/*
+ * Answer "aggregate? since, until, width, functions...": split the time
+ * range in windows of the given width, starting at `since', and send
+ * the functions of the values of each window holding measurements. In
+ * ASCII mode, the answer is a line with the number of windows followed
+ * by one line per window: its start time, then the functions, separated
+ * by commas. In binary mode, it is a single RECORD_AGGREGATE record.
+ */
+static void queue_aggregate(client_t *cl, int index, const char *format,
+        int64_t since, int64_t until, int64_t width,
+        const int *functions, int function_count)
+{
+    aggregation_t ag = {format, since, width, 0};
+
+    query_samples(index, since, until, aggregate_sample, &ag);
+    if (cl->binary) {
+        size_t size = 8 + 8 * function_count;
+        queue_record_header(cl, RECORD_AGGREGATE, index, ag.n * size);
+        for (size_t i = 0; i < ag.n; i++) {
+            unsigned char *p = put_u64(reserve_output(cl, size),
+                    windows[i].start);
+            for (int j = 0; j < function_count; j++)
+                p = put_f64(p, window_value(&windows[i].stats,
+                            functions[j]));
+        }
+        end_record(cl);
+        return;
+    }
+    queue_output(cl, "%zu\r\n", ag.n);
+    for (size_t i = 0; i < ag.n; i++) {
+        char text[(AGG_FUNCTIONS + 1) * NUMBER_LENGTH];
+        char *p = text;
+        for (int j = 0; j < function_count; j++) {
+            double value = window_value(&windows[i].stats, functions[j]);
+            *p++ = ',';
+            if (functions[j] == AGG_COUNT)
+                p += format_int(p, value);
+            else
+                p += format_double(p, value, cl->precision);
+        }
+        memcpy(p, "\r\n", 2);
+        queue_output(cl, "%" PRId64 ".%06d", windows[i].start / 1000000000,
+                (int) (windows[i].start % 1000000000 / 1000));
+        queue_text(cl, text, p + 2 - text);
+    }
+}
+
+/*
+ * Answer "decimate? since, until, points": send at most that many of
+ * the measurements received between these times, picked so that their
+ * plot looks like the plot of them all. The answer is the same as for
+ * "history?".
+ */
+static void queue_decimated(client_t *cl, int index, const char *format,
+        int64_t since, int64_t until, size_t points)
+{
+    size_t n = 0;
+
+    query_samples(index, since, until, gather_sample, &n);
+    if (n > points) {
+        double *x = malloc(2 * n * sizeof *x);
+        size_t *selected = malloc(points * sizeof *selected);
+        if (!x || !selected) {
+            syslog(LOG_ERR, "malloc: %m\n");
+            exit(EXIT_FAILURE);
+        }
+        double *y = x + n;
+        for (size_t i = 0; i < n; i++) {
+            x[i] = (gathered[i].received - gathered[0].received) * 1e-9;
+            y[i] = sample_value(format, &gathered[i].meas);
+        }
+        n = lttb(x, y, n, points, selected);
+        for (size_t i = 0; i < n; i++)
+            gathered[i] = gathered[selected[i]];
+        free(x);
+        free(selected);
+    }
+    queue_gathered(cl, index, format, n);
+}
+
+/*
+ * Parse a time in seconds since the epoch, to the microsecond, into *t
+ * in ns. Times beyond about 285,000 years are clamped to the int64
+ * range. Returns -1 if the text is not a number.
+ */
+static int parse_time(const char *text, int64_t *t)
+{
+    char *end;
+    double us = strtod(text, &end) * 1e6;
+
+    while (*end == ' ') end++;
+    if (end == text || *end || isnan(us)) return -1;
+    if (us > 9e15)
+        *t = INT64_MAX;
+    else if (us < -9e15)
+        *t = INT64_MIN;
+    else
+        *t = llround(us) * 1000;
+    return 0;
+}
+
+/*
+ * Answer the queries of the measurements received in a time range:
+ * "history?", "archive?", "aggregate?" and "decimate?". Returns 0, or 1
+ * if an error has been reported.
+ */
+static int queue_range_query(client_t *cl, int index, const char *format,
+        int cmd_data, parsed_command *cmd)
+{
+    int64_t since, until = INT64_MAX;
+
+    if (parse_time(cmd->param[0], &since) == -1 || (cmd->n_param > 1
+                && parse_time(cmd->param[1], &until) == -1)) {
+        report_error(cl, "Invalid time");
+        return 1;
+    }
+    switch (cmd_data) {
+        case history:
+            queue_history(cl, index, format, since, until);
+            break;
+        case archive:
+            queue_archive(cl, index, format, since, until);
+            break;
+        case aggregate:;
+            int functions[AGG_FUNCTIONS];
+            int64_t width;
+            if (parse_time(cmd->param[2], &width) == -1 || width <= 0) {
+                report_error(cl, "Invalid aggregation window");
+                return 1;
+            }
+            for (int i = 3; i < cmd->n_param; i++) {
+                functions[i - 3] = aggregate_function(cmd->param[i]);
+                if (functions[i - 3] == -1) {
+                    report_error(cl, "Invalid aggregate function");
+                    return 1;
+                }
+            }
+            queue_aggregate(cl, index, format, since, until, width, functions,
+                    cmd->n_param - 3);
+            break;
+        case decimate:;
+            int points = atoi(cmd->param[2]);
+            if (points < 2) {
+                report_error(cl, "Invalid point count");
+                return 1;
+            }
+            queue_decimated(cl, index, format, since, until, points);
+            break;
+    }
+    return 0;
+}
+
+/*
+ * Fields of the channel configuration, in the order of the reply to
+ * `config?', with their keys for the "key=value" form of `config'.
+ */
+enum { CONFIG_MODE, CONFIG_AVERAGING, CONFIG_POLLING, CONFIG_PRIORITY,
+    CONFIG_FIFOSIZE, CONFIG_VRANGE, CONFIG_IRANGE, CONFIG_FIELDS };
+
+static const char *const config_keys[CONFIG_FIELDS] = { "mode",
+    "averaging", "polling", "priority", "fifosize", "voltage:range",
+    "current:range" };
+
+/*
+ * Read an integer field of the configuration. As in the reply to
+ * `config?', it may be followed by its name in parentheses, which is
+ * ignored. Returns 0 if invalid.
+ */
+static int read_config_int(const char *text, int *value)
+{
+    char *end;
+
+    errno = 0;
+    long v = strtol(text, &end, 10);
+    if (end == text || errno || v < INT_MIN || v > INT_MAX) return 0;
+    end += strspn(end, " ");
+    if (*end == '(' && (end = strchr(end, ')')))
+        end += 1 + strspn(end + 1, " ");
+    if (!end || *end) return 0;
+    *value = v;
+    return 1;
+}
+
+/* Read a floating-point field of the configuration. */
+static int read_config_double(const char *text, double *value)
 {
-    size_t n = strlen(format);
-    for (size_t i = 0; i < n; i++) {
-        switch (format[i]) {
-            case RAW:    queue_output(cl, "raw");       break;
-            case MEAS:   queue_output(cl, "converted"); break;
-            case RANGEI: queue_output(cl, "range_i");   break;
-            case RANGEV: queue_output(cl, "range_v");   break;
-            case TIME:   queue_output(cl, "time");      break;
-            case STATUS: queue_output(cl, "status");    break;
-            case NUMBER: queue_output(cl, "number");    break;
-            case COUNT:  queue_output(cl, "count");     break;
-        }
-        if (i < n - 1) queue_output(cl, ",");
-    }
-    queue_output(cl, "\r\n");
+    char *end;
+
+    double v = strtod(text, &end);
+    if (end == text || end[strspn(end, " ")]) return 0;
+    *value = v;
+    return 1;
 }
 
-/* Send a measurement as per the requested format. */
-static void queue_measurement(client_t *cl,
-        const char *format, AMEASURE *m, int count)
+/*
+ * Apply the parameters of a `config' command. Each one is either
+ * "key=value" or a value for the field at its position. Empty values
+ * leave their fields unchanged. Returns 0, without changing anything,
+ * if any parameter is invalid.
+ */
+static int apply_config(CHANNELPARAMETER *channel, parsed_command *cmd)
 {
-    size_t n = strlen(format);
-    for (size_t i = 0; i < n; i++) {
-        switch (format[i]) {
-            case RAW:    queue_output(cl, "%g", m->MeasureRaw);  break;
-            case MEAS:   queue_output(cl, "%g", m->Measure);     break;
-            case RANGEI: queue_output(cl, "%g", m->ValueRangeI); break;
-            case RANGEV: queue_output(cl, "%g", m->ValueRangeV); break;
-            case TIME:   queue_output(cl, "%d", m->Time);        break;
-            case STATUS: queue_output(cl, "%d", m->Status);      break;
-            case NUMBER: queue_output(cl, "%d", m->Number);      break;
-            case COUNT:  queue_output(cl, "%d", count);          break;
+    CHANNELPARAMETER new = *channel;
+
+    for (int i = 0; i < cmd->n_param; i++) {
+        const char *value = cmd->param[i];
+        const char *equal = strchr(value, '=');
+        int field = i;
+        if (equal) {
+            size_t len = equal - value;
+            while (len > 0 && value[len-1] == ' ') len--;
+            for (field = 0; field < CONFIG_FIELDS; field++)
+                if (strncasecmp(value, config_keys[field], len) == 0
+                        && config_keys[field][len] == '\0')
+                    break;
+            value = equal + 1 + strspn(equal + 1, " ");
         }
-        if (i < n - 1) queue_output(cl, ",");
+        if (field >= CONFIG_FIELDS) return 0;
+        if (!*value) continue;
+        int ok = 0;
+        switch (field) {
+            case CONFIG_MODE:
+                ok = read_config_int(value, &new.Mode);
+                break;
+            case CONFIG_AVERAGING:
+                ok = read_config_int(value, &new.PreAveraging);
+                break;
+            case CONFIG_POLLING:
+                ok = read_config_int(value, &new.ScrutationTime);
+                break;
+            case CONFIG_PRIORITY:
+                ok = read_config_int(value, &new.PriorityFlag);
+                break;
+            case CONFIG_FIFOSIZE:
+                ok = read_config_int(value, &new.FifoSize)
+                    && new.FifoSize >= 1;
+                break;
+            case CONFIG_VRANGE:
+                ok = read_config_double(value, &new.ValueRangeV);
+                break;
+            case CONFIG_IRANGE:
+                ok = read_config_double(value, &new.ValueRangeI);
+                break;
+        }
+        if (!ok) return 0;
     }
-    queue_output(cl, "\r\n");
+    *channel = new;
+    return 1;
 }
 
 /* Handle channels by calling GetChannelTRMC() and SetChannelTRMC(). */
@@ -346,12 +1984,42 @@ static int channel_handler(void *client, int cmd_data, parsed_command *cmd)
 
     /* Sanity check. */
     assert(client != NULL);
+    RUN_IN_ACQUISITION_THREAD(channel_handler);
     index = cmd->suffix[0];
+    int ranged = cmd_data == history || cmd_data == archive;
+    int reduced = cmd_data == aggregate || cmd_data == decimate;
+    int max_param = ranged ? 2
+        : cmd_data == aggregate ? 3 + AGG_FUNCTIONS
+        : cmd_data == decimate ? 3
+        : cmd_data == measure_all || cmd_data == measure_next;
     if (index == -1 || cmd->suffix[1] != -1
-            || (cmd->query && cmd->n_param != 0)) {
+            || (cmd->query && cmd->n_param > max_param)
+            || (cmd->query && cmd_data == unsubscribe)
+            || (cmd->query && ranged && !cmd->n_param)
+            || (cmd->query && cmd_data == aggregate && cmd->n_param < 4)
+            || (cmd->query && cmd_data == decimate && cmd->n_param < 3)
+            || (!cmd->query && (cmd_data == measure_all
+                    || cmd_data == measure_next || ranged || reduced))) {
         report_error(client, "Malformed channel command");
         return 1;
     }
+    if ((cmd_data == cursor || cmd_data == measure_next)
+            && !ring_enabled()) {
+        report_error(client, "Measurement rings disabled");
+        return 1;
+    }
+    if (cmd_data == history && !history_enabled()) {
+        report_error(client, "Measurement history disabled");
+        return 1;
+    }
+    if (cmd_data == archive && !archive_enabled()) {
+        report_error(client, "Measurement archive disabled");
+        return 1;
+    }
+    if (reduced && !history_enabled() && !archive_enabled()) {
+        report_error(client, "Measurement history and archive disabled");
+        return 1;
+    }
     if (!cmd->query) {
         int n_param_ok;
         switch (cmd_data) {
@@ -364,11 +2032,16 @@ static int channel_handler(void *client, int cmd_data, parsed_command *cmd)
                 n_param_ok = cmd->n_param >= 1 && cmd->n_param <= 3;
                 break;
             case format:
+            case c_config:
                 n_param_ok = cmd->n_param >= 1;
                 break;
             case flush:
+            case unsubscribe:
                 n_param_ok = cmd->n_param == 0;
                 break;
+            case subscribe:
+                n_param_ok = cmd->n_param <= 1;
+                break;
             default:
                 n_param_ok = cmd->n_param == 1;
         }
@@ -379,8 +2052,12 @@ static int channel_handler(void *client, int cmd_data, parsed_command *cmd)
     }
 
     /* Get the current parameters. */
-    channel.Index = index;
-    ret =  GetChannelTRMC(_BYINDEX, &channel);
+    channel_extras = get_channel_extras(index);
+    if (!channel_extras) {
+        report_error(client, const_name(_NO_SUCH_CHANNEL, error_codes));
+        return 1;
+    }
+    ret = get_channel_parameters(channel_extras, &channel);
     if (ret) {
         report_error(client, const_name(ret, error_codes));
         return 1;
@@ -390,10 +2067,10 @@ static int channel_handler(void *client, int cmd_data, parsed_command *cmd)
     if (!cmd->query) {
         switch (cmd_data) {
             case c_vrange:
-                channel.ValueRangeV = atof(cmd->param[0]);
+                channel.ValueRangeV = parse_double(cmd->param[0]);
                 break;
             case c_irange:
-                channel.ValueRangeI = atof(cmd->param[0]);
+                channel.ValueRangeI = parse_double(cmd->param[0]);
                 break;
             case c_mode:
                 channel.Mode = atoi(cmd->param[0]);
@@ -415,6 +2092,12 @@ static int channel_handler(void *client, int cmd_data, parsed_command *cmd)
                 }
                 channel.FifoSize = fifo_size;
                 break;
+            case c_config:
+                if (!apply_config(&channel, cmd)) {
+                    report_error(client, "Invalid channel configuration");
+                    return 1;
+                }
+                break;
             case c_conversion:
 
                 /* Only the "none" conversion takes a single parameter. */
@@ -425,7 +2108,6 @@ static int channel_handler(void *client, int cmd_data, parsed_command *cmd)
                 }
 
                 /* Remove the old conversion. */
-                channel_extras = get_channel_extras(index);
                 if (channel_extras->conversion) {
                     free(channel_extras->conversion);
                     channel_extras->conversion = NULL;
@@ -439,15 +2121,19 @@ static int channel_handler(void *client, int cmd_data, parsed_command *cmd)
                 if (cmd->n_param <= 1) break;  // `<=' prevents a gcc warning
 
                 /* Remember the conversion parameters. */
-                size_t sz = 0;
+                size_t len[3], sz = 0;
                 for (int i = 0; i < cmd->n_param; i++)
-                    sz += strlen(cmd->param[i]) + 1;
-                channel_extras->conversion = malloc(sz);
-                channel_extras->conversion[0] = '\0';
+                    sz += (len[i] = strlen(cmd->param[i])) + 1;
+                char *conversion = malloc(sz);
+                if (!conversion) {
+                    syslog(LOG_ERR, "malloc: %m\n");
+                    exit(EXIT_FAILURE);
+                }
+                channel_extras->conversion = conversion;
                 for (int i = 0; i < cmd->n_param; i++) {
-                    strcat(channel_extras->conversion, cmd->param[i]);
-                    if (i < cmd->n_param - 1)
-                        strcat(channel_extras->conversion, ",");
+                    memcpy(conversion, cmd->param[i], len[i]);
+                    conversion += len[i];
+                    *conversion++ = i < cmd->n_param - 1 ? ',' : '\0';
                 }
 
                 /* Use the given conversion. */
@@ -457,24 +2143,29 @@ static int channel_handler(void *client, int cmd_data, parsed_command *cmd)
                     return 1;
                 }
                 break;
-            case format:
-                channel_extras = get_channel_extras(index);
-                char *format = malloc(cmd->n_param + 1);
-                if (channel_extras->format) free(channel_extras->format);
-                channel_extras->format = format;
+            case format:;
+                char *format = channel_extras->format;
                 for (int i = 0; i < cmd->n_param; i++) {
-                    format[i] = parse_format_item(cmd->param[i]);
-                    if (!format[i]) {
+                    if (i == MAX_FORMAT
+                            || !(format[i] = parse_format_item(cmd->param[i]))) {
                         report_error(client, "Invalid format.");
-                        free(format);
-                        channel_extras->format = NULL;
+                        format[0] = '\0';
                         return 1;
                     }
                 }
                 format[cmd->n_param] = '\0';
                 break;
             case flush:
-                ret = FlushFifoTRMC(index);
+
+                /* With rings, only this client's measurements go. */
+                if (ring_enabled()) {
+                    ret = drain_channel(index);
+                    reader_t *rd = get_reader(channel_extras, requester);
+                    rd->next = ring_end(index);
+                    rd->lost = 0;
+                } else {
+                    ret = FlushFifoTRMC(index);
+                }
                 if (ret < 0) {
                     report_error(client, const_name(ret, error_codes));
                     return 1;
@@ -482,29 +2173,53 @@ static int channel_handler(void *client, int cmd_data, parsed_command *cmd)
                 if (VERBOSE(client))
                     queue_output(client, "Channel buffer flushed.\r\n");
                 return 0;  // not changing a parameter
+            case subscribe:;
+                int decimation = cmd->n_param ? atoi(cmd->param[0]) : 1;
+                if (decimation < 1) {
+                    report_error(client, "Invalid decimation factor");
+                    return 1;
+                }
+                add_subscriber(channel_extras, requester,
+                        decimation);
+                if (VERBOSE(client))
+                    queue_output(client, "%d\r\n", decimation);
+                return 0;  // not changing a parameter
+            case unsubscribe:
+                remove_subscriber(channel_extras, requester);
+                if (VERBOSE(client))
+                    queue_output(client, "Unsubscribed.\r\n");
+                return 0;  // not changing a parameter
+            case cursor:;
+                const char *text = cmd->param[0];
+                char *end;
+                errno = 0;
+                uint64_t seq = strtoull(text, &end, 10);
+                if (*text < '0' || *text > '9' || *end || errno
+                        || seq > ring_end(index)) {
+                    report_error(client, "Invalid sequence number");
+                    return 1;
+                }
+                reader_t *rd = get_reader(channel_extras, requester);
+                rd->next = seq;
+                rd->lost = 0;
+                if (VERBOSE(client))
+                    queue_output(client, "%" PRIu64 "\r\n", seq);
+                return 0;  // not changing a parameter
         }
-        ret = SetChannelTRMC(&channel);
+        ret = set_channel_parameters(channel_extras, &channel);
         if (ret) {
             report_error(client, const_name(ret, error_codes));
             return 1;
         }
-        if (VERBOSE(client)) {
-            /* Read back the parameters in order to report them. */
-            ret =  GetChannelTRMC(_BYINDEX, &channel);
-            if (ret) {
-                report_error(client, const_name(ret, error_codes));
-                return 1;
-            }
-        }
     }
 
     /* Report parameters. */
     if (cmd->query || VERBOSE(client)) switch (cmd_data) {
         case c_vrange:
-            queue_output(client, "%g\r\n", channel.ValueRangeV);
+            queue_value(client, channel.ValueRangeV);
             break;
         case c_irange:
-            queue_output(client, "%g\r\n", channel.ValueRangeI);
+            queue_value(client, channel.ValueRangeI);
             break;
         case c_address:
             queue_output(client, "%d, %d\r\n",
@@ -531,33 +2246,33 @@ static int channel_handler(void *client, int cmd_data, parsed_command *cmd)
         case c_fifosz:
             queue_output(client, "%d\r\n", channel.FifoSize);
             break;
-        case c_config:
-            queue_output(client, "%d (%s), %d, %d, %d (%s), %d, %g, %g\r\n",
+        case c_config:;
+            char vrange[NUMBER_LENGTH], irange[NUMBER_LENGTH];
+            format_double(vrange, channel.ValueRangeV, PRECISION(client));
+            format_double(irange, channel.ValueRangeI, PRECISION(client));
+            queue_output(client, "%d (%s), %d, %d, %d (%s), %d, %s, %s\r\n",
                     channel.Mode, const_name(channel.Mode, Mode_names),
                     channel.PreAveraging, channel.ScrutationTime,
                     channel.PriorityFlag,
                     const_name(channel.PriorityFlag, Priority_names),
-                    channel.FifoSize, channel.ValueRangeV,
-                    channel.ValueRangeI);
+                    channel.FifoSize, vrange, irange);
             break;
-        case c_conversion:
-            channel_extras = get_channel_extras(index);
+        case c_conversion:;
             const char *conversion = channel_extras->conversion;
             if (!conversion) conversion = "none";
             queue_output(client, "%s\r\n", conversion);
             break;
         case format:
-            channel_extras = get_channel_extras(index);
-            if (channel_extras->format)
+            if (channel_extras->format[0])
                 queue_format(client, channel_extras->format);
             else
                 queue_output(client, "No format defined.\r\n");
             break;
         case measure:
-            ret = ReadValueTRMC(index, &meas);
+            ret = read_measurement(channel_extras, &meas);
             /*
-             * A positive return value is the number of data points in
-             * the FIFO before the read. A negative value is an error
+             * A positive return value is the number of data points
+             * available before the read. A negative value is an error
              * code.
              */
             if (ret < 0) {
@@ -568,16 +2283,168 @@ static int channel_handler(void *client, int cmd_data, parsed_command *cmd)
                 report_error(client, "Measurement queue empty.");
                 return 1;
             }
-            channel_extras = get_channel_extras(index);
-            const char *format = channel_extras->format;
-            if (!format) {
-                if (channel.Etalon) format = format_raw_meas;
-                else format = format_raw;
+            queue_measurement(client, index,
+                    measurement_format(channel_extras), &meas, ret);
+            report_lost(client, channel_extras);
+            break;
+        case measure_all:;
+            int max = INT_MAX;
+            if (cmd->n_param) {
+                max = atoi(cmd->param[0]);
+                if (max < 1) {
+                    report_error(client, "Invalid measurement count");
+                    return 1;
+                }
+            }
+            ret = queue_all_measurements(client, channel_extras,
+                    measurement_format(channel_extras), max);
+            if (ret) {
+                report_error(client, const_name(ret, error_codes));
+                return 1;
+            }
+            report_lost(client, channel_extras);
+            break;
+        case measure_next:;
+            int count = INT_MAX;
+            if (cmd->n_param) {
+                count = atoi(cmd->param[0]);
+                if (count < 1) {
+                    report_error(client, "Invalid measurement count");
+                    return 1;
+                }
+            }
+            ret = queue_next_measurements(client, channel_extras,
+                    measurement_format(channel_extras), count);
+            if (ret) {
+                report_error(client, const_name(ret, error_codes));
+                return 1;
             }
-            queue_measurement(client, format, &meas, ret);
             break;
+        case cursor:
+            queue_output(client, "%" PRIu64 "\r\n",
+                    get_reader(channel_extras, requester)->next);
+            break;
+        case history:
+        case archive:
+        case aggregate:
+        case decimate:;
+            const char *format = measurement_format(channel_extras);
+            if (cmd_data == archive
+                    || (cmd_data != history && archive_enabled()))
+                forward_to_reader(index, format);
+            else if (queue_range_query(client, index, format, cmd_data,
+                        cmd))
+                return 1;
+            break;
+        case subscribe:;
+            subscriber_t *sub = find_subscriber(channel_extras, requester);
+            queue_output(client, "%d\r\n", sub ? sub->decimation : 0);
+            break;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Multi-channel scan: read one measurement from each of the given
+ * channels, and send them all on a single line, in the order of the
+ * request, each in its channel's format. A channel with no measurement
+ * available has all its fields set to "nan". In binary mode, the answer
+ * is a single RECORD_SCAN record: for each channel, its index (int32)
+ * followed by the measurement, with a count of 0 if there was none.
+ */
+
+enum { scan_list, scan_all };
+
+#define SCAN_ENTRY_SIZE (4 + MEASURE_RECORD_SIZE)
+
+static int scan_handler(void *client, int cmd_data, parsed_command *cmd)
+{
+    client_t *cl = client;
+    static int *indices;
+    static int allocated;
+    int n;
+
+    assert(client != NULL);
+    RUN_IN_ACQUISITION_THREAD(scan_handler);
+    if (!cmd->query || cmd->suffix[0] != -1 || cmd->suffix[1] != -1
+            || (cmd_data == scan_all && cmd->suffix[2] != -1)
+            || (cmd_data == scan_all && cmd->n_param != 0)
+            || (cmd_data == scan_list && cmd->n_param == 0)) {
+        report_error(client, "Malformed scan command");
+        return 1;
+    }
+
+    /* List the channels. */
+    if (cmd_data == scan_all) {
+        int ret = GetNumberOfChannelTRMC(&n);
+        if (ret) {
+            report_error(client, const_name(ret, error_codes));
+            return 1;
+        }
+    } else {
+        n = cmd->n_param;
+    }
+    if (n > allocated) {
+        allocated = n;
+        indices = realloc(indices, allocated * sizeof *indices);
+        if (!indices) {
+            syslog(LOG_ERR, "realloc: %m\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (cmd_data == scan_all) {
+            indices[i] = i;
+            continue;
+        }
+        char *end;
+        errno = 0;
+        long index = strtol(cmd->param[i], &end, 10);
+        if (end == cmd->param[i] || *end || errno
+                || index < 0 || index >= MAX_CHANNELS) {
+            report_error(client, "Invalid channel number");
+            return 1;
+        }
+        indices[i] = index;
     }
 
+    /* Read and send the measurements. */
+    if (cl->binary)
+        queue_record_header(cl, RECORD_SCAN, -1, n * SCAN_ENTRY_SIZE);
+    for (int i = 0; i < n; i++) {
+        AMEASURE meas;
+        int index = indices[i];
+        channel_t *ch = get_channel_extras(index);
+        const char *format = ch ? measurement_format(ch) : NULL;
+        int ret = format ? read_measurement(ch, &meas) : -1;
+        if (cl->binary) {
+            if (ret <= 0) {
+                memset(&meas, 0, sizeof meas);
+                ret = 0;
+            }
+            encode_measurement(put_i32(reserve_output(cl, SCAN_ENTRY_SIZE),
+                        index), &meas, ret);
+            continue;
+        }
+        if (i > 0) queue_output(cl, ",");
+        if (ret > 0) {
+            queue_fields(cl, format, &meas, ret);
+        } else {
+            if (!format) format = format_raw;
+            for (size_t j = 0; format[j]; j++)
+                queue_output(cl, j ? ",nan" : "nan");
+        }
+    }
+    if (cl->binary)
+        end_record(cl);
+    else
+        queue_output(cl, "\r\n");
+    for (int i = 0; i < n; i++) {
+        channel_t *ch = get_channel_extras(indices[i]);
+        if (ch) report_lost(cl, ch);
+    }
     return 0;
 }
 
@@ -587,7 +2454,7 @@ static int channel_handler(void *client, int cmd_data, parsed_command *cmd)
  */
 
 /* regulation sub-commands. */
-enum {r_setpoint, r_p, r_i, r_d, r_max, r_res, r_weight};
+enum {r_setpoint, r_p, r_i, r_d, r_max, r_res, r_weight, r_set, r_all};
 
 /*
  * Return the index of channel in the weights array, if found.
@@ -613,6 +2480,104 @@ static int get_regulation_slot(REGULPARAMETER *regul, int channel)
     return -1;
 }
 
+/*
+ * Apply the "key=value" parameters of a `set' command. The keys are
+ * those of the single-field commands, with "channel<j>:weight" for the
+ * weights. Empty values leave their fields unchanged. Returns an error
+ * message, without changing anything, if any parameter is invalid.
+ */
+static const char *apply_regulation(REGULPARAMETER *regul,
+        parsed_command *cmd)
+{
+    static const struct { const char *key; int field; } keys[] = {
+        {"setpoint", r_setpoint}, {"p", r_p}, {"i", r_i}, {"d", r_d},
+        {"max", r_max}, {"resistance", r_res}
+    };
+    REGULPARAMETER new = *regul;
+
+    for (int i = 0; i < cmd->n_param; i++) {
+        const char *key = cmd->param[i];
+        const char *equal = strchr(key, '=');
+        if (!equal) return "Invalid regulation settings";
+        size_t len = equal - key;
+        while (len > 0 && key[len-1] == ' ') len--;
+        int field = -1, channel = -1;
+        for (size_t j = 0; j < sizeof keys / sizeof keys[0]; j++)
+            if (strncasecmp(key, keys[j].key, len) == 0
+                    && keys[j].key[len] == '\0')
+                field = keys[j].field;
+        if (field == -1 && strncasecmp(key, "channel", 7) == 0
+                && key[7] >= '0' && key[7] <= '9') {
+            char *end;
+            long j = strtol(key + 7, &end, 10);
+            if (j <= INT_MAX && (size_t) (end - key) + 7 == len
+                    && strncasecmp(end, ":weight", 7) == 0) {
+                field = r_weight;
+                channel = j;
+            }
+        }
+        if (field == -1) return "Invalid regulation settings";
+        const char *text = equal + 1 + strspn(equal + 1, " ");
+        if (!*text) continue;
+        double value;
+        if (!read_config_double(text, &value))
+            return "Invalid regulation settings";
+        switch (field) {
+            case r_setpoint: new.SetPoint        = value; break;
+            case r_p:        new.P               = value; break;
+            case r_i:        new.I               = value; break;
+            case r_d:        new.D               = value; break;
+            case r_max:      new.HeatingMax      = value; break;
+            case r_res:      new.HeatingResistor = value; break;
+            case r_weight:;
+                int slot = get_regulation_slot(&new, channel);
+                if (slot == -1 && value != 0)
+                    return "At most 4 channels can be used for regulation";
+                if (slot != -1) {
+                    if (value == 0) {
+                        new.IndexofChannel[slot] = _EMPTY_CHANNEL;
+                        new.WeightofChannel[slot] = 1;
+                    } else {
+                        new.IndexofChannel[slot] = channel;
+                        new.WeightofChannel[slot] = value;
+                    }
+                }
+                break;
+        }
+    }
+    *regul = new;
+    return NULL;
+}
+
+/* Send all the regulation parameters, in the form accepted by `set'. */
+static void queue_regulation(void *client, const REGULPARAMETER *regul)
+{
+    char text[NUMBER_LENGTH];
+    int precision = PRECISION(client);
+
+    queue_text(client, "setpoint=", 9);
+    queue_text(client, text, format_double(text, regul->SetPoint, precision));
+    queue_text(client, ", p=", 4);
+    queue_text(client, text, format_double(text, regul->P, precision));
+    queue_text(client, ", i=", 4);
+    queue_text(client, text, format_double(text, regul->I, precision));
+    queue_text(client, ", d=", 4);
+    queue_text(client, text, format_double(text, regul->D, precision));
+    queue_text(client, ", max=", 6);
+    queue_text(client, text,
+            format_double(text, regul->HeatingMax, precision));
+    queue_text(client, ", resistance=", 13);
+    queue_text(client, text,
+            format_double(text, regul->HeatingResistor, precision));
+    for (int i = 0; i < _NB_REGULATING_CHANNEL; i++) {
+        if (regul->IndexofChannel[i] == _EMPTY_CHANNEL) continue;
+        format_double(text, regul->WeightofChannel[i], precision);
+        queue_output(client, ", channel%d:weight=%s",
+                regul->IndexofChannel[i], text);
+    }
+    queue_text(client, "\r\n", 2);
+}
+
 static int regulation_handler(void *client, int cmd_data, parsed_command *cmd)
 {
     REGULPARAMETER regul;
@@ -622,28 +2587,41 @@ static int regulation_handler(void *client, int cmd_data, parsed_command *cmd)
     assert(client != NULL);
     assert((cmd_data != r_weight && cmd->n_tok == 2)
             || (cmd_data == r_weight && cmd->n_tok == 3));
+    RUN_IN_ACQUISITION_THREAD(regulation_handler);
     index = cmd->suffix[0];
     if (index == -1
             || (cmd_data != r_weight && cmd->suffix[1] != -1)
             || (cmd_data == r_weight
                 && (cmd->suffix[1] == -1 || cmd->suffix[2] != -1))
-            || (cmd->query && cmd->n_param != 0)
-            || (!cmd->query && cmd->n_param != 1)) {
+            || (cmd->query && (cmd->n_param != 0 || cmd_data == r_set))
+            || (!cmd->query && cmd_data == r_all)
+            || (!cmd->query && cmd_data != r_set && cmd->n_param != 1)
+            || (cmd_data == r_set && cmd->n_param < 1)) {
         report_error(client, "Malformed regulation command");
         return 1;
     }
 
     /* Get the current parameters. */
-    regul.Index = index;
-    ret = GetRegulationTRMC(&regul);
+    ret = get_regulation_parameters(index, &regul);
     if (ret) {
         report_error(client, const_name(ret, error_codes));
         return 1;
     }
 
     /* Change parameters. */
-    if (!cmd->query) {
-        double value = atof(cmd->param[0]);
+    if (cmd_data == r_set) {
+        const char *error = apply_regulation(&regul, cmd);
+        if (error) {
+            report_error(client, error);
+            return 1;
+        }
+        ret = set_regulation_parameters(&regul);
+        if (ret) {
+            report_error(client, const_name(ret, error_codes));
+            return 1;
+        }
+    } else if (!cmd->query) {
+        double value = parse_double(cmd->param[0]);
         switch (cmd_data) {
             case r_setpoint: regul.SetPoint        = value; break;
             case r_p:        regul.P               = value; break;
@@ -670,49 +2648,45 @@ static int regulation_handler(void *client, int cmd_data, parsed_command *cmd)
                 }
                 break;
         }
-        ret = SetRegulationTRMC(&regul);
+        ret = set_regulation_parameters(&regul);
         if (ret) {
             report_error(client, const_name(ret, error_codes));
             return 1;
         }
-        if (VERBOSE(client)) {
-            /* Read back the parameters in order to report them. */
-            ret =  GetRegulationTRMC(&regul);
-            if (ret) {
-                report_error(client, const_name(ret, error_codes));
-                return 1;
-            }
-        }
     }
 
     /* Report parameters. */
     if (cmd->query || VERBOSE(client)) switch (cmd_data) {
         case r_setpoint:
-            queue_output(client, "%g\r\n", regul.SetPoint);
+            queue_value(client, regul.SetPoint);
             break;
         case r_p:
-            queue_output(client, "%g\r\n", regul.P);
+            queue_value(client, regul.P);
             break;
         case r_i:
-            queue_output(client, "%g\r\n", regul.I);
+            queue_value(client, regul.I);
             break;
         case r_d:
-            queue_output(client, "%g\r\n", regul.D);
+            queue_value(client, regul.D);
             break;
         case r_max:
-            queue_output(client, "%g\r\n", regul.HeatingMax);
+            queue_value(client, regul.HeatingMax);
             break;
         case r_res:
-            queue_output(client, "%g\r\n", regul.HeatingResistor);
+            queue_value(client, regul.HeatingResistor);
             break;
         case r_weight:;
             int channel = cmd->suffix[1];
             int i = get_regulation_slot(&regul, channel);
             if (i != -1 && regul.IndexofChannel[i] == channel)
-                queue_output(client, "%g\r\n", regul.WeightofChannel[i]);
+                queue_value(client, regul.WeightofChannel[i]);
             else
                 queue_output(client, "0\r\n");
             break;
+        case r_set:
+        case r_all:
+            queue_regulation(client, &regul);
+            break;
     }
 
     return 0;
@@ -750,18 +2724,25 @@ static int help(void *client, unused(int cmd_data), parsed_command *cmd)
         "help? [topic]  - display help on topic (or this general help)\r\n"
         "    available topics: board, channel, regulation\r\n"
         "verbose N      - set (N = 1) or clear (N = 0) verbose mode\r\n"
+        "precision N    - send numbers with N digits at most (6; 0: exact)\r\n"
+        "protocol P     - talk the ascii (default) or binary protocol\r\n"
+        "cache?         - return the hits and misses of the route cache\r\n"
         "start freq [,port] - start the TRMC2\r\n"
         "stop           - stop the periodic timer\r\n"
         "board:count?   - return the number of boards\r\n"
         "board<i>:      - prefix for commands addressing board i\r\n"
         "channel:count? - return the number of channels\r\n"
         "channel<i>:    - prefix for commands addressing channel i\r\n"
+        "measure:scan? i,j,... - read a measurement from each channel\r\n"
+        "measure:scan:all? - read a measurement from every channel\r\n"
         "regulation<i>: - prefix for commands addressing regulation i\r\n"
         "error?         - pop and return last error from the error stack\r\n"
         "error:count?   - return number of errors in the stack\r\n"
         "error:clear    - clear the error stack\r\n"
         "quit           - disconnect from the server\r\n"
         "terminate      - terminate the server process\r\n"
+        "#tag command   - execute command, tagging its reply\r\n"
+        "cmd1;cmd2;...  - execute several commands, joining the replies\r\n"
         );
     else if (strcmp(cmd->param[0], "board") == 0)
         queue_output(client, "%s",
@@ -789,12 +2770,35 @@ static int help(void *client, unused(int cmd_data), parsed_command *cmd)
         "fifosize N      - set the FIFO size\r\n"
         "config?         - return the configuration (mode, averaging,\r\n"
         "    polling, priority, fifosize, voltage:range, current:range)\r\n"
+        "config list     - set several fields of the configuration at\r\n"
+        "    once, in the above order or as key=value (e.g. fifosize=32)\r\n"
         "conversion plugin,function,initialization - define a conversion\r\n"
         "measure:format list - define the measurement format\r\n"
         "    possible list items: raw, converted, range_i, range_v,\r\n"
         "    time, status, number, count\r\n"
         "measure:flush   - discard all buffered measurements\r\n"
         "measure?        - return a measurement\r\n"
+        "measure:all? [N] - return all (at most N) buffered measurements,\r\n"
+        "    preceded by their count\r\n"
+        "measure:subscribe [N] - push one measurement out of N as they\r\n"
+        "    come, as 'channel<i>:measure data' lines\r\n"
+        "measure:unsubscribe - stop pushing measurements\r\n"
+        "measure:next? [N] - with -r, return the (at most N) measurements\r\n"
+        "    at this client's cursor, preceded by their count\r\n"
+        "measure:cursor seq - with -r, move this client's cursor\r\n"
+        "measure:cursor? - with -r, return the sequence number of the\r\n"
+        "    next measurement this client will read\r\n"
+        "history? since [,until] - with -H, return the measurements\r\n"
+        "    received between the times since and until (default: now),\r\n"
+        "    in seconds since the epoch, preceded by their count\r\n"
+        "archive? since [,until] - with -a, same as history?, from the\r\n"
+        "    archive on disk\r\n"
+        "aggregate? since,until,width,f1[,f2...] - with -H or -a, return\r\n"
+        "    the functions f1, f2... of the measurements over windows of\r\n"
+        "    width seconds; functions: min, max, mean, stddev, first,\r\n"
+        "    last, count\r\n"
+        "decimate? since,until,points - with -H or -a, return at most\r\n"
+        "    points measurements, picked to keep the shape of the curve\r\n"
         );
     else if (strcmp(cmd->param[0], "regulation") == 0)
         queue_output(client, "%s",
@@ -806,6 +2810,8 @@ static int help(void *client, unused(int cmd_data), parsed_command *cmd)
         "max val      - set maximum heating power\r\n"
         "resistance R - set resistance of heating resistor\r\n"
         "channel<i>:weight W - set weight of channel i\r\n"
+        "set key=val, ... - set several of the above at once\r\n"
+        "all?         - query all of the above\r\n"
         );
     else {
         report_error(client, "Invalid help topic");
@@ -830,6 +2836,77 @@ static int verbose(void *client, unused(int cmd_data), parsed_command *cmd)
     return 0;
 }
 
+/* syntax: "precision digits", 0 for as many digits as needed */
+static int precision(void *client, unused(int cmd_data),
+        parsed_command *cmd)
+{
+    assert(client != NULL);
+    assert(cmd->n_tok == 1);
+    if (cmd->suffix[0] != -1 || (cmd->query && cmd->n_param != 0)
+            || (!cmd->query && cmd->n_param != 1)) {
+        report_error(client, "Malformed precision command");
+        return 1;
+    }
+    if (!cmd->query) {
+        int digits = atoi(cmd->param[0]);
+        if (digits < 0 || digits > MAX_PRECISION) {
+            report_error(client, "Invalid precision");
+            return 1;
+        }
+        PRECISION(client) = digits;
+    }
+    if (cmd->query || VERBOSE(client))
+        queue_output(client, "%d\r\n", PRECISION(client));
+    return 0;
+}
+
+/* syntax: "protocol ascii" or "protocol binary" */
+static int protocol(void *client, unused(int cmd_data), parsed_command *cmd)
+{
+    client_t *cl = client;
+
+    assert(client != NULL);
+    assert(cmd->n_tok == 1);
+    if (cmd->suffix[0] != -1 || (cmd->query && cmd->n_param != 0)
+            || (!cmd->query && cmd->n_param != 1)) {
+        report_error(client, "Malformed protocol command");
+        return 1;
+    }
+    if (!cmd->query && cl->in_flight) {
+        /* Their replies are being formatted for the current protocol. */
+        report_error(client, "Commands in progress");
+        return 1;
+    }
+    if (!cmd->query) {
+        if (strcmp(cmd->param[0], "ascii") == 0)
+            cl->binary = 0;
+        else if (strcmp(cmd->param[0], "binary") == 0)
+            cl->binary = 1;
+        else {
+            report_error(client, "Invalid protocol");
+            return 1;
+        }
+    }
+    if (cmd->query || VERBOSE(client))
+        queue_output(client, "%s\r\n", cl->binary ? "binary" : "ascii");
+    return 0;
+}
+
+/* Statistics of the parser's route cache, as "hits,misses". */
+static int cache(void *client, unused(int cmd_data), parsed_command *cmd)
+{
+    unsigned long hits, misses;
+
+    assert(client != NULL);
+    if (!cmd->query || cmd->suffix[0] != -1 || cmd->n_param != 0) {
+        report_error(client, "Malformed cache command");
+        return 1;
+    }
+    parse_cache_stats(&hits, &misses);
+    queue_output(client, "%lu,%lu\r\n", hits, misses);
+    return 0;
+}
+
 /* syntax: "start frequency [, serial_port_number]" */
 static int start(void *client, unused(int cmd_data),
         parsed_command *cmd)
@@ -838,6 +2915,7 @@ static int start(void *client, unused(int cmd_data),
 
     /* Sanity check. */
     assert(cmd->n_tok == 1);
+    RUN_IN_ACQUISITION_THREAD(start);
     if (cmd->query || cmd->suffix[0] != -1
             || cmd->n_param < 1 || cmd->n_param > 2) {
         report_error(client, "Malformed start command");
@@ -868,6 +2946,7 @@ static int start(void *client, unused(int cmd_data),
 
     /* Proceed to start the TRMC2. */
     int ret = StartTRMC(&init);
+    forget_parameters();
     if (ret) {
         report_error(client, const_name(ret, error_codes));
         return 1;
@@ -881,6 +2960,7 @@ static int stop(void *client, unused(int cmd_data), parsed_command *cmd)
 {
     /* Sanity check. */
     assert(cmd->n_tok == 1);
+    RUN_IN_ACQUISITION_THREAD(stop);
     if (cmd->query || cmd->suffix[0] != -1 || cmd->n_param != 0) {
         report_error(client, "Malformed stop command");
         return 1;
@@ -931,11 +3011,100 @@ enum { Start, Stop, GetError, GetNumberOfChannel, GetChannel,
     SetChannel, GetRegulation, SetRegulation, GetNumberOfBoard,
     GetBoard, SetBoard, ReadValue };
 
+/*
+ * Replies to raw commands are comma-separated lists in ASCII mode. In
+ * binary mode, they are RECORD_RAW records where each item is a type
+ * byte ('i': int32, 'd': float64, 's': uint16 length + bytes) followed
+ * by its value.
+ */
+typedef struct {
+    client_t *client;
+    int items;              /* number of items so far */
+    size_t size;            /* size of the binary payload */
+} raw_reply;
+
+/* Buffer for the binary payload. */
+static unsigned char *reply_data;
+static size_t reply_allocated;
+
+/* Make room for n more bytes in the binary payload. */
+static unsigned char *reply_reserve(raw_reply *r, size_t n)
+{
+    if (r->size + n > reply_allocated) {
+        reply_allocated = 2 * (r->size + n);
+        reply_data = realloc(reply_data, reply_allocated);
+        if (!reply_data) {
+            syslog(LOG_ERR, "realloc: %m\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    unsigned char *p = reply_data + r->size;
+    r->size += n;
+    return p;
+}
+
+static void reply_int(raw_reply *r, int value)
+{
+    if (r->client->binary) {
+        unsigned char *p = reply_reserve(r, 5);
+        *p++ = 'i';
+        put_i32(p, value);
+    } else {
+        char text[NUMBER_LENGTH] = ",";
+        int n = r->items ? 1 : 0;
+        n += format_int(text + n, value);
+        queue_text(r->client, text, n);
+    }
+    r->items++;
+}
+
+static void reply_double(raw_reply *r, double value)
+{
+    if (r->client->binary) {
+        unsigned char *p = reply_reserve(r, 9);
+        *p++ = 'd';
+        put_f64(p, value);
+    } else {
+        char text[NUMBER_LENGTH + 1] = ",";
+        int n = r->items ? 1 : 0;
+        n += format_double(text + n, value, PRECISION(r->client));
+        queue_text(r->client, text, n);
+    }
+    r->items++;
+}
+
+static void reply_string(raw_reply *r, const char *value)
+{
+    if (r->client->binary) {
+        size_t n = strlen(value);
+        if (n > UINT16_MAX) n = UINT16_MAX;
+        unsigned char *p = reply_reserve(r, 3 + n);
+        *p++ = 's';
+        p = put_u16(p, n);
+        memcpy(p, value, n);
+    } else {
+        queue_output(r->client, r->items ? ",%s" : "%s", value);
+    }
+    r->items++;
+}
+
+static void reply_end(raw_reply *r)
+{
+    if (r->client->binary)
+        queue_record(r->client, RECORD_RAW, -1, reply_data, r->size);
+    else
+        queue_output(r->client, "\r\n");
+}
+
 static int raw_command(void *client, int cmd_data, parsed_command *cmd)
 {
+    RUN_IN_ACQUISITION_THREAD(raw_command);
+    raw_reply reply = {client, 0, 0};
+    raw_reply *r = &reply;
     int request_id = 0;
     if (cmd->n_param < 1) goto bad_arg_count;
     request_id = atoi(cmd->param[0]);
+    reply_int(r, request_id);
     switch (cmd_data) {
         case Start: {
             if (cmd->n_param != 4) goto bad_arg_count;
@@ -944,35 +3113,36 @@ static int raw_command(void *client, int cmd_data, parsed_command *cmd)
             init.Frequency =         atoi(cmd->param[2]);
             init.CommunicationTime = atoi(cmd->param[3]);
             int ret = StartTRMC(&init);
-            queue_output(client, "%d,%d,%d,%d,%d\r\n", request_id, ret,
-                    init.Com,
-                    init.Frequency,
-                    init.CommunicationTime);
+            forget_parameters();
+            reply_int(r, ret);
+            reply_int(r, init.Com);
+            reply_int(r, init.Frequency);
+            reply_int(r, init.CommunicationTime);
             break;
         }
         case Stop: {
             if (cmd->n_param != 1) goto bad_arg_count;
             int ret = StopTRMC();
-            queue_output(client, "%d,%d\r\n", request_id, ret);
+            reply_int(r, ret);
             break;
         }
         case GetError: {
             if (cmd->n_param != 1) goto bad_arg_count;
             ERRORS errors;
             int ret = GetSynchroneousErrorTRMC(&errors);
-            queue_output(client, "%d,%d,%d,%d,%d,%d\r\n", request_id, ret,
-                    errors.CommError,
-                    errors.CalcError,
-                    errors.TimerError,
-                    errors.Date);
+            reply_int(r, ret);
+            reply_int(r, errors.CommError);
+            reply_int(r, errors.CalcError);
+            reply_int(r, errors.TimerError);
+            reply_int(r, errors.Date);
             break;
         }
         case GetNumberOfChannel: {
             if (cmd->n_param != 1) goto bad_arg_count;
             int channel_count;
             int ret = GetNumberOfChannelTRMC(&channel_count);
-            queue_output(client, "%d,%d,%d\r\n", request_id, ret,
-                    channel_count);
+            reply_int(r, ret);
+            reply_int(r, channel_count);
             break;
         }
         case GetChannel:
@@ -987,8 +3157,8 @@ static int raw_command(void *client, int cmd_data, parsed_command *cmd)
             int N = 1 + is_getter;
             strncpy(channel.name, cmd->param[N+0], _LENGTHOFNAME - 1);
             channel.name[_LENGTHOFNAME - 1] = '\0';
-            channel.ValueRangeI =    atof(cmd->param[N+1]);
-            channel.ValueRangeV =    atof(cmd->param[N+2]);
+            channel.ValueRangeI =    parse_double(cmd->param[N+1]);
+            channel.ValueRangeV =    parse_double(cmd->param[N+2]);
             channel.BoardAddress =   atoi(cmd->param[N+3]);
             channel.SubAddress =     atoi(cmd->param[N+4]);
             channel.BoardType =      atoi(cmd->param[N+5]);
@@ -1004,25 +3174,26 @@ static int raw_command(void *client, int cmd_data, parsed_command *cmd)
             } else {
                 /* Preserve the field `Etalon'. */
                 CHANNELPARAMETER channel_old = channel;
-                GetChannelTRMC(_BYINDEX, &channel_old);
+                channel_t *ch = get_channel_extras(channel.Index);
+                if (ch) get_channel_parameters(ch, &channel_old);
+                else GetChannelTRMC(_BYINDEX, &channel_old);
                 channel.Etalon = channel_old.Etalon;
                 ret = SetChannelTRMC(&channel);
+                if (ch) ch->cached = 0;
             }
-            queue_output(client,
-                    "%d,%d,%s,%e,%e,%d,%d,%d,%d,%d,%d,%d,%d,%d\r\n",
-                    request_id, ret,
-                    channel.name,
-                    channel.ValueRangeI,
-                    channel.ValueRangeV,
-                    channel.BoardAddress,
-                    channel.SubAddress,
-                    channel.BoardType,
-                    channel.Index,
-                    channel.Mode,
-                    channel.PreAveraging,
-                    channel.ScrutationTime,
-                    channel.PriorityFlag,
-                    channel.FifoSize);
+            reply_int(r, ret);
+            reply_string(r, channel.name);
+            reply_double(r, channel.ValueRangeI);
+            reply_double(r, channel.ValueRangeV);
+            reply_int(r, channel.BoardAddress);
+            reply_int(r, channel.SubAddress);
+            reply_int(r, channel.BoardType);
+            reply_int(r, channel.Index);
+            reply_int(r, channel.Mode);
+            reply_int(r, channel.PreAveraging);
+            reply_int(r, channel.ScrutationTime);
+            reply_int(r, channel.PriorityFlag);
+            reply_int(r, channel.FifoSize);
             break;
         }
         case GetRegulation:
@@ -1030,55 +3201,55 @@ static int raw_command(void *client, int cmd_data, parsed_command *cmd)
         {
             if (cmd->n_param != 11 + 2 * _NB_REGULATING_CHANNEL)
                 goto bad_arg_count;
-            REGULPARAMETER r;
-            strncpy(r.name, cmd->param[1], _LENGTHOFNAME - 1);
-            r.name[_LENGTHOFNAME - 1] = '\0';
-            r.SetPoint =        atof(cmd->param[2]);
-            r.P =               atof(cmd->param[3]);
-            r.I =               atof(cmd->param[4]);
-            r.D =               atof(cmd->param[5]);
-            r.HeatingMax =      atof(cmd->param[6]);
-            r.HeatingResistor = atof(cmd->param[7]);
+            REGULPARAMETER reg;
+            strncpy(reg.name, cmd->param[1], _LENGTHOFNAME - 1);
+            reg.name[_LENGTHOFNAME - 1] = '\0';
+            reg.SetPoint =        parse_double(cmd->param[2]);
+            reg.P =               parse_double(cmd->param[3]);
+            reg.I =               parse_double(cmd->param[4]);
+            reg.D =               parse_double(cmd->param[5]);
+            reg.HeatingMax =      parse_double(cmd->param[6]);
+            reg.HeatingResistor = parse_double(cmd->param[7]);
             int N = 8;
             for (int i = 0; i < _NB_REGULATING_CHANNEL; i++)
-                r.WeightofChannel[i] = atof(cmd->param[N+i]);
+                reg.WeightofChannel[i] = parse_double(cmd->param[N+i]);
             N += _NB_REGULATING_CHANNEL;
             for (int i = 0; i < _NB_REGULATING_CHANNEL; i++)
-                r.IndexofChannel[i] =  atoi(cmd->param[N+i]);
+                reg.IndexofChannel[i] =  atoi(cmd->param[N+i]);
             N += _NB_REGULATING_CHANNEL;
-            r.Index =           atoi(cmd->param[N+0]);
-            r.ThereIsABooster = atoi(cmd->param[N+1]);
-            r.ReturnTo0 =       atoi(cmd->param[N+2]);
+            reg.Index =           atoi(cmd->param[N+0]);
+            reg.ThereIsABooster = atoi(cmd->param[N+1]);
+            reg.ReturnTo0 =       atoi(cmd->param[N+2]);
             int ret;
-            if (cmd_data == GetRegulation)
-                ret = GetRegulationTRMC(&r);
-            else
-                ret = SetRegulationTRMC(&r);
-            queue_output(client, "%d,%d,%s,%e,%e,%e,%e,%e,%e,",
-                    request_id, ret,
-                    r.name,
-                    r.SetPoint,
-                    r.P,
-                    r.I,
-                    r.D,
-                    r.HeatingMax,
-                    r.HeatingResistor);
+            if (cmd_data == GetRegulation) {
+                ret = GetRegulationTRMC(&reg);
+            } else {
+                ret = SetRegulationTRMC(&reg);
+                forget_regulation(reg.Index);
+            }
+            reply_int(r, ret);
+            reply_string(r, reg.name);
+            reply_double(r, reg.SetPoint);
+            reply_double(r, reg.P);
+            reply_double(r, reg.I);
+            reply_double(r, reg.D);
+            reply_double(r, reg.HeatingMax);
+            reply_double(r, reg.HeatingResistor);
             for (int i = 0; i < _NB_REGULATING_CHANNEL; i++)
-                queue_output(client, "%e,", r.WeightofChannel[i]);
+                reply_double(r, reg.WeightofChannel[i]);
             for (int i = 0; i < _NB_REGULATING_CHANNEL; i++)
-                queue_output(client, "%d,", r.IndexofChannel[i]);
-            queue_output(client, "%d,%d,%d\r\n",
-                    r.Index,
-                    r.ThereIsABooster,
-                    r.ReturnTo0);
+                reply_int(r, reg.IndexofChannel[i]);
+            reply_int(r, reg.Index);
+            reply_int(r, reg.ThereIsABooster);
+            reply_int(r, reg.ReturnTo0);
             break;
         }
         case GetNumberOfBoard: {
             if (cmd->n_param != 1) goto bad_arg_count;
             int board_count;
             int ret = GetNumberOfBoardTRMC(&board_count);
-            queue_output(client, "%d,%d,%d\r\n", request_id, ret,
-                    board_count);
+            reply_int(r, ret);
+            reply_int(r, board_count);
             break;
         }
         case GetBoard:
@@ -1104,57 +3275,61 @@ static int raw_command(void *client, int cmd_data, parsed_command *cmd)
                     board.NumberofIRanges + board.NumberofVRanges)
                 goto bad_arg_count;
             for (int i = 0; i < board.NumberofCalibrationMeasure; i++)
-                board.CalibrationTable[i] = atof(cmd->param[N+i]);
+                board.CalibrationTable[i] = parse_double(cmd->param[N+i]);
             N += board.NumberofCalibrationMeasure;
             for (int i = 0; i < board.NumberofIRanges; i++)
-                board.IRangesTable[i] = atof(cmd->param[N+i]);
+                board.IRangesTable[i] = parse_double(cmd->param[N+i]);
             N += board.NumberofIRanges;
             for (int i = 0; i < board.NumberofVRanges; i++)
-                board.VRangesTable[i] = atof(cmd->param[N+i]);
+                board.VRangesTable[i] = parse_double(cmd->param[N+i]);
             int ret;
-            if (is_getter)
+            if (is_getter) {
                 ret = GetBoardTRMC(bywhat, &board);
-            else
+            } else {
                 ret = SetBoardTRMC(&board);
-            queue_output(client, "%d,%d,%d,%d,%d,%d,%d,%d,%d",
-                    request_id, ret,
-                    board.TypeofBoard,
-                    board.AddressofBoard,
-                    board.Index,
-                    board.CalibrationStatus,
-                    board.NumberofCalibrationMeasure,
-                    board.NumberofIRanges,
-                    board.NumberofVRanges);
+                forget_board(board.Index);
+            }
+            reply_int(r, ret);
+            reply_int(r, board.TypeofBoard);
+            reply_int(r, board.AddressofBoard);
+            reply_int(r, board.Index);
+            reply_int(r, board.CalibrationStatus);
+            reply_int(r, board.NumberofCalibrationMeasure);
+            reply_int(r, board.NumberofIRanges);
+            reply_int(r, board.NumberofVRanges);
             for (int i = 0; i < board.NumberofCalibrationMeasure; i++)
-                queue_output(client, ",%e", board.CalibrationTable[i]);
+                reply_double(r, board.CalibrationTable[i]);
             for (int i = 0; i < board.NumberofIRanges; i++)
-                queue_output(client, ",%e", board.IRangesTable[i]);
+                reply_double(r, board.IRangesTable[i]);
             for (int i = 0; i < board.NumberofVRanges; i++)
-                queue_output(client, ",%e", board.VRangesTable[i]);
-            queue_output(client, "\r\n");
+                reply_double(r, board.VRangesTable[i]);
             break;
         }
         case ReadValue: {
             if (cmd->n_param != 2) goto bad_arg_count;
             int index =  atoi(cmd->param[1]);
-            AMEASURE measure;
-            int ret = ReadValueTRMC(index, &measure);
-            queue_output(client, "%d,%d,%e,%e,%e,%e,%d,%d,%d,%d\r\n",
-                    request_id, ret,
-                    measure.MeasureRaw,
-                    measure.Measure,
-                    measure.ValueRangeI,
-                    measure.ValueRangeV,
-                    measure.Time,
-                    measure.Status,
-                    measure.Number,
-                    measure.Nothing);
+            channel_t *ch = get_channel_extras(index);
+            AMEASURE measure = {0};
+            int ret = ch ? read_measurement(ch, &measure)
+                : ReadValueTRMC(index, &measure);
+            reply_int(r, ret);
+            reply_double(r, measure.MeasureRaw);
+            reply_double(r, measure.Measure);
+            reply_double(r, measure.ValueRangeI);
+            reply_double(r, measure.ValueRangeV);
+            reply_int(r, measure.Time);
+            reply_int(r, measure.Status);
+            reply_int(r, measure.Number);
+            reply_int(r, measure.Nothing);
             break;
         }
     }
+    reply_end(r);
     return 0;
 bad_arg_count:
-    queue_output(client, "%d,Error: bad argument count\r\n", request_id);
+    if (!r->items) reply_int(r, request_id);
+    reply_string(r, "Error: bad argument count");
+    reply_end(r);
     return 1;
 }
 
@@ -1169,6 +3344,9 @@ const syntax_tree trmc2_syntax[] = {
     {"*idn", idn, 0, NULL},
     {"help", help, 0, NULL},
     {"verbose", verbose, 0, NULL},
+    {"precision", precision, 0, NULL},
+    {"protocol", protocol, 0, NULL},
+    {"cache", cache, 0, NULL},
     {"start", start, 0, NULL},
     {"stop", stop, 0, NULL},
     {"board", NULL, 0, (syntax_tree[]) {
@@ -1206,9 +3384,25 @@ const syntax_tree trmc2_syntax[] = {
         {"fifosize", channel_handler, c_fifosz, NULL},
         {"config", channel_handler, c_config, NULL},
         {"conversion", channel_handler, c_conversion, NULL},
+        {"history", channel_handler, history, NULL},
+        {"archive", channel_handler, archive, NULL},
+        {"aggregate", channel_handler, aggregate, NULL},
+        {"decimate", channel_handler, decimate, NULL},
         {"measure", channel_handler, measure, (syntax_tree[]) {
             {"format", channel_handler, format, NULL},
             {"flush", channel_handler, flush, NULL},
+            {"all", channel_handler, measure_all, NULL},
+            {"subscribe", channel_handler, subscribe, NULL},
+            {"unsubscribe", channel_handler, unsubscribe, NULL},
+            {"cursor", channel_handler, cursor, NULL},
+            {"next", channel_handler, measure_next, NULL},
+            END_OF_LIST
+        }},
+        END_OF_LIST
+    }},
+    {"measure", NULL, 0, (syntax_tree[]) {
+        {"scan", scan_handler, scan_list, (syntax_tree[]) {
+            {"all", scan_handler, scan_all, NULL},
             END_OF_LIST
         }},
         END_OF_LIST
@@ -1224,6 +3418,8 @@ const syntax_tree trmc2_syntax[] = {
             {"weight", regulation_handler, r_weight, NULL},
             END_OF_LIST
         }},
+        {"set", regulation_handler, r_set, NULL},
+        {"all", regulation_handler, r_all, NULL},
         END_OF_LIST
     }},
     {"error", get_error, 0, (syntax_tree[]) {
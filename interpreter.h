@@ -9,5 +9,44 @@ void report_error(client_t *client, const char *err);
 /* Usage: parse(command, trmc2_syntax, NULL); */
 extern const syntax_tree trmc2_syntax[];
 
+/*
+ * Execute a single command, possibly tagged ("#tag command"), reporting
+ * the parse errors. Returns the value of parse(). For a command out of
+ * a compound line, set client->line_continues and ->line_continued as
+ * get_command() does.
+ */
+int execute_command(client_t *client, char *line);
+
+/*
+ * The acquisition thread owns the TRMC2: commands that talk to it are
+ * executed there, and their replies come back asynchronously, as do
+ * the measurements pushed to subscribers. Start it before executing
+ * any command, and stop it before exiting.
+ */
+int start_acquisition(void);
+void stop_acquisition(void);
+
+/*
+ * File descriptor to watch for results of the acquisition thread. When
+ * it is readable, call deliver_results(), which queues the results in
+ * the clients' output buffers, flushes them, and then calls resume()
+ * (unless NULL) for each client that got a command completed.
+ */
+int acquisition_fd(void);
+void deliver_results(void (*resume)(client_t *cl));
+
+/*
+ * Should the client wait, i.e. not execute further commands, until
+ * some of its commands complete?
+ */
+int client_waiting(const client_t *cl);
+
+/*
+ * Start retiring a leaving client: this cancels its subscriptions and
+ * drops its cursors in the rings. The client can be deleted once
+ * cl->in_flight drops to zero.
+ */
+void retire_client(client_t *cl);
+
 /* This is set to 1 by the "quit" command. */
 extern int should_quit;
@@ -2,20 +2,30 @@
 /*
  * Network and IO functions for trmc2d. Mostly stolen from fieldd.
  *
- * To avoid blocking on input, we do a single read() when select() tells
- * us it will not block. To avoid blocking on output, we write
- * everything on an internal buffer. When there is data in the buffer,
- * we do a single write() when selects() tells un it will not block.
+ * Network sockets are non-blocking and are watched by an edge-triggered
+ * epoll loop: the caller keeps calling process_input() until it reports
+ * that no data is available. To avoid blocking on output, we write
+ * everything on a chain of buffer segments. When there is data in the
+ * chain, we writev() as much of it as the socket accepts. Data is never
+ * moved around within the chain. Ranges of files in the chain are
+ * passed to sendfile() instead.
  *
  * Debugging macro: if compiled with -DECHO_COMMANDS, all commands
  * received will be echoed on stderr.
  */
 
+#define _GNU_SOURCE     /* fopencookie() */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
@@ -23,22 +33,122 @@
 #include <netinet/tcp.h>
 #include "io.h"
 
-/* Array of clients. */
-client_t client[MAX_CLIENTS];
+/* Maximum number of free segments kept in the pool. */
+#define POOL_SIZE 256
 
-/* Get a free slot from the above array. */
-client_t *get_client_slot(void)
+/* Maximum number of segments sent by a single writev(). */
+#define MAX_IOV 64
+
+/*
+ * Pool of free output segments. Each thread has its own: the
+ * acquisition thread builds replies on segments too.
+ */
+static __thread segment_t *free_segments;
+static __thread int free_count;
+
+/* Get an empty segment, from the pool if possible. */
+static segment_t *get_segment(void)
+{
+    segment_t *seg = free_segments;
+    if (seg) {
+        free_segments = seg->next;
+        free_count--;
+    } else {
+        seg = malloc(sizeof *seg);
+        if (!seg) {
+            syslog(LOG_ERR, "malloc: %m\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    seg->next = NULL;
+    seg->fd = -1;
+    seg->start = seg->end = 0;
+    return seg;
+}
+
+/* Give a segment back to the pool. */
+static void release_segment(segment_t *seg)
+{
+    if (seg->fd != -1) close(seg->fd);
+    if (free_count >= POOL_SIZE) {
+        free(seg);
+        return;
+    }
+    seg->next = free_segments;
+    free_segments = seg;
+    free_count++;
+}
+
+/* Append an empty segment to the client's output chain. */
+static segment_t *append_segment(client_t *cl)
+{
+    segment_t *seg = get_segment();
+    if (cl->output_tail)
+        cl->output_tail->next = seg;
+    else
+        cl->output_head = seg;
+    cl->output_tail = seg;
+    return seg;
+}
+
+/* Allocate a client talking through the given file descriptors. */
+client_t *new_client(int in, int out)
 {
-    int i;
+    client_t *cl = malloc(sizeof *cl);
+    if (!cl) {
+        syslog(LOG_ERR, "malloc: %m\n");
+        return NULL;
+    }
+    cl->autoflush = 0;
+    cl->verbose = 0;
+    cl->precision = 6;  /* as printf("%g") */
+    cl->quitting = 0;
+    cl->in = in;
+    cl->out = out;
+    cl->skip_lf = 0;
+    cl->discarding = cl->overlong = 0;
+    cl->input_buffer = malloc(COMMAND_LENGTH);
+    if (!cl->input_buffer) {
+        syslog(LOG_ERR, "malloc: %m\n");
+        free(cl);
+        return NULL;
+    }
+    cl->input_size = COMMAND_LENGTH;
+    cl->input_start = cl->input_scan = cl->input_end = 0;
+    cl->input_buffer[0] = '\0';
+    cl->throttled = 0;
+    cl->binary = 0;
+    cl->tag = NULL;
+    cl->waiting = 0;
+    cl->retired = 0;
+    cl->line_continues = cl->line_continued = 0;
+    cl->joining = cl->join_open = cl->join_eol = cl->join_sep = 0;
+    cl->in_flight = 0;
+    cl->output_pending = 0;
+    cl->output_head = cl->output_tail = NULL;
+    return cl;
+}
+
+/* Close the client's file descriptors and release its slot. */
+void delete_client(client_t *cl)
+{
+    close(cl->in);
+    if (cl->out != cl->in) close(cl->out);
+    while (cl->output_head) {
+        segment_t *seg = cl->output_head;
+        cl->output_head = seg->next;
+        release_segment(seg);
+    }
+    free(cl->input_buffer);
+    free(cl);
+}
 
-    for (i=0; i<MAX_CLIENTS; i++) if (!client[i].active) break;
-    if (i == MAX_CLIENTS) return NULL;
-    client[i].autoflush = 0;
-    client[i].verbose = 0;
-    client[i].quitting = 0;
-    client[i].input_pending = 0;
-    client[i].output_pending = 0;
-    return &client[i];
+/* Make a file descriptor non-blocking. Returns -1 on error. */
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
 /* Cleanup: unlink_socket() has to be registered with atexit(). */
@@ -54,9 +164,10 @@ static void unlink_socket(void) { unlink(socket_name); }
  *  - AF_INET for a TCP port:
  *      - 'port' is the port number
  *      - 'name' is ignored.
+ * 'backlog' is the length of the queue of pending connections.
  * Returns -1 on error, the listening socket on success.
  */
-int get_socket(int domain, int port, const char *name)
+int get_socket(int domain, int port, const char *name, int backlog)
 {
     int s;
     union {
@@ -139,48 +250,459 @@ int get_socket(int domain, int port, const char *name)
         }
     }
 
-    /* listen() to one client at a time. */
-    err = listen(s, 1);
+    /* The event loop accept()s until there are no pending connections. */
+    err = set_nonblocking(s);
+    if (err) { syslog(LOG_ERR, "fcntl: %m\n"); return -1; }
+
+    /* listen() to possibly many clients. */
+    err = listen(s, backlog);
     if (err) { syslog(LOG_ERR, "listen: %m\n"); return -1; }
 
     return s;
 }
 
-/* Get a command from the input buffer. */
-char *get_command(client_t *cl, char *command)
+/*
+ * Accept a pending connection on the listening socket and make it
+ * non-blocking. Returns the new socket, or -1 if there is no pending
+ * connection or on error.
+ */
+int accept_connection(int ls)
+{
+    int s = accept(ls, NULL, NULL);
+    if (s == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            syslog(LOG_ERR, "accept: %m\n");
+        return -1;
+    }
+    if (set_nonblocking(s) == -1) {
+        syslog(LOG_ERR, "fcntl: %m\n");
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/*
+ * Get a command from the input buffer. Only the bytes that have not
+ * been scanned by a previous call are searched for a command
+ * terminator: end of line or `;'. While an over-long command is being
+ * discarded, only the end of line counts, and the bytes scanned are
+ * dropped.
+ */
+char *get_command(client_t *cl)
 {
-    char *eol = strpbrk(cl->input_buffer, "\r\n");
-    if (!eol) return NULL;
+    char *buffer = cl->input_buffer;
+    char *end = buffer + cl->input_end;
+
+    /* Drop the LF of a CRLF that was split across two reads. */
+    if (cl->skip_lf && cl->input_start < cl->input_end) {
+        if (buffer[cl->input_start] == '\n')
+            cl->input_start++;
+        if (cl->input_scan < cl->input_start)
+            cl->input_scan = cl->input_start;
+        cl->skip_lf = 0;
+    }
+
+    /* Look for the end of the command. */
+    char *eol = buffer + cl->input_scan;
+    while (eol < end && *eol != '\n' && *eol != '\r'
+            && (*eol != ';' || cl->discarding))
+        eol++;
+    if (eol == end) {
+        if (cl->discarding) cl->input_start = cl->input_end;
+        cl->input_scan = cl->input_end;
+        return NULL;
+    }
+
+    /* Cut the command in place. */
+    char *command = buffer + cl->input_start;
     char *next_cmd = eol + 1;
-    if (eol[0] == '\r' && eol[1] == '\n') next_cmd++;
+    if (*eol == '\r') {
+        if (next_cmd == end) cl->skip_lf = 1;
+        else if (*next_cmd == '\n') next_cmd++;
+    }
+    cl->line_continued = cl->line_continues;
+    cl->line_continues = *eol == ';';
+    cl->overlong = cl->discarding;
+    cl->discarding = 0;
     *eol = '\0';
-    strcpy(command, cl->input_buffer);
-    size_t shift = next_cmd - cl->input_buffer;
-    memmove(cl->input_buffer, next_cmd, cl->input_pending - shift);
-    cl->input_pending -= shift;
-    cl->input_buffer[cl->input_pending] = '\0';
+    cl->input_start = cl->input_scan = next_cmd - buffer;
     return command;
 }
 
+/* Copy data to the client output chain. */
+void queue_bytes(client_t *cl, const char *data, size_t n)
+{
+    while (n) {
+        segment_t *seg = cl->output_tail;
+        if (!seg || seg->fd != -1 || seg->end == SEGMENT_SIZE)
+            seg = append_segment(cl);
+        size_t chunk = SEGMENT_SIZE - seg->end;
+        if (chunk > n) chunk = n;
+        memcpy(seg->data + seg->end, data, chunk);
+        seg->end += chunk;
+        cl->output_pending += chunk;
+        data += chunk;
+        n -= chunk;
+    }
+}
+
+/* Queue a range of a file. */
+void queue_file(client_t *cl, int fd, size_t offset, size_t length)
+{
+    segment_t *seg = append_segment(cl);
+    seg->fd = fd;
+    seg->start = offset;
+    seg->end = offset + length;
+    cl->output_pending += length;
+    if (cl->autoflush) while (cl->output_pending)
+        process_output(cl);
+}
+
+/* Little-endian encoding. */
+unsigned char *put_u16(unsigned char *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+unsigned char *put_i32(unsigned char *p, int32_t v)
+{
+    uint32_t u = v;
+    for (int i = 0; i < 4; i++, u >>= 8) p[i] = u;
+    return p + 4;
+}
+
+unsigned char *put_u64(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++, v >>= 8) p[i] = v;
+    return p + 8;
+}
+
+unsigned char *put_f64(unsigned char *p, double v)
+{
+    uint64_t u;
+    memcpy(&u, &v, sizeof u);
+    return put_u64(p, u);
+}
+
+/* Move the pending output of the client to the buffer. */
+void take_output(client_t *cl, char *buffer)
+{
+    while (cl->output_head) {
+        segment_t *seg = cl->output_head;
+        memcpy(buffer, seg->data + seg->start, seg->end - seg->start);
+        buffer += seg->end - seg->start;
+        cl->output_head = seg->next;
+        release_segment(seg);
+    }
+    cl->output_tail = NULL;
+    cl->output_pending = 0;
+}
+
+static void queue_header(client_t *cl, int type, int channel, size_t size)
+{
+    unsigned char header[RECORD_HEADER_SIZE];
+    unsigned char *p = header;
+
+    p = put_i32(p, size);
+    p = put_u16(p, type);
+    put_u16(p, channel);
+    queue_bytes(cl, (const char *) header, sizeof header);
+}
+
+/* The binary reply to a tagged command starts with the tag. */
+static void queue_tag_record(client_t *cl)
+{
+    size_t n = strlen(cl->tag);
+    queue_header(cl, RECORD_TAG, -1, n);
+    queue_bytes(cl, cl->tag, n);
+    cl->tag_output = 1;
+}
+
+/* Queue a binary record in the client output buffer. */
+void queue_record(client_t *cl, int type, int channel,
+        const void *payload, size_t size)
+{
+    if (cl->tag && !cl->tag_output)
+        queue_tag_record(cl);
+    queue_header(cl, type, channel, size);
+    queue_bytes(cl, payload, size);
+    if (cl->autoflush) while (cl->output_pending)
+        process_output(cl);
+}
+
+/* Queue a record header, the payload coming later. */
+void queue_record_header(client_t *cl, int type, int channel, size_t size)
+{
+    if (cl->tag && !cl->tag_output)
+        queue_tag_record(cl);
+    queue_header(cl, type, channel, size);
+}
+
+/* Get room for n bytes at the end of the chain, to be written in place. */
+unsigned char *reserve_output(client_t *cl, size_t n)
+{
+    segment_t *seg = cl->output_tail;
+    if (!seg || seg->fd != -1 || SEGMENT_SIZE - seg->end < n)
+        seg = append_segment(cl);
+    unsigned char *p = (unsigned char *) seg->data + seg->end;
+    seg->end += n;
+    cl->output_pending += n;
+    return p;
+}
+
+/* End a record whose payload was written by reserve_output(). */
+void end_record(client_t *cl)
+{
+    if (cl->autoflush) while (cl->output_pending)
+        process_output(cl);
+}
+
+/* Queue text, prefixing each line with the tag of the current command. */
+static void queue_tagged_text(client_t *cl, const char *text, size_t n)
+{
+    while (n) {
+        if (cl->tag_line_start) {
+            queue_bytes(cl, "#", 1);
+            queue_bytes(cl, cl->tag, strlen(cl->tag));
+            queue_bytes(cl, " ", 1);
+        }
+        const char *eol = memchr(text, '\n', n);
+        size_t len = eol ? (size_t) (eol - text) + 1 : n;
+        queue_bytes(cl, text, len);
+        cl->tag_line_start = eol != NULL;
+        text += len;
+        n -= len;
+    }
+    cl->tag_output = 1;
+}
+
+/*
+ * Queue text, joining the replies of a compound line: the CRLF ending
+ * each chunk is held back, and only sent if more text comes as part of
+ * the same reply. Otherwise, it becomes a `;' or the end of the line.
+ */
+static void queue_joined_text(client_t *cl, const char *text, size_t n)
+{
+    if (!n) return;
+    if (cl->join_eol)
+        queue_bytes(cl, "\r\n", 2);
+    else if (cl->join_sep)
+        queue_bytes(cl, ";", 1);
+    cl->join_eol = cl->join_sep = 0;
+    if (n >= 2 && text[n-2] == '\r' && text[n-1] == '\n') {
+        n -= 2;
+        cl->join_eol = 1;
+    }
+    queue_bytes(cl, text, n);
+    cl->join_open = 1;
+}
+
+/* Text for a binary, tagged or joined reply. */
+static void queue_special_text(client_t *cl, const char *text, size_t n)
+{
+    if (cl->binary)
+        queue_record(cl, RECORD_TEXT, -1, text, n);
+    else if (cl->tag)
+        queue_tagged_text(cl, text, n);
+    else
+        queue_joined_text(cl, text, n);
+}
+
+/*
+ * Messages longer than a segment cannot be formatted in one piece: they
+ * are printed to a stream whose writes go to the output chain of
+ * stream_client, as they come. Each thread has its own stream, created
+ * on first use, and unbuffered, so that it never allocates.
+ */
+static __thread FILE *chain_stream;
+static __thread client_t *stream_client;
+static __thread int stream_cr;  /* a CR held back from a joined reply */
+
+static ssize_t write_to_chain(void *cookie, const char *data, size_t n)
+{
+    client_t *cl = stream_client;
+    size_t len = n;
+
+    (void) cookie;
+    if (cl->binary || !(cl->tag || cl->joining)) {
+        queue_bytes(cl, data, n);
+    } else if (cl->tag) {
+        queue_tagged_text(cl, data, n);
+    } else {
+        /* Keep a CRLF whole, for queue_joined_text() to hold it back. */
+        if (stream_cr && len && data[0] == '\n') {
+            queue_joined_text(cl, "\r\n", 2);
+            data++;
+            len--;
+        } else if (stream_cr) {
+            queue_joined_text(cl, "\r", 1);
+        }
+        stream_cr = len && data[len - 1] == '\r';
+        queue_joined_text(cl, data, len - stream_cr);
+    }
+    return n;
+}
+
+/* Queue a message of n bytes, longer than a segment, through the stream. */
+static void stream_output(client_t *cl, int n, const char *fmt, va_list ap)
+{
+    if (!chain_stream) {
+        cookie_io_functions_t functions = {.write = write_to_chain};
+        chain_stream = fopencookie(NULL, "w", functions);
+        if (!chain_stream) {
+            syslog(LOG_ERR, "fopencookie: %m\n");
+            exit(EXIT_FAILURE);
+        }
+        setvbuf(chain_stream, NULL, _IONBF, 0);
+    }
+    if (cl->binary)
+        queue_record_header(cl, RECORD_TEXT, -1, n);
+    stream_client = cl;
+    vfprintf(chain_stream, fmt, ap);
+    if (stream_cr) {
+        queue_joined_text(cl, "\r", 1);
+        stream_cr = 0;
+    }
+}
+
+/*
+ * Format a message for a binary, tagged or joined reply, i.e. for the
+ * cases that cannot format right into the output chain: in a spare
+ * segment, from which it is edited into the chain.
+ */
+static void queue_special_output(client_t *cl, const char *fmt, va_list ap)
+{
+    segment_t *spare = get_segment();
+    va_list ap2;
+    int n;
+
+    va_copy(ap2, ap);
+    n = vsnprintf(spare->data, SEGMENT_SIZE, fmt, ap);
+    if (n < 0)
+        syslog(LOG_WARNING, "vsnprintf: %m\n");
+    else if (n < SEGMENT_SIZE)
+        queue_special_text(cl, spare->data, n);
+    else
+        stream_output(cl, n, fmt, ap2);
+    va_end(ap2);
+    release_segment(spare);
+}
+
+/* Start the reply to a tagged command. */
+void begin_tagged_reply(client_t *cl, const char *tag)
+{
+    end_joined_line(cl);
+    cl->tag = tag;
+    cl->tag_line_start = 1;
+    cl->tag_output = 0;
+}
+
+/* End the reply to a tagged command, acknowledging it if it was silent. */
+void end_tagged_reply(client_t *cl)
+{
+    if (cl->binary && !cl->tag_output) {
+        queue_tag_record(cl);
+    } else if (!cl->binary && !cl->tag_output) {
+        queue_bytes(cl, "#", 1);
+        queue_bytes(cl, cl->tag, strlen(cl->tag));
+        queue_bytes(cl, "\r\n", 2);
+    } else if (!cl->binary && !cl->tag_line_start)
+        queue_bytes(cl, "\r\n", 2);
+    cl->tag = NULL;
+    if (cl->autoflush) while (cl->output_pending)
+        process_output(cl);
+}
+
+/* Start the reply to an untagged command of a compound line. */
+void begin_joined_reply(client_t *cl)
+{
+    cl->joining = 1;
+}
+
+/* End that reply, and the line if this was its last command. */
+void end_joined_reply(client_t *cl)
+{
+    cl->joining = 0;
+    if (cl->join_eol) {
+        cl->join_eol = 0;
+        cl->join_sep = 1;
+    }
+    if (!cl->line_continues)
+        end_joined_line(cl);
+}
+
+/* Terminate the line of joined replies, if unfinished. */
+void end_joined_line(client_t *cl)
+{
+    if (!cl->join_open) return;
+    queue_bytes(cl, "\r\n", 2);
+    cl->join_open = cl->join_eol = cl->join_sep = 0;
+    if (cl->autoflush) while (cl->output_pending)
+        process_output(cl);
+}
+
+/* Queue text without formatting. */
+void queue_text(client_t *cl, const char *text, size_t n)
+{
+    if (cl->binary || cl->tag || cl->joining)
+        queue_special_text(cl, text, n);
+    else
+        queue_bytes(cl, text, n);
+    if (cl->autoflush) while (cl->output_pending)
+        process_output(cl);
+}
+
 /* Queue message in the client output buffer. */
 void queue_output(client_t *cl, const char *fmt, ...)
 {
-    va_list ap;
-    int available;
+    va_list ap, ap2;
+    segment_t *seg;
+    size_t available;
     int n;
 
-    available = sizeof cl->output_buffer - cl->output_pending;
+    /*
+     * Binary clients get text wrapped in records, tagged and joined
+     * replies get it edited.
+     */
+    if (cl->binary || cl->tag || cl->joining) {
+        va_start(ap, fmt);
+        queue_special_output(cl, fmt, ap);
+        va_end(ap);
+        if (cl->autoflush) while (cl->output_pending)
+            process_output(cl);
+        return;
+    }
+
+    /* Try to format the message right at the end of the chain. */
+    seg = cl->output_tail;
+    if (!seg || seg->fd != -1 || seg->end == SEGMENT_SIZE)
+        seg = append_segment(cl);
+    available = SEGMENT_SIZE - seg->end;
     va_start(ap, fmt);
-    n = vsnprintf(cl->output_buffer + cl->output_pending, available,
-            fmt, ap);
+    va_copy(ap2, ap);
+    n = vsnprintf(seg->data + seg->end, available, fmt, ap);
     va_end(ap);
+    if (n < 0) {
+        syslog(LOG_WARNING, "vsnprintf: %m\n");
+        va_end(ap2);
+        return;
+    }
 
-    /* -1 in glibc < 2.1. Space needed in C99 and glibc >= 2.1 */
-    if (n == -1 || n >= available) {
-        syslog(LOG_WARNING, "Output buffer overflow\n");
-        n = available;
+    if ((size_t) n < available) {           /* it fits */
+        seg->end += n;
+        cl->output_pending += n;
+    } else if (n < SEGMENT_SIZE) {          /* it fits in a new segment */
+        seg = append_segment(cl);
+        vsnprintf(seg->data, SEGMENT_SIZE, fmt, ap2);
+        seg->end = n;
+        cl->output_pending += n;
+    } else {                                /* bulk reply */
+        stream_output(cl, n, fmt, ap2);
     }
-    cl->output_pending += n;
+    va_end(ap2);
 
     if (cl->autoflush) while (cl->output_pending)
         process_output(cl);
@@ -188,52 +710,125 @@ void queue_output(client_t *cl, const char *fmt, ...)
 
 /*
  * Read bytes from the client.
- * Returns the number of bytes read, 0 on disconnect.
+ * Returns the number of bytes read, 0 on disconnect, -1 if no data is
+ * available right now.
  */
 int process_input(client_t *cl)
 {
-    char *p = cl->input_buffer + cl->input_pending;
-    size_t sz = sizeof cl->input_buffer - cl->input_pending;
     int ret;
-#ifdef ECHO_COMMANDS
-    char *eol;
-#endif
+
+    /* Move the unprocessed data, if any, to the start of the buffer. */
+    if (cl->input_start) {
+        size_t pending = cl->input_end - cl->input_start;
+        memmove(cl->input_buffer, cl->input_buffer + cl->input_start,
+                pending + 1);  /* include the NUL terminator */
+        cl->input_scan -= cl->input_start;
+        cl->input_end = pending;
+        cl->input_start = 0;
+    }
+
+    /* Make room for a command longer than the buffer. */
+    if (cl->input_size - cl->input_end <= 1) {
+        if (cl->input_size < MAX_COMMAND_LENGTH) {
+            size_t size = 2 * cl->input_size;
+            char *buffer = realloc(cl->input_buffer, size);
+            if (!buffer) {
+                syslog(LOG_ERR, "realloc: %m\n");
+                exit(EXIT_FAILURE);
+            }
+            cl->input_buffer = buffer;
+            cl->input_size = size;
+        } else {  /* the command is too long: discard it */
+            syslog(LOG_WARNING, "Input buffer overflow\n");
+            cl->input_scan = cl->input_end = 0;
+            cl->discarding = 1;
+        }
+    }
 
     /* Read the client input. */
-    ret = read(cl->in, p, sz - 1);
+    char *p = cl->input_buffer + cl->input_end;
+    ret = read(cl->in, p, cl->input_size - cl->input_end - 1);
     if (ret == -1) {
-        syslog(LOG_ERR, "read: %m\n");
-        exit(EXIT_FAILURE);
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return -1;
+        syslog(LOG_WARNING, "read: %m\n");
+        return 0;  /* treat as a disconnect */
     }
-    cl->input_pending += ret;
+    cl->input_end += ret;
     p[ret] = '\0';
 
 #ifdef ECHO_COMMANDS
-    /* Testing: echo to stderr (ugly code here). */
-    if (!ret) return 0;
-    eol = strrchr(cl->input_buffer, '\n');
-    if (*eol) strcpy(eol, "\\n");
-    fprintf(stderr, "[%s]\n", cl->input_buffer);
-    if (*eol) strcpy(eol, "\n");
+    /* Testing: echo to stderr. */
+    if (ret) fprintf(stderr, "[%.*s]\n", ret, p);
 #endif
 
     return ret;
 }
 
-/* Send pending output to the client. */
+/* Send as much pending output as the client accepts. */
 void process_output(client_t *cl)
 {
-    int ret;
+    struct iovec iov[MAX_IOV];
+    segment_t *seg;
+    ssize_t ret;
+    int n;
+
+    while (cl->output_pending) {
+
+        /* A file range goes straight from the page cache. */
+        seg = cl->output_head;
+        if (seg->fd != -1) {
+            off_t offset = seg->start;
+            ret = sendfile(cl->out, seg->fd, &offset, seg->end - seg->start);
+            if (ret <= 0) {
+                if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK
+                            && errno != EINTR)) {
+                    syslog(LOG_WARNING, "sendfile: %m\n");
+                    cl->quitting = 1;
+                }
+                return;
+            }
+            cl->output_pending -= ret;
+            seg->start += ret;
+            if (seg->start == seg->end) {
+                cl->output_head = seg->next;
+                if (!cl->output_head) cl->output_tail = NULL;
+                release_segment(seg);
+            }
+            continue;
+        }
 
-    if (!cl->output_pending) return;    /* be defensive */
-    ret = write(cl->out, cl->output_buffer, cl->output_pending);
-    if (ret < 0) { syslog(LOG_WARNING, "write: %m\n"); return; }
-    if (ret > 0 && (unsigned) ret < cl->output_pending) {
+        /* Gather the pending segments, up to the next file. */
+        n = 0;
+        for (; seg && seg->fd == -1 && n < MAX_IOV; seg = seg->next) {
+            iov[n].iov_base = seg->data + seg->start;
+            iov[n].iov_len = seg->end - seg->start;
+            n++;
+        }
+        ret = writev(cl->out, iov, n);
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                syslog(LOG_WARNING, "writev: %m\n");
+                cl->quitting = 1;   /* nobody is listening */
+            }
+            return;
+        }
+        cl->output_pending -= ret;
+
+        /* Release the segments that have been fully sent. */
+        while ((seg = cl->output_head) && ret > 0) {
+            size_t len = seg->end - seg->start;
+            if ((size_t) ret < len) {
 #ifdef ECHO_COMMANDS
-        fprintf(stderr, "(partial write)\n");
+                fprintf(stderr, "(partial write)\n");
 #endif
-        memmove(cl->output_buffer, cl->output_buffer + ret,
-                cl->output_pending - ret);
+                seg->start += ret;
+                break;
+            }
+            ret -= len;
+            cl->output_head = seg->next;
+            if (!cl->output_head) cl->output_tail = NULL;
+            release_segment(seg);
+        }
     }
-    cl->output_pending -= ret;
 }
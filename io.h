@@ -1,63 +1,227 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 /*
  * Network and IO functions for trmc2d. Mostly stolen from fieldd.
+ * Include <stdint.h> before this.
  */
 
 /*
- * Maximum number of network clients. We don't want to have lots of
- * clients connected to an instrument. Use a CGI if you want the
- * Internet to know about the temperature of the cryostat.
+ * Maximum number of network clients. Client slots are allocated on
+ * demand, this is only a sanity limit for the -n option. Read-only
+ * dashboards and loggers are cheap, but think twice before letting the
+ * Internet know about the temperature of the cryostat.
  */
-#define MAX_CLIENTS 5
+#define MAX_CLIENTS 1024
 
-#define COMMAND_LENGTH 1024  /* max length of an accepted command */
+/* Default length of the queue of pending connections. */
+#define DEFAULT_BACKLOG 16
+
+/*
+ * The input buffer starts at COMMAND_LENGTH bytes and grows as needed
+ * to hold a command split across several reads, up to
+ * MAX_COMMAND_LENGTH. A longer command is dropped up to the end of its
+ * line.
+ */
+#define COMMAND_LENGTH 1024
+#define MAX_COMMAND_LENGTH (64 * 1024)
+
+/*
+ * Pending output is queued in a chain of fixed-size segments, taken
+ * from a pool shared by all clients. Sent segments go back to the pool.
+ * A segment can instead stand for a range of a file, which is sent by
+ * sendfile() and closed once sent.
+ */
+#define SEGMENT_SIZE 4096
+
+typedef struct _segment {
+    struct _segment *next;
+    int fd;                     /* file to send, or -1 for data */
+    size_t start;               /* first byte not yet sent */
+    size_t end;                 /* end of the queued data */
+    char data[SEGMENT_SIZE];
+} segment_t;
+
+/*
+ * Past this many pending output bytes, we stop executing the client's
+ * commands until it reads its replies.
+ */
+#define OUTPUT_HIGH_WATER (256 * 1024)
 
 /* Description of a client. */
 typedef struct {
-    unsigned int active: 1;     /* 1 if this slot is used */
     unsigned int autoflush: 1;  /* for tty clients only */
     unsigned int verbose: 1;    /* opted-in for verbose mode */
     unsigned int quitting: 1;   /* wants to quit */
+    unsigned int throttled: 1;  /* input paused until output drains */
+    unsigned int skip_lf: 1;    /* last command ended with a lone CR */
+    unsigned int discarding: 1; /* dropping an over-long command */
+    unsigned int overlong: 1;   /* the command is the end of one */
+    unsigned int binary: 1;     /* speaks the binary framed protocol */
+    unsigned int tag_line_start: 1;  /* next output starts a line */
+    unsigned int tag_output: 1; /* the tagged command sent something */
+    unsigned int waiting: 1;    /* an untagged command is in progress */
+    unsigned int retired: 1;    /* left, waiting for its commands */
+    unsigned int line_continues: 1;  /* command followed by `;' */
+    unsigned int line_continued: 1;  /* command preceded by `;' */
+    unsigned int joining: 1;    /* text output joins a compound reply */
+    unsigned int join_open: 1;  /* a joined reply line is unterminated */
+    unsigned int join_eol: 1;   /* ... and its last CRLF is held back */
+    unsigned int join_sep: 1;   /* ... and the next reply needs a `;' */
+    unsigned int precision: 5;  /* significant digits of numbers, 6 by
+                                   default, 0 for as many as needed */
+    const char *tag;            /* tag of the command being executed */
+    int in_flight;              /* commands in the acquisition thread */
     int in;                     /* fd for reading */
     int out;                    /* fd for writing */
-    size_t input_pending;       /* number of read bytes not processed */
-    char input_buffer[COMMAND_LENGTH];  /* NUL-terminated */
+    char *input_buffer;         /* NUL-terminated */
+    size_t input_size;          /* allocated size of input_buffer */
+    size_t input_start;         /* start of the next command */
+    size_t input_scan;          /* no line terminator before this */
+    size_t input_end;           /* end of the data read */
     size_t output_pending;      /* number of bytes pending */
-    char output_buffer[4096];
+    segment_t *output_head;     /* next segment to send */
+    segment_t *output_tail;     /* segment being filled */
 } client_t;
 
-/* Array of clients. */
-extern client_t client[MAX_CLIENTS];
+/*
+ * Allocate a client talking through the given file descriptors.
+ * Returns NULL if out of memory.
+ */
+client_t *new_client(int in, int out);
+
+/* Close the client's file descriptors and release its slot. */
+void delete_client(client_t *cl);
 
-/* Get a free slot from the above array. */
-client_t *get_client_slot(void);
+/* Get a non-blocking listening socket. */
+int get_socket(int domain, int port, const char *name, int backlog);
 
-/* Get a listening socket. */
-int get_socket(int domain, int port, const char *name);
+/*
+ * Accept a pending connection and make it non-blocking. Returns the new
+ * socket, or -1 if there is no pending connection or on error.
+ */
+int accept_connection(int ls);
 
 /*
- * Get a command from the input buffer. The caller should allocate
- * COMMAND_LENGTH bytes for `command'. Returns `command' or NULL if
- * there is no complete buffered command.
+ * Get a command from the input buffer. Returns a pointer to the
+ * NUL-terminated command, in place within the buffer, or NULL if there
+ * is no complete buffered command. The command remains valid, and can
+ * be modified, until the next call to process_input().
+ *
+ * A line can hold several commands separated by `;'. Each one is
+ * returned in turn, with cl->line_continues and cl->line_continued
+ * telling its position in the line.
+ *
+ * Once the start of an over-long command has been dropped, the rest of
+ * its line is returned as a single command, with cl->overlong set: it
+ * should not be executed.
  */
-char *get_command(client_t *cl, char *command);
+char *get_command(client_t *cl);
+
+/* Is the current command part of a `;'-separated compound line? */
+#define in_compound_line(cl) ((cl)->line_continues || (cl)->line_continued)
 
-/* Queue message in the client output buffer. */
+/*
+ * Queue message in the client output buffer. The message is never
+ * truncated: the buffer grows as needed, by pooled segments.
+ */
 #ifdef __GNUC__
 __attribute__((format(printf, 2, 3)))
 #endif
 void queue_output(client_t *cl, const char *fmt, ...);
 
+/* Copy raw data to the client output buffer. */
+void queue_bytes(client_t *cl, const char *data, size_t n);
+
+/* Queue text, like queue_output() but without formatting. */
+void queue_text(client_t *cl, const char *text, size_t n);
+
+/*
+ * Queue `length' bytes of a file, from `offset' on, to be sent as they
+ * are. The file descriptor is closed once they are sent. The pages
+ * should be in the page cache already: sending them should not wait
+ * for the disk.
+ */
+void queue_file(client_t *cl, int fd, size_t offset, size_t length);
+
+/*
+ * Move the pending output of the client to the buffer, which should be
+ * at least cl->output_pending bytes long. This leaves the output chain
+ * empty. The output should not hold any file.
+ */
+void take_output(client_t *cl, char *buffer);
+
+/*
+ * Binary framed protocol. Each record starts with an 8-byte header: the
+ * payload size (uint32), the record type (uint16) and a channel index
+ * (int16, -1 if irrelevant). All numbers are little-endian. Text output
+ * sent to a binary client is wrapped in RECORD_TEXT records.
+ */
+#define RECORD_HEADER_SIZE 8
+enum { RECORD_TEXT, RECORD_MEASURE, RECORD_RAW, RECORD_MEASURE_BLOCK,
+    RECORD_SCAN, RECORD_TAG, RECORD_SEQUENCE, RECORD_HISTORY,
+    RECORD_ARCHIVE, RECORD_AGGREGATE };
+
+/* Queue a binary record in the client output buffer. */
+void queue_record(client_t *cl, int type, int channel,
+        const void *payload, size_t size);
+
+/*
+ * Queue the header of a binary record whose payload, `size' bytes long,
+ * will be queued separately.
+ */
+void queue_record_header(client_t *cl, int type, int channel, size_t size);
+
 /*
- * The following functions may block. Use them only when select() says
- * cl-in (resp. cl->out) is ready for input (resp. output).
+ * Get room for n bytes, at most SEGMENT_SIZE, at the end of the output
+ * chain, and return a pointer to it: the caller writes a piece of a
+ * record payload there, in place. end_record() ends the record.
+ */
+unsigned char *reserve_output(client_t *cl, size_t n);
+void end_record(client_t *cl);
+
+/* Little-endian encoding. These return the pointer past the value. */
+unsigned char *put_u16(unsigned char *p, uint16_t v);
+unsigned char *put_i32(unsigned char *p, int32_t v);
+unsigned char *put_u64(unsigned char *p, uint64_t v);
+unsigned char *put_f64(unsigned char *p, double v);
+
+/*
+ * Replies to tagged commands. Between these calls, every line of text
+ * output is prefixed with "#tag ", and a lone "#tag" line acknowledges
+ * a command that sent nothing. Binary clients get a RECORD_TAG record
+ * before the reply instead, or alone if the command sent nothing. The
+ * tag string must remain valid until end_tagged_reply().
+ */
+void begin_tagged_reply(client_t *cl, const char *tag);
+void end_tagged_reply(client_t *cl);
+
+/*
+ * Replies to the untagged commands of a compound line, for text
+ * clients. The replies of consecutive commands are joined by `;' into
+ * a single line, i.e. the CRLF ending each reply is replaced by `;'
+ * unless it is the last one of the line. The end of the reply to the
+ * last command of the line (!cl->line_continues) terminates the line.
+ * Any other output (a tagged reply, a pushed measurement...) should
+ * first call end_joined_line(), which terminates an unfinished line.
+ */
+void begin_joined_reply(client_t *cl);
+void end_joined_reply(client_t *cl);
+void end_joined_line(client_t *cl);
+
+/*
+ * The following functions do not block on non-blocking file
+ * descriptors. On blocking ones, use them only when the event loop says
+ * cl->in (resp. cl->out) is ready for input (resp. output).
  */
 
 /*
  * Read bytes from the client.
- * Returns the number of bytes read, 0 on disconnect.
+ * Returns the number of bytes read, 0 on disconnect, -1 if no data is
+ * available right now.
  */
 int process_input(client_t *cl);
 
-/* Send pending output to the client. */
+/* Send as much pending output as the client accepts. */
 void process_output(client_t *cl);
+
+/* Is the client's output backlog too large to accept more commands? */
+#define output_congested(cl) ((cl)->output_pending >= OUTPUT_HIGH_WATER)
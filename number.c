@@ -0,0 +1,439 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Conversions between numbers and text.
+ *
+ * Doubles are written with the Grisu3 algorithm (F. Loitsch, "Printing
+ * floating-point numbers quickly and accurately with integers", PLDI
+ * 2010). The double and the bounds of its rounding interval are scaled
+ * by a cached power of ten into 64-bit fixed point, and the digits are
+ * generated with integer arithmetic. Grisu3 can tell when the error of
+ * the scaling may have cost it the shortest or the closest digits. This
+ * happens for about 0.5% of the doubles, which then go to printf().
+ *
+ * Rounding to a given number of digits starts from the shortest digits.
+ * This is exact, except when they end right on a tie, a rare case that
+ * also goes to printf().
+ *
+ * Doubles are read with Clinger's fast path: when the decimal
+ * significand fits in 53 bits and the power of ten is exact, a single
+ * multiplication or division is correctly rounded. Anything else goes
+ * to strtod().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include "number.h"
+
+/* A floating-point number f * 2^e with a 64-bit significand. */
+typedef struct {
+    uint64_t f;
+    int e;
+} diy_fp;
+
+/* 10^k for k = -348, -340... 340, rounded: significand, exponent, k. */
+#define FIRST_CACHED_POWER (-348)
+#define CACHED_POWER_STEP  8
+static const struct {
+    uint64_t f;
+    int16_t e;
+    int16_t k;
+} cached_powers[] = {
+    {0xfa8fd5a0081c0288, -1220, -348},
+    {0xbaaee17fa23ebf76, -1193, -340},
+    {0x8b16fb203055ac76, -1166, -332},
+    {0xcf42894a5dce35ea, -1140, -324},
+    {0x9a6bb0aa55653b2d, -1113, -316},
+    {0xe61acf033d1a45df, -1087, -308},
+    {0xab70fe17c79ac6ca, -1060, -300},
+    {0xff77b1fcbebcdc4f, -1034, -292},
+    {0xbe5691ef416bd60c, -1007, -284},
+    {0x8dd01fad907ffc3c,  -980, -276},
+    {0xd3515c2831559a83,  -954, -268},
+    {0x9d71ac8fada6c9b5,  -927, -260},
+    {0xea9c227723ee8bcb,  -901, -252},
+    {0xaecc49914078536d,  -874, -244},
+    {0x823c12795db6ce57,  -847, -236},
+    {0xc21094364dfb5637,  -821, -228},
+    {0x9096ea6f3848984f,  -794, -220},
+    {0xd77485cb25823ac7,  -768, -212},
+    {0xa086cfcd97bf97f4,  -741, -204},
+    {0xef340a98172aace5,  -715, -196},
+    {0xb23867fb2a35b28e,  -688, -188},
+    {0x84c8d4dfd2c63f3b,  -661, -180},
+    {0xc5dd44271ad3cdba,  -635, -172},
+    {0x936b9fcebb25c996,  -608, -164},
+    {0xdbac6c247d62a584,  -582, -156},
+    {0xa3ab66580d5fdaf6,  -555, -148},
+    {0xf3e2f893dec3f126,  -529, -140},
+    {0xb5b5ada8aaff80b8,  -502, -132},
+    {0x87625f056c7c4a8b,  -475, -124},
+    {0xc9bcff6034c13053,  -449, -116},
+    {0x964e858c91ba2655,  -422, -108},
+    {0xdff9772470297ebd,  -396, -100},
+    {0xa6dfbd9fb8e5b88f,  -369,  -92},
+    {0xf8a95fcf88747d94,  -343,  -84},
+    {0xb94470938fa89bcf,  -316,  -76},
+    {0x8a08f0f8bf0f156b,  -289,  -68},
+    {0xcdb02555653131b6,  -263,  -60},
+    {0x993fe2c6d07b7fac,  -236,  -52},
+    {0xe45c10c42a2b3b06,  -210,  -44},
+    {0xaa242499697392d3,  -183,  -36},
+    {0xfd87b5f28300ca0e,  -157,  -28},
+    {0xbce5086492111aeb,  -130,  -20},
+    {0x8cbccc096f5088cc,  -103,  -12},
+    {0xd1b71758e219652c,   -77,   -4},
+    {0x9c40000000000000,   -50,    4},
+    {0xe8d4a51000000000,   -24,   12},
+    {0xad78ebc5ac620000,     3,   20},
+    {0x813f3978f8940984,    30,   28},
+    {0xc097ce7bc90715b3,    56,   36},
+    {0x8f7e32ce7bea5c70,    83,   44},
+    {0xd5d238a4abe98068,   109,   52},
+    {0x9f4f2726179a2245,   136,   60},
+    {0xed63a231d4c4fb27,   162,   68},
+    {0xb0de65388cc8ada8,   189,   76},
+    {0x83c7088e1aab65db,   216,   84},
+    {0xc45d1df942711d9a,   242,   92},
+    {0x924d692ca61be758,   269,  100},
+    {0xda01ee641a708dea,   295,  108},
+    {0xa26da3999aef774a,   322,  116},
+    {0xf209787bb47d6b85,   348,  124},
+    {0xb454e4a179dd1877,   375,  132},
+    {0x865b86925b9bc5c2,   402,  140},
+    {0xc83553c5c8965d3d,   428,  148},
+    {0x952ab45cfa97a0b3,   455,  156},
+    {0xde469fbd99a05fe3,   481,  164},
+    {0xa59bc234db398c25,   508,  172},
+    {0xf6c69a72a3989f5c,   534,  180},
+    {0xb7dcbf5354e9bece,   561,  188},
+    {0x88fcf317f22241e2,   588,  196},
+    {0xcc20ce9bd35c78a5,   614,  204},
+    {0x98165af37b2153df,   641,  212},
+    {0xe2a0b5dc971f303a,   667,  220},
+    {0xa8d9d1535ce3b396,   694,  228},
+    {0xfb9b7cd9a4a7443c,   720,  236},
+    {0xbb764c4ca7a44410,   747,  244},
+    {0x8bab8eefb6409c1a,   774,  252},
+    {0xd01fef10a657842c,   800,  260},
+    {0x9b10a4e5e9913129,   827,  268},
+    {0xe7109bfba19c0c9d,   853,  276},
+    {0xac2820d9623bf429,   880,  284},
+    {0x80444b5e7aa7cf85,   907,  292},
+    {0xbf21e44003acdd2d,   933,  300},
+    {0x8e679c2f5e44ff8f,   960,  308},
+    {0xd433179d9c8cb841,   986,  316},
+    {0x9e19db92b4e31ba9,  1013,  324},
+    {0xeb96bf6ebadf77d9,  1039,  332},
+    {0xaf87023b9bf0ee6b,  1066,  340},
+};
+
+/* Product, rounded to 64 bits. */
+static diy_fp multiply(diy_fp x, diy_fp y)
+{
+    unsigned __int128 p = (unsigned __int128) x.f * y.f;
+    uint64_t high = p >> 64, low = p;
+    return (diy_fp) {high + (low >> 63), x.e + y.e + 64};
+}
+
+static diy_fp normalize(diy_fp x)
+{
+    int shift = __builtin_clzll(x.f);
+    return (diy_fp) {x.f << shift, x.e - shift};
+}
+
+/*
+ * Move the last digit down towards w, as long as the result gets closer
+ * to it and remains safely within the interval. Returns whether the
+ * digits are sure to be the shortest and the closest.
+ */
+static int round_weed(char *digits, int length, uint64_t distance_w,
+        uint64_t unsafe_interval, uint64_t rest, uint64_t ten_kappa,
+        uint64_t unit)
+{
+    uint64_t small_distance = distance_w - unit;
+    uint64_t big_distance = distance_w + unit;
+
+    while (rest < small_distance && unsafe_interval - rest >= ten_kappa
+            && (rest + ten_kappa < small_distance
+                || small_distance - rest
+                    >= rest + ten_kappa - small_distance)) {
+        digits[length - 1]--;
+        rest += ten_kappa;
+    }
+    if (rest < big_distance && unsafe_interval - rest >= ten_kappa
+            && (rest + ten_kappa < big_distance
+                || big_distance - rest > rest + ten_kappa - big_distance))
+        return 0;
+    return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+/*
+ * Generate the digits of the scaled w, stopping as soon as they are
+ * within the interval (low, high), widened by the scaling error. The
+ * value is digits * 10^kappa.
+ */
+static int generate_digits(diy_fp low, diy_fp w, diy_fp high,
+        char *digits, int *length, int *kappa)
+{
+    static const uint32_t powers_of_ten[] = { 1, 10, 100, 1000, 10000,
+        100000, 1000000, 10000000, 100000000, 1000000000 };
+    uint64_t unit = 1;
+    uint64_t too_high = high.f + unit;
+    uint64_t unsafe_interval = too_high - (low.f - unit);
+    int shift = -w.e;
+    uint64_t one = (uint64_t) 1 << shift;
+    uint32_t integrals = too_high >> shift;
+    uint64_t fractionals = too_high & (one - 1);
+    int n = 10;
+
+    while (n > 1 && integrals < powers_of_ten[n - 1]) n--;
+    uint32_t divisor = powers_of_ten[n - 1];
+    *kappa = n;
+    *length = 0;
+    while (*kappa > 0) {
+        digits[(*length)++] = '0' + integrals / divisor;
+        integrals %= divisor;
+        (*kappa)--;
+        uint64_t rest = ((uint64_t) integrals << shift) + fractionals;
+        if (rest < unsafe_interval)
+            return round_weed(digits, *length, too_high - w.f,
+                    unsafe_interval, rest, (uint64_t) divisor << shift,
+                    unit);
+        divisor /= 10;
+    }
+    for (;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval *= 10;
+        digits[(*length)++] = '0' + (fractionals >> shift);
+        fractionals &= one - 1;
+        (*kappa)--;
+        if (fractionals < unsafe_interval)
+            return round_weed(digits, *length, (too_high - w.f) * unit,
+                    unsafe_interval, fractionals, one, unit);
+    }
+}
+
+/*
+ * Shortest digits of a positive double: value = digits * 10^exponent.
+ * Returns 0 if unsure of the result.
+ */
+static int grisu3(double value, char *digits, int *length, int *exponent)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof bits);
+    uint64_t fraction = bits & (((uint64_t) 1 << 52) - 1);
+    int biased = bits >> 52;
+    diy_fp v = biased
+        ? (diy_fp) {fraction | (uint64_t) 1 << 52, biased - 1075}
+        : (diy_fp) {fraction, -1074};
+
+    /* Bounds of the rounding interval, with the exponent of w. */
+    diy_fp w = normalize(v);
+    diy_fp plus = normalize((diy_fp) {(v.f << 1) + 1, v.e - 1});
+    diy_fp minus = fraction == 0 && biased > 1
+        ? (diy_fp) {(v.f << 2) - 1, v.e - 2}
+        : (diy_fp) {(v.f << 1) - 1, v.e - 1};
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    /* Scale so that the binary exponent is within [-60, -32]. */
+    double t = (-61 - w.e) * 0.30102999566398114;
+    int k = t;
+    if (k < t) k++;
+    int i = (k - FIRST_CACHED_POWER - 1) / CACHED_POWER_STEP + 1;
+    diy_fp c = {cached_powers[i].f, cached_powers[i].e};
+
+    int kappa;
+    int ok = generate_digits(multiply(minus, c), multiply(w, c),
+            multiply(plus, c), digits, length, &kappa);
+    *exponent = kappa - cached_powers[i].k;
+    return ok;
+}
+
+/* Digits and exponent, as above, from the output of printf("%e"). */
+static int split_scientific(const char *text, char *digits, int *exponent)
+{
+    int length = 0;
+    const char *p;
+
+    for (p = text; *p != 'e'; p++)
+        if (*p >= '0' && *p <= '9') digits[length++] = *p;
+    while (length > 1 && digits[length - 1] == '0') length--;
+    *exponent = atoi(p + 1) - (length - 1);
+    return length;
+}
+
+/* Shortest digits, the slow way. */
+static int exact_digits(double value, char *digits, int *exponent)
+{
+    char text[NUMBER_LENGTH];
+    int precision = 15;     /* always enough when fewer are */
+
+    for (;;) {
+        snprintf(text, sizeof text, "%.*e", precision - 1, value);
+        if (precision == MAX_PRECISION || strtod(text, NULL) == value)
+            break;
+        precision++;
+    }
+    return split_scientific(text, digits, exponent);
+}
+
+/* Write a double. */
+int format_double(char *buffer, double value, int precision)
+{
+    char digits[MAX_PRECISION + 8], text[NUMBER_LENGTH];
+    char *p = buffer;
+    int length, exponent;
+
+    if (!isfinite(value))
+        return snprintf(buffer, NUMBER_LENGTH, "%g", value);
+    if (signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+    if (value == 0) {
+        strcpy(p, "0");
+        return p + 1 - buffer;
+    }
+    if (!grisu3(value, digits, &length, &exponent))
+        length = exact_digits(value, digits, &exponent);
+
+    /* Round to the requested precision. */
+    if (precision && length > precision) {
+        if (length == precision + 1 && digits[precision] == '5') {
+            snprintf(text, sizeof text, "%.*e", precision - 1, value);
+            length = split_scientific(text, digits, &exponent);
+        } else {
+            int up = digits[precision] >= '5';
+            exponent += length - precision;
+            length = precision;
+            if (up) {
+                int i = length - 1;
+                while (i >= 0 && digits[i] == '9') i--;
+                if (i >= 0) {
+                    digits[i]++;
+                    exponent += length - (i + 1);
+                    length = i + 1;
+                } else {
+                    digits[0] = '1';
+                    exponent += length;
+                    length = 1;
+                }
+            }
+            while (length > 1 && digits[length - 1] == '0') {
+                length--;
+                exponent++;
+            }
+        }
+    }
+
+    /* Lay the digits out as "%g" does. */
+    int x = exponent + length - 1;  /* exponent in scientific notation */
+    if (x < -4 || x >= (precision ? precision : MAX_PRECISION)) {
+        *p++ = digits[0];
+        if (length > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, length - 1);
+            p += length - 1;
+        }
+        *p++ = 'e';
+        *p++ = x < 0 ? '-' : '+';
+        if (x < 0) x = -x;
+        if (x >= 100) {
+            *p++ = '0' + x / 100;
+            x %= 100;
+        }
+        *p++ = '0' + x / 10;
+        *p++ = '0' + x % 10;
+    } else if (x < 0) {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', -x - 1);
+        p += -x - 1;
+        memcpy(p, digits, length);
+        p += length;
+    } else if (length <= x + 1) {
+        memcpy(p, digits, length);
+        memset(p + length, '0', x + 1 - length);
+        p += x + 1;
+    } else {
+        memcpy(p, digits, x + 1);
+        p += x + 1;
+        *p++ = '.';
+        memcpy(p, digits + x + 1, length - x - 1);
+        p += length - x - 1;
+    }
+    *p = '\0';
+    return p - buffer;
+}
+
+/* Write an int. */
+int format_int(char *buffer, int value)
+{
+    char digits[10];
+    unsigned int u = value < 0 ? -(unsigned int) value : (unsigned int) value;
+    int n = 0, length = 0;
+
+    do {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (value < 0) buffer[length++] = '-';
+    while (n) buffer[length++] = digits[--n];
+    buffer[length] = '\0';
+    return length;
+}
+
+/* Read a double. */
+double parse_double(const char *text)
+{
+    static const double powers_of_ten[] = { 1e0, 1e1, 1e2, 1e3, 1e4,
+        1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+        1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const char *p = text;
+    uint64_t significand = 0;
+    int significant_digits = 0, digits = 0, point = 0;
+    int negative = 0, exponent = 0;
+
+    while (*p == ' ' || (*p >= '\t' && *p <= '\r')) p++;
+    if (*p == '-' || *p == '+') negative = *p++ == '-';
+    for (;; p++) {
+        if (*p >= '0' && *p <= '9') {
+            digits++;
+            if (significand || *p != '0') {
+                if (++significant_digits > 19) return strtod(text, NULL);
+                significand = 10 * significand + (*p - '0');
+            }
+            if (point) exponent--;
+        } else if (*p == '.' && !point) {
+            point = 1;
+        } else break;
+    }
+
+    /* No digits: inf, nan or junk. Hexadecimal. */
+    if (!digits || *p == 'x' || *p == 'X') return strtod(text, NULL);
+
+    if (*p == 'e' || *p == 'E') {
+        const char *q = p + 1;
+        int negative_exponent = 0, e = 0;
+        if (*q == '-' || *q == '+') negative_exponent = *q++ == '-';
+        for (; *q >= '0' && *q <= '9'; q++)
+            if (e < 100000) e = 10 * e + (*q - '0');
+        exponent += negative_exponent ? -e : e;
+    }
+
+    if (!significand) return negative ? -0.0 : 0.0;
+    if (FLT_EVAL_METHOD == 0 && significand <= (uint64_t) 1 << 53
+            && exponent >= -22 && exponent <= 22) {
+        double value = significand;
+        if (exponent < 0) value /= powers_of_ten[-exponent];
+        else value *= powers_of_ten[exponent];
+        return negative ? -value : value;
+    }
+    return strtod(text, NULL);
+}
@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Conversions between numbers and text, faster than the printf() and
+ * strtod() families, and independent of the locale.
+ */
+
+/* Buffer size enough for any number written by the functions below. */
+#define NUMBER_LENGTH 32
+
+/* Most significant digits a double needs. */
+#define MAX_PRECISION 17
+
+/*
+ * Write a double in the layout of printf("%.*g", precision). The number
+ * gets the fewest significant digits that read back as the very same
+ * double. A non-zero precision caps the digits, the number being
+ * rounded past it: for normal numbers and precisions up to 15, the text
+ * is then the same as printf's. Precision 0 means no cap, with the
+ * layout of "%.17g". The buffer should be NUMBER_LENGTH bytes long.
+ * Returns the length of the NUL-terminated text.
+ */
+int format_double(char *buffer, double value, int precision);
+
+/* Write an int as printf("%d") does. Returns the length of the text. */
+int format_int(char *buffer, int value);
+
+/* Read a double, with the same result as atof(). */
+double parse_double(const char *text);
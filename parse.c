@@ -2,11 +2,20 @@
 /*
  * Generic parser for an SCPI-like language. See parse.h for details.
  *
+ * The first time a language is used, its syntax tree is compiled into
+ * perfect hash tables (see compile_syntax() below), so that each token
+ * is resolved in time proportional to its length, whatever the number
+ * of nodes at its level.
+ *
  * Compile with -DDEBUG_PARSE to see the parsing on stderr.
  */
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <strings.h>
+#include <ctype.h>
 #ifdef DEBUG_PARSE
 # include <stdio.h>
 #endif
@@ -15,69 +24,401 @@
 #define MAX_TOKENS 16
 #define MAX_PARAMS 128
 
+/***********************************************************************
+ * Compiled syntax trees.
+ *
+ * Each level of the syntax tree (a NULL-name terminated array of nodes)
+ * becomes a hash table of the case-folded node names and short forms.
+ * The hash only looks at the length of the token and at three of its
+ * characters, and the multiplier is chosen, when compiling, such that
+ * no two keys of a level share a slot. A lookup thus costs one hash,
+ * one slot and one comparison of the token with the key.
+ */
+
+typedef struct {
+    char *key;                  /* folded name, NULL if the slot is free */
+    int len;                    /* length of key */
+    const syntax_tree *node;    /* node matched by this key */
+    const syntax_tree *alt;     /* same name in another case, or NULL */
+    int child;                  /* level of the node's children, or -1 */
+} hash_slot;
+
+typedef struct {
+    hash_slot *slots;
+    uint32_t multiplier;
+    int shift;                  /* 32 - log2(number of slots) */
+} hash_level;
+
+typedef struct compiled_syntax {
+    const syntax_tree *language;
+    hash_level *levels;         /* levels[0] is the top level */
+    int count, size;
+    struct compiled_syntax *next;
+} compiled_syntax;
+
+/* All the languages compiled so far. */
+static compiled_syntax *compiled;
+
+/*
+ * Case folding of the characters allowed in node names: letters and
+ * `*'. Anything else folds to 0, which matches nothing.
+ */
+static unsigned char fold[256];
+
+static void init_fold(void)
+{
+    for (int c = 'a'; c <= 'z'; c++)
+        fold[c] = fold[toupper(c)] = c;
+    fold['*'] = '*';
+}
+
+static inline uint32_t hash_key(const char *s, int len)
+{
+    return len
+        ^ fold[(unsigned char) s[0]] << 8
+        ^ fold[(unsigned char) s[len > 1]] << 16
+        ^ (uint32_t) fold[(unsigned char) s[len - 1]] << 24;
+}
+
+/*
+ * Length of the SCPI short form of a node name: its first four
+ * letters, or three if the fourth is a vowel. Only lowercase names
+ * (the SCPI-style commands, not the raw libtrmc2 function names) get a
+ * short form. Returns 0 if the name has none.
+ */
+static int short_form(const char *name)
+{
+    int len = strlen(name);
+    if (len <= 4) return 0;
+    for (int i = 0; i < len; i++)
+        if (!islower((unsigned char) name[i])) return 0;
+    return strchr("aeiou", name[3]) ? 3 : 4;
+}
+
+/* A key of a level, before it is placed in the hash table. */
+typedef struct {
+    const char *name;
+    int len;
+    const syntax_tree *node;
+} level_key;
+
+/* Find a slot for each key. Returns the number of collisions. */
+static int fill_slots(hash_level *level, const level_key *keys, int n)
+{
+    int size = 1 << (32 - level->shift), collisions = 0;
+
+    memset(level->slots, 0, size * sizeof *level->slots);
+    for (int i = 0; i < n; i++) {
+        uint32_t h = hash_key(keys[i].name, keys[i].len);
+        int j = (h * level->multiplier) >> level->shift;
+        hash_slot *slot;
+        for (;;) {
+            slot = &level->slots[j];
+            if (!slot->node) break;
+            if (slot->len == keys[i].len && strncasecmp(slot->node->name,
+                        keys[i].name, keys[i].len) == 0)
+                break;
+            collisions++;
+            j = (j + 1) & (size - 1);
+        }
+        if (!slot->node) {
+            slot->len = keys[i].len;
+            slot->node = keys[i].node;
+            slot->child = -1;
+        } else if (!slot->alt && keys[i].len == (int) strlen(slot->node->name)
+                && keys[i].len == (int) strlen(keys[i].node->name)) {
+            /* Full names differing only in case. */
+            slot->alt = keys[i].node;
+        }
+    }
+    return collisions;
+}
+
+/* Compile one level of the tree. Returns its index, or -1. */
+static int compile_level(compiled_syntax *cs, const syntax_tree *tree)
+{
+    const syntax_tree *node;
+    level_key *keys;
+    int n = 0, bits, index;
+    hash_level *level;
+
+    for (node = tree; node->name; node++) n++;
+    keys = malloc(2 * n * sizeof *keys);
+    if (!keys) return -1;
+
+    /* Full names first, so that they take precedence over short forms. */
+    n = 0;
+    for (node = tree; node->name; node++) {
+        for (const char *p = node->name; *p; p++)
+            if (!fold[(unsigned char) *p]) goto fail;
+        keys[n++] = (level_key) {node->name, strlen(node->name), node};
+    }
+    for (node = tree; node->name; node++) {
+        int len = short_form(node->name);
+        if (len) keys[n++] = (level_key) {node->name, len, node};
+    }
+
+    if (cs->count == cs->size) {
+        int size = cs->size ? 2 * cs->size : 16;
+        hash_level *levels = realloc(cs->levels, size * sizeof *levels);
+        if (!levels) goto fail;
+        cs->levels = levels;
+        cs->size = size;
+    }
+    index = cs->count++;
+    level = &cs->levels[index];
+
+    /* Look for a multiplier leaving no collision. */
+    for (bits = 1; (1 << bits) < 2 * n; bits++) ;
+    level->slots = malloc((1 << (bits + 2)) * sizeof *level->slots);
+    if (!level->slots) goto fail;
+    uint32_t seed = 2654435769u;  /* 2^32 / golden ratio */
+    for (int attempt = 0; ; attempt++) {
+        level->multiplier = seed | 1;
+        level->shift = 32 - bits - attempt / 256;
+        if (fill_slots(level, keys, n) == 0 || attempt == 3 * 256 - 1)
+            break;
+        seed = seed * 1664525 + 1013904223;
+    }
+
+    /* Store the folded keys, then compile the children. */
+    int slot_count = 1 << (32 - level->shift);
+    for (int i = 0; i < slot_count; i++) {
+        hash_slot *slot = &level->slots[i];
+        if (!slot->node) continue;
+        slot->key = malloc(slot->len);
+        if (!slot->key) goto fail;
+        for (int j = 0; j < slot->len; j++)
+            slot->key[j] = fold[(unsigned char) slot->node->name[j]];
+    }
+    for (int i = 0; i < slot_count; i++) {
+        hash_slot *slot = &cs->levels[index].slots[i];
+        if (!slot->node || !slot->node->child) continue;
+        int child = compile_level(cs, slot->node->child);
+        if (child == -1) goto fail;
+        cs->levels[index].slots[i].child = child;  /* levels may move */
+    }
+    free(keys);
+    return index;
+
+fail:
+    free(keys);
+    return -1;
+}
+
+static void free_compiled(compiled_syntax *cs)
+{
+    for (int i = 0; i < cs->count; i++) {
+        hash_level *level = &cs->levels[i];
+        if (!level->slots) continue;
+        for (int j = 0; j < 1 << (32 - level->shift); j++)
+            free(level->slots[j].key);
+        free(level->slots);
+    }
+    free(cs->levels);
+    free(cs);
+}
+
+/* Find the compiled form of a language, compiling it if needed. */
+static const compiled_syntax *get_compiled(const syntax_tree *language)
+{
+    compiled_syntax *cs;
+
+    for (cs = compiled; cs; cs = cs->next)
+        if (cs->language == language) return cs;
+
+    if (!fold['*']) init_fold();
+    cs = calloc(1, sizeof *cs);
+    if (!cs) return NULL;
+    cs->language = language;
+    if (compile_level(cs, language) == -1) {
+        free_compiled(cs);
+        return NULL;
+    }
+    cs->next = compiled;
+    compiled = cs;
+    return cs;
+}
+
+int compile_syntax(const syntax_tree *language)
+{
+    return get_compiled(language) ? 0 : -1;
+}
+
 /*
- * Remove the numeric suffix from the token and return it.
- * *token is incremented past the added '\0'.
+ * Find the node matching the token (of length len) at the given level,
+ * and set *level
+ * to the level of its children. Returns NULL if no node matches.
+ */
+static const syntax_tree *lookup(const compiled_syntax *cs, int *level,
+        const char *token, int len)
+{
+    const hash_level *lv = &cs->levels[*level];
+    if (!len) return NULL;
+    uint32_t mask = (1u << (32 - lv->shift)) - 1;
+    uint32_t j = (hash_key(token, len) * lv->multiplier) >> lv->shift;
+
+    for (;; j = (j + 1) & mask) {
+        const hash_slot *slot = &lv->slots[j];
+        if (!slot->node) return NULL;
+        if (slot->len != len) continue;
+        int i = 0;
+        while (i < len && fold[(unsigned char) token[i]] == slot->key[i])
+            i++;
+        if (i < len) continue;
+        *level = slot->child;
+        if (slot->alt && strcmp(token, slot->alt->name) == 0)
+            return slot->alt;
+        return slot->node;
+    }
+}
+
+
+/***********************************************************************
+ * Route cache.
+ *
+ * Pollers send the same few commands over and over. This direct-mapped
+ * cache remembers, for the verb of each command (the text before the
+ * parameters, exactly as received), the node it resolved to, and the
+ * tokenized verb: the text with its separators and the first digit of
+ * each suffix replaced by '\0'. A hit skips tokenization and the walk
+ * down the tree: the tokenized text is copied over the verb, and the
+ * suffixes come from the cache.
  */
-static int split_suffix(char **token)
+
+#define CACHE_SIZE      128     /* number of entries, a power of two */
+#define CACHE_VERB_MAX  40      /* longest verb cached, including '?' */
+#define CACHE_TOKENS    4       /* most tokens in a cached verb */
+
+typedef struct {
+    const syntax_tree *language;    /* NULL if the entry is free */
+    const syntax_tree *node;
+    unsigned char len, query, n_tok;
+    unsigned char offset[CACHE_TOKENS];     /* of each token in text */
+    int suffix[CACHE_TOKENS];
+    char verb[CACHE_VERB_MAX];      /* as received */
+    char text[CACHE_VERB_MAX];      /* as tokenized */
+} route;
+
+static route route_cache[CACHE_SIZE];
+static unsigned long cache_hits, cache_misses;
+
+static uint32_t hash_verb(const char *verb, size_t len)
 {
-    char *p;
-    int suffix;
-    
-    p = strpbrk(*token, "0123456789");
-    if (!p) return -1;
-    suffix = atoi(p);
-    *p = '\0';
-    *token = p+1;
-    return suffix;
+    uint64_t h = len, w;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&w, verb + i, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15;
+    }
+    w = 0;
+    memcpy(&w, verb + i, len - i);
+    h = (h ^ w) * 0x9e3779b97f4a7c15;
+    return h >> 32;
 }
 
-/* Parse the command according to the language. */
+void parse_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    *hits = cache_hits;
+    *misses = cache_misses;
+}
+
+
+/***********************************************************************
+ * Parser.
+ */
+
+/*
+ * Parse the command according to the language. The command is scanned
+ * once: the parameters, then the verb, are cut in place, and the token
+ * lengths are handed to lookup().
+ */
 int parse(char *command, const syntax_tree *language, void *data)
 {
     char *token[MAX_TOKENS], *param[MAX_PARAMS];
-    int suffix[MAX_TOKENS];
+    int suffix[MAX_TOKENS], length[MAX_TOKENS];
     parsed_command cmd = {0, 0, token, suffix, 0, param};
-    char *p;
+    char *p, *end;
     int i;
-    const syntax_tree *node, *last_node = NULL;
+    const syntax_tree *node = NULL, *last_node = NULL;
 
-    /* Remove trailing garbage. */
-    i = strlen(command);
-    while (i-- &&
-            (command[i]==' ' || command[i]=='\n' || command[i]=='\r'))
-        command[i] = '\0';
+    /* The verb ends at the first space. Remove trailing garbage. */
+    end = command + strlen(command);
+    p = memchr(command, ' ', end - command);
+    if (!p) p = end;
+    while (end > command
+            && (end[-1]==' ' || end[-1]=='\n' || end[-1]=='\r'))
+        end--;
+    if (p > end) p = end;
+    *end = '\0';
+    size_t verb_len = p - command;
 
     /* Look for parameters. */
     cmd.n_param = 0;
-    p = strchr(command, ' ');
-    while (p) {
+    if (p < end) {
         *p++ = '\0';
-        while (*p == ' ') p++;
-        param[cmd.n_param++] = p;
-        if (cmd.n_param == MAX_PARAMS) break;
-        p = strchr(p, ',');
+        for (;;) {
+            while (*p == ' ') p++;
+            param[cmd.n_param++] = p;
+            if (cmd.n_param == MAX_PARAMS) break;
+            if (!(p = memchr(p, ',', end - p))) break;
+            *p++ = '\0';
+        }
     }
 
     /* Empty? */
-    if (!*command) return EMPTY_COMMAND;
+    if (!verb_len) return EMPTY_COMMAND;
+
+    /* Seen before? */
+    route *r = &route_cache[hash_verb(command, verb_len) & (CACHE_SIZE-1)];
+    if (r->language == language && r->len == verb_len
+            && memcmp(r->verb, command, verb_len) == 0) {
+        cache_hits++;
+        memcpy(command, r->text, verb_len);
+        cmd.query = r->query;
+        cmd.n_tok = r->n_tok;
+        for (i=0; i<cmd.n_tok; i++) {
+            token[i] = command + r->offset[i];
+            suffix[i] = r->suffix[i];
+        }
+        node = r->node;
+        goto invoke;
+    }
+    cache_misses++;
+    char verb[CACHE_VERB_MAX];
+    if (verb_len <= CACHE_VERB_MAX) memcpy(verb, command, verb_len);
 
     /* Query? */
-    p = command + strlen(command) - 1;
-    cmd.query = (*p == '?');
-    if (cmd.query) *p = '\0';
+    end = command + verb_len;
+    cmd.query = end[-1] == '?';
+    if (cmd.query) *--end = '\0';
 
-    /* Cut command in tokens. */
-    /* XXX: This should be done in a cleaner way. */
+    /*
+     * Cut the verb in tokens. A token ends at a colon. Its numeric
+     * suffix starts at its first digit, and anything between the
+     * suffix and the colon is ignored.
+     */
     cmd.n_tok = 0;
-    p = token[cmd.n_tok] = command;
-    suffix[cmd.n_tok] = split_suffix(&p);
-    cmd.n_tok++;
-    while (cmd.n_tok<MAX_TOKENS && *p && (p = strchr(p, ':')) != NULL) {
-        *p = '\0';
-        token[cmd.n_tok] = ++p;
-        suffix[cmd.n_tok] = split_suffix(&p);
+    p = command;
+    for (;;) {
+        token[cmd.n_tok] = p;
+        suffix[cmd.n_tok] = -1;
+        while (p < end && *p != ':' && (*p < '0' || *p > '9')) p++;
+        length[cmd.n_tok] = p - token[cmd.n_tok];
+        if (p < end && *p != ':') {
+            int n = *p - '0';
+            *p++ = '\0';
+            while (p < end && *p >= '0' && *p <= '9') {
+                if (n < INT_MAX / 10) n = 10 * n + (*p - '0');
+                p++;
+            }
+            suffix[cmd.n_tok] = n;
+            while (p < end && *p != ':') p++;
+        }
         cmd.n_tok++;
+        if (p == end || cmd.n_tok == MAX_TOKENS) break;
+        *p++ = '\0';
     }
 
 #ifdef DEBUG_PARSE
@@ -87,24 +428,53 @@ int parse(char *command, const syntax_tree *language, void *data)
         if (suffix[i] != -1) fprintf(stderr, "(%d)", suffix[i]);
         putc(']', stderr);
     }
-    if (param[0]) fputs(" ", stderr);
+    if (cmd.n_param) fputs(" ", stderr);
     for (i=0; i<cmd.n_param; i++)
         fprintf(stderr, "{%s}", param[i]);
     fputs("\n", stderr);
 #endif
 
-    /* Walk down the syntax tree. */
-    node = language;
-    for (i=0; i<cmd.n_tok; i++) {
-        if (!node) return TOO_MANY_TOKENS_IN_COMMAND;
-        while (node->name && strcmp(token[i], node->name)) node++;
-        if (!node->name) return NO_SUCH_COMMAND;
-        last_node = node;
-        node = node->child;
+    /*
+     * Walk down the syntax tree, through its compiled form if any.
+     * Without it (no memory), fall back to exact linear matching.
+     */
+    const compiled_syntax *cs = get_compiled(language);
+    if (cs) {
+        int level = 0;
+        for (i=0; i<cmd.n_tok; i++) {
+            if (level == -1) return TOO_MANY_TOKENS_IN_COMMAND;
+            node = lookup(cs, &level, token[i], length[i]);
+            if (!node) return NO_SUCH_COMMAND;
+        }
+    } else {
+        node = language;
+        for (i=0; i<cmd.n_tok; i++) {
+            if (!node) return TOO_MANY_TOKENS_IN_COMMAND;
+            while (node->name && strcmp(token[i], node->name)) node++;
+            if (!node->name) return NO_SUCH_COMMAND;
+            last_node = node;
+            node = node->child;
+        }
+        node = last_node;
+    }
+
+    /* Remember the route. */
+    if (verb_len <= CACHE_VERB_MAX && cmd.n_tok <= CACHE_TOKENS) {
+        r->language = language;
+        r->node = node;
+        r->len = verb_len;
+        r->query = cmd.query;
+        r->n_tok = cmd.n_tok;
+        for (i=0; i<cmd.n_tok; i++) {
+            r->offset[i] = token[i] - command;
+            r->suffix[i] = suffix[i];
+        }
+        memcpy(r->verb, verb, verb_len);
+        memcpy(r->text, command, verb_len);
     }
-    node = last_node;
 
     /* Invoke handler. */
+invoke:
     if (!node->handler) return NO_HANDLER;
     return node->handler(data, node->data, &cmd);
 }
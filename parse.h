@@ -11,6 +11,13 @@
  * imperative form (without `?') which expects no response. Commands can
  * accept an optional comma-separated list of parameters.
  *
+ * Tokens are matched case-insensitively. A node with a lowercase name
+ * longer than four letters can also be reached through its SCPI short
+ * form: the first four letters, or three if the fourth is a vowel
+ * (e.g. CHAN for channel, MEAS for measure, REG for regulation). When
+ * two names at the same level differ only in case, the first one is
+ * matched by default, and the second one only if spelled exactly.
+ *
  * Examples:
  *      channel2:voltage:range 0.1     sets the voltage range to 100 mV
  *                                     on channel 2
@@ -69,6 +76,22 @@ typedef struct _syntax_node {
  */
 int parse(char *command, const syntax_tree *language, void *data);
 
+/*
+ * Compile the language into the dispatch tables used by parse(). This
+ * is done automatically on the first parse(), but can be done earlier
+ * to keep that cost out of the first command. Returns -1 if out of
+ * memory, in which case parse() falls back to exact, linear matching.
+ */
+int compile_syntax(const syntax_tree *language);
+
+/*
+ * parse() caches the routes of the command verbs it has resolved, so
+ * that a command seen before is neither tokenized nor looked up again.
+ * This reports the number of commands that did (hits) and did not
+ * (misses) find their route in the cache.
+ */
+void parse_cache_stats(unsigned long *hits, unsigned long *misses);
+
 /* Error codes returned by the parser. */
 #define EMPTY_COMMAND    -1     /* empty command */
 #define TOO_MANY_TOKENS_IN_COMMAND -2  /* tokens found past a leaf node */
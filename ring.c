@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Rings of measurements.
+ *
+ * A channel's ring is allocated when its first sample is stored. The
+ * sample numbered `seq' lives in the slot seq % size.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <Trmc.h>
+#include "ring.h"
+
+/* Channels that can have a ring. */
+#define RING_CHANNELS 256
+
+typedef struct {
+    uint64_t end;               /* sequence number of the next sample */
+    ring_sample_t *samples;     /* ring_size of them */
+} ring_t;
+
+static size_t ring_size;
+static ring_t rings[RING_CHANNELS];
+
+/* Set the size of the rings. */
+void ring_init(size_t size)
+{
+    ring_size = size;
+}
+
+/* Are the measurements kept in rings? */
+int ring_enabled(void)
+{
+    return ring_size != 0;
+}
+
+/* Store a measurement. */
+uint64_t ring_store(int index, int64_t received, const AMEASURE *m)
+{
+    if (!ring_size || index < 0 || index >= RING_CHANNELS) return 0;
+    ring_t *ring = &rings[index];
+    if (!ring->samples) {
+        ring->samples = malloc(ring_size * sizeof *ring->samples);
+        if (!ring->samples) {
+            syslog(LOG_ERR, "malloc: %m\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ring_sample_t *sample = &ring->samples[ring->end % ring_size];
+    sample->received = received;
+    sample->meas = *m;
+    return ring->end++;
+}
+
+/* Sequence number of the oldest sample held. */
+uint64_t ring_first(int index)
+{
+    if (index < 0 || index >= RING_CHANNELS) return 0;
+    uint64_t end = rings[index].end;
+    return end > ring_size ? end - ring_size : 0;
+}
+
+/* Sequence number of the next sample. */
+uint64_t ring_end(int index)
+{
+    if (index < 0 || index >= RING_CHANNELS) return 0;
+    return rings[index].end;
+}
+
+/* Return a sample, if still held. */
+const ring_sample_t *ring_get(int index, uint64_t seq)
+{
+    if (seq < ring_first(index) || seq >= ring_end(index)) return NULL;
+    return &rings[index].samples[seq % ring_size];
+}
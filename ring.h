@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Rings of measurements: the latest samples read from each channel,
+ * numbered in the order they were read, with their receive times. Only
+ * the acquisition thread uses them. Include <stdint.h> and <Trmc.h>
+ * before this.
+ */
+
+/* A measurement, as stored in a ring. */
+typedef struct {
+    int64_t received;   /* receive time, in ns since the epoch */
+    AMEASURE meas;
+} ring_sample_t;
+
+/*
+ * Keep the last `size' samples of every channel. Without this call,
+ * rings are disabled and nothing is stored.
+ */
+void ring_init(size_t size);
+
+/* Are the measurements kept in rings? */
+int ring_enabled(void);
+
+/*
+ * Store a measurement just read from the channel, received at the given
+ * time in ns since the epoch, overwriting the oldest one if the ring is
+ * full. Returns its sequence number.
+ */
+uint64_t ring_store(int index, int64_t received, const AMEASURE *m);
+
+/*
+ * Sequence numbers of the oldest sample held and of the next sample to
+ * be stored. The ring holds the samples numbered from ring_first()
+ * to ring_end() - 1. Sequence numbers start at 0 and never wrap.
+ */
+uint64_t ring_first(int index);
+uint64_t ring_end(int index);
+
+/* Return the sample with this sequence number, or NULL if not held. */
+const ring_sample_t *ring_get(int index, uint64_t seq);
@@ -5,9 +5,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/select.h>
 #include "constants.h"
 #include "parse.h"
@@ -99,6 +101,19 @@
 int force_color_prompt;
 static client_t *tty;
 
+/* Wait for the acquisition thread to complete the tty's commands. */
+static void wait_for_commands(void)
+{
+    while (tty->in_flight) {
+        struct pollfd pfd = {acquisition_fd(), POLLIN, 0};
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        deliver_results(NULL);
+    }
+}
+
 static void handle_line(char *line)
 {
     /* Exit on EOF (Ctrl-D). */
@@ -114,10 +129,18 @@ static void handle_line(char *line)
     if (line && *line &&
             (!last_line || strcmp(line, last_line) != 0))
         add_history(line);
-    int ret = parse(line, trmc2_syntax, tty);
+
+    /* Execute the `;'-separated commands in turn. */
+    char *rest = line, *command;
+    tty->line_continues = 0;
+    while ((command = strsep(&rest, ";"))) {
+        tty->line_continued = tty->line_continues;
+        tty->line_continues = rest != NULL;
+        execute_command(tty, command);
+        wait_for_commands();
+        if (tty->quitting) break;
+    }
     free(line);
-    if (ret < 0)
-        report_error(tty, const_name(ret, parse_errors));
     if (tty->quitting)
         should_quit = 1;  /* terminate if the client is leaving */
     if (should_quit)
@@ -127,7 +150,8 @@ static void handle_line(char *line)
 /* Read lines on stdin and send them to parse(). */
 int shell(void)
 {
-    tty = get_client_slot();
+    tty = new_client(0, 1);
+    if (!tty) return EXIT_FAILURE;
     tty->in = 0;          /* stdin, actually unused */
     tty->out = 1;         /* stdout */
     tty->autoflush = 1;   /* don't have to call process_output() */
@@ -144,15 +168,19 @@ int shell(void)
     rl_callback_handler_install(prompt, handle_line);
     while (!should_quit) {
         fd_set fds;
+        int acq = acquisition_fd();
         FD_ZERO(&fds);
         FD_SET(STDIN_FILENO, &fds);
-        int ret = select(STDIN_FILENO + 1, &fds, NULL, NULL, NULL);
+        FD_SET(acq, &fds);
+        int ret = select(acq + 1, &fds, NULL, NULL, NULL);
 
         /* Restart on interrupted system call. */
         if (ret == -1 && errno == EINTR)
                 continue;
 
-        if (FD_ISSET(STDIN_FILENO, &fds))
+        if (ret > 0 && FD_ISSET(acq, &fds))
+            deliver_results(NULL);
+        if (ret > 0 && FD_ISSET(STDIN_FILENO, &fds))
             rl_callback_read_char();
     }
 
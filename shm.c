@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Publication of the latest measurements in shared memory.
+ *
+ * We are the only writer, thus the sequence lock of a slot only has to
+ * be incremented around each update. See trmc2d-shm.h for the reader
+ * side.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <Trmc.h>
+#include "trmc2d-shm.h"
+#include "shm.h"
+
+static trmc2d_shm *shm;
+
+/* Cleanup: unlink_shm() has to be registered with atexit(). */
+static const char *shm_name;
+static void unlink_shm(void) { shm_unlink(shm_name); }
+
+/* Create the shared memory object and map it. */
+int shm_init(const char *name)
+{
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd == -1) {
+        syslog(LOG_ERR, "shm_open: %m\n");
+        return -1;
+    }
+    shm_name = name;
+    if (atexit(unlink_shm)) {
+        syslog(LOG_ERR, "atexit failed\n");
+        unlink_shm();
+        close(fd);
+        return -1;
+    }
+    if (ftruncate(fd, sizeof *shm) == -1) {
+        syslog(LOG_ERR, "ftruncate: %m\n");
+        close(fd);
+        return -1;
+    }
+    void *p = mmap(NULL, sizeof *shm, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        syslog(LOG_ERR, "mmap: %m\n");
+        return -1;
+    }
+
+    /* The object is zero-filled: only the header needs to be set. */
+    shm = p;
+    shm->version = TRMC2D_SHM_VERSION;
+    shm->channel_count = TRMC2D_SHM_CHANNELS;
+    shm->slot_size = sizeof(trmc2d_shm_slot);
+    atomic_thread_fence(memory_order_release);
+    shm->magic = TRMC2D_SHM_MAGIC;
+    return 0;
+}
+
+/* Is the table published? */
+int shm_enabled(void)
+{
+    return shm != NULL;
+}
+
+/* Store a measurement in the channel's slot. */
+void shm_publish(int index, const AMEASURE *m)
+{
+    if (!shm || index < 0 || index >= TRMC2D_SHM_CHANNELS) return;
+    trmc2d_shm_slot *slot = &shm->slot[index];
+    uint32_t lock = atomic_load_explicit(&slot->lock, memory_order_relaxed);
+
+    atomic_store_explicit(&slot->lock, lock + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->sample.raw       = m->MeasureRaw;
+    slot->sample.converted = m->Measure;
+    slot->sample.range_i   = m->ValueRangeI;
+    slot->sample.range_v   = m->ValueRangeV;
+    slot->sample.time      = m->Time;
+    slot->sample.status    = m->Status;
+    slot->sample.number    = m->Number;
+    slot->sample.sequence++;
+    atomic_store_explicit(&slot->lock, lock + 2, memory_order_release);
+}
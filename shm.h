@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Publication of the latest measurements in shared memory. See
+ * trmc2d-shm.h for the layout and the reader side. Include <Trmc.h>
+ * before this.
+ */
+
+/*
+ * Create the shared memory object with the given name and map it.
+ * Returns -1 on error.
+ */
+int shm_init(const char *name);
+
+/* Is the table published? */
+int shm_enabled(void);
+
+/* Store a measurement in the channel's slot, if the table is published. */
+void shm_publish(int index, const AMEASURE *m);
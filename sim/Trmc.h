@@ -0,0 +1,152 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Stand-in for libtrmc2's Trmc.h, used when building trmc2d against the
+ * simulated TRMC2 (make SIMULATION=yes). It declares only the part of
+ * the API that trmc2d uses. The values of the constants are those
+ * listed in constants.c, but the layout of the structures is not meant
+ * to be binary-compatible with libtrmc2: never mix the two.
+ */
+
+#ifndef TRMC_H
+#define TRMC_H
+
+#define _LENGTHOFNAME           32
+#define _NB_REGULATING_CHANNEL  4
+#define _EMPTY_CHANNEL          -1
+
+/* Sizes of the board tables. */
+#define _NB_CALIBRATION_MEASURE 64
+#define _NB_RANGES              16
+
+/* Communication port and mains frequency. */
+#define _COM1           1
+#define _COM2           2
+#define _NOTBEATING     0
+#define _50HZ           1
+#define _60HZ           2
+
+/* How GetChannelTRMC() and GetBoardTRMC() find their target. */
+#define _BYINDEX        1
+#define _BYADDRESS      2
+
+/* Board types and indices. */
+#define _TYPEREGULMAIN  0
+#define _TYPEREGULAUX   1
+#define _TYPEA          2
+#define _REGULMAINBOARD 0
+#define _REGULAUXBOARD  1
+#define _FIRSTBOARD     2
+
+/* Channel modes and priorities. */
+#define _INIT_MODE              -2
+#define _NOT_USED_MODE          -1
+#define _FIX_RANGE_MODE         0
+#define _SPECIAL_MODE           5
+#define _NO_PRIORITY            0
+#define _ALWAYS                 2
+
+/* Board calibration status. */
+#define _NORMAL_MODE            0
+
+/* Return codes. */
+#define _TIMER_NOT_RUNNING              4
+#define _TIMER_ALREADY_RUNNING          3
+#define _RETURN_OK                      0
+#define _TRMC_NOT_INITIALIZED           -25
+#define _NO_BOARD_AT_THIS_ADDRESS       -16
+#define _NO_BOARD_WITH_THIS_INDEX       -27
+#define _NO_SUCH_CHANNEL                -19
+#define _INVALID_MODE                   -20
+#define _INVALID_PRIORITY               -21
+#define _INVALID_BYWHAT                 -26
+#define _INVALID_CALIBRATION_PARAMETER  -47
+#define _NO_SUCH_REGULATION             -50
+#define _INVALID_REGULPARAMETER         -51
+#define _INVALID_CHANNELPARAMETER       -52
+#define _INVALID_COM                    -45
+#define _INVALID_FREQUENCY              -48
+
+typedef struct {
+    int Com;
+    int Frequency;
+    int CommunicationTime;
+    int futureuse;
+} INITSTRUCTURE;
+
+typedef struct {
+    int CommError;
+    int CalcError;
+    int TimerError;
+    int Date;
+} ERRORS;
+
+typedef struct {
+    char name[_LENGTHOFNAME];
+    double ValueRangeI;
+    double ValueRangeV;
+    int BoardAddress;
+    int SubAddress;
+    int BoardType;
+    int Index;
+    int Mode;
+    int PreAveraging;
+    int ScrutationTime;
+    int PriorityFlag;
+    int FifoSize;
+    int (*Etalon)(double *);
+} CHANNELPARAMETER;
+
+typedef struct {
+    char name[_LENGTHOFNAME];
+    double SetPoint;
+    double P;
+    double I;
+    double D;
+    double HeatingMax;
+    double HeatingResistor;
+    double WeightofChannel[_NB_REGULATING_CHANNEL];
+    int IndexofChannel[_NB_REGULATING_CHANNEL];
+    int Index;
+    int ThereIsABooster;
+    int ReturnTo0;
+} REGULPARAMETER;
+
+typedef struct {
+    int TypeofBoard;
+    int AddressofBoard;
+    int Index;
+    int CalibrationStatus;
+    int NumberofCalibrationMeasure;
+    int NumberofIRanges;
+    int NumberofVRanges;
+    double CalibrationTable[_NB_CALIBRATION_MEASURE];
+    double IRangesTable[_NB_RANGES];
+    double VRangesTable[_NB_RANGES];
+} BOARDPARAMETER;
+
+typedef struct {
+    double MeasureRaw;
+    double Measure;
+    double ValueRangeI;
+    double ValueRangeV;
+    int Time;
+    int Status;
+    int Number;
+    int Nothing;
+} AMEASURE;
+
+int StartTRMC(INITSTRUCTURE *init);
+int StopTRMC(void);
+int GetSynchroneousErrorTRMC(ERRORS *errors);
+int GetNumberOfChannelTRMC(int *count);
+int GetChannelTRMC(int bywhat, CHANNELPARAMETER *channel);
+int SetChannelTRMC(CHANNELPARAMETER *channel);
+int GetRegulationTRMC(REGULPARAMETER *regul);
+int SetRegulationTRMC(REGULPARAMETER *regul);
+int GetNumberOfBoardTRMC(int *count);
+int GetBoardTRMC(int bywhat, BOARDPARAMETER *board);
+int SetBoardTRMC(BOARDPARAMETER *board);
+int ReadValueTRMC(int index, AMEASURE *measure);
+int FlushFifoTRMC(int index);
+
+#endif
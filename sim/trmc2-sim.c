@@ -0,0 +1,674 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Simulated TRMC2: an implementation of the libtrmc2 API that needs no
+ * hardware, for benchmarking and soak-testing trmc2d. Build trmc2d with
+ * `make SIMULATION=yes' to link it instead of libtrmc2.
+ *
+ * The simulation is configured by the TRMC2_SIM environment variable, a
+ * comma-separated list of key=value settings:
+ *
+ *      channels=N      number of channels (default: 8)
+ *      boards=N        number of measurement boards (default: 2), not
+ *                      counting the two regulation boards
+ *      rate=R          samples per second per channel (default: 10)
+ *      latency=T       duration of every call, in microseconds
+ *      jitter=T        extra random duration of every call, up to T us
+ *      error=F:C:P     make the calls to F (e.g. ReadValue) fail with
+ *                      the code C with probability P; can be repeated
+ *      seed=N          seed of the random generator
+ *      replay=file     replay recorded measurements instead of
+ *                      generating them
+ *      speed=S         replay S times faster than real time (default: 1)
+ *
+ * Example:
+ *
+ *      TRMC2_SIM=channels=16,rate=100,latency=2000,error=ReadValue:-36:0.001
+ *
+ * As with the real controller, the channels only acquire once the TRMC2
+ * has been started, and only if their mode is not _NOT_USED_MODE. Each
+ * channel fills its FIFO with a slowly drifting noisy resistance; when
+ * the FIFO is full, the oldest samples are lost. Changing the channel
+ * parameters flushes its FIFO.
+ *
+ * A replay file holds one measurement per line: the time in seconds,
+ * the channel index and the raw value, separated by white space. Lines
+ * starting with `#' are ignored. Each measurement is pushed into the
+ * FIFO of its channel when its time comes, relative to the first one.
+ * The file is replayed in a loop.
+ *
+ * The whole API is serialized by a mutex held for the duration of the
+ * call, including the simulated latency, as on a serial line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <Trmc.h>
+
+#define MAX_ERROR_RULES 16
+
+/* Injected error. */
+typedef struct {
+    char function[32];
+    int code;
+    double probability;
+} error_rule;
+
+/* Simulation settings. */
+static struct {
+    int channels;
+    int boards;
+    double rate;
+    long latency;
+    long jitter;
+    unsigned int seed;
+    const char *replay;
+    double speed;
+    int error_count;
+    error_rule errors[MAX_ERROR_RULES];
+} config = {8, 2, 10, 0, 0, 1, NULL, 1, 0, {{"", 0, 0}}};
+
+/* A channel and its FIFO. */
+typedef struct {
+    CHANNELPARAMETER param;
+    AMEASURE *fifo;
+    int head;               /* oldest sample */
+    int count;              /* number of samples in the FIFO */
+    int number;             /* number of samples acquired */
+    double next_time;       /* of the next synthetic sample, s */
+} sim_channel;
+
+/* A measurement of the replay file. */
+typedef struct {
+    double time;
+    int channel;
+    double raw;
+} replay_sample;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int configured;
+static int initialized;     /* StartTRMC() was called */
+static int running;         /* the periodic timer runs */
+static struct timespec start_time;
+static sim_channel *channels;
+static BOARDPARAMETER *boards;
+static REGULPARAMETER regulations[2];
+static int injected_errors; /* since the last GetSynchroneousErrorTRMC() */
+
+static replay_sample *replay;
+static int replay_count;
+static int replay_next;     /* next sample to push */
+static double replay_offset;    /* time shift of the current loop */
+
+/* Ranges of the simulated boards. */
+static const double vranges[] = {2e-5, 2e-4, 2e-3, 2e-2};
+static const double iranges[] = {1e-9, 1e-8, 1e-7, 1e-6, 1e-5};
+#define COUNT(a) ((int) (sizeof (a) / sizeof *(a)))
+
+/* Parse one error=F:C:P setting. */
+static void add_error_rule(const char *spec)
+{
+    error_rule *rule = &config.errors[config.error_count];
+
+    if (config.error_count == MAX_ERROR_RULES) {
+        syslog(LOG_WARNING, "TRMC2_SIM: too many error rules\n");
+        return;
+    }
+    if (sscanf(spec, "%31[^:]:%d:%lf", rule->function, &rule->code,
+                &rule->probability) != 3) {
+        syslog(LOG_WARNING, "TRMC2_SIM: invalid error rule: %s\n", spec);
+        return;
+    }
+    config.error_count++;
+}
+
+/* Read the settings from the environment. */
+static void configure(void)
+{
+    const char *env = getenv("TRMC2_SIM");
+    char *settings, *item, *saveptr;
+
+    configured = 1;
+    if (!env) return;
+    settings = strdup(env);
+    if (!settings) return;
+    for (item = strtok_r(settings, ",", &saveptr); item;
+            item = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(item, '=');
+        if (!value) {
+            syslog(LOG_WARNING, "TRMC2_SIM: missing value: %s\n", item);
+            continue;
+        }
+        *value++ = '\0';
+        if (strcmp(item, "channels") == 0)
+            config.channels = atoi(value);
+        else if (strcmp(item, "boards") == 0)
+            config.boards = atoi(value);
+        else if (strcmp(item, "rate") == 0)
+            config.rate = atof(value);
+        else if (strcmp(item, "latency") == 0)
+            config.latency = atol(value);
+        else if (strcmp(item, "jitter") == 0)
+            config.jitter = atol(value);
+        else if (strcmp(item, "error") == 0)
+            add_error_rule(value);
+        else if (strcmp(item, "seed") == 0)
+            config.seed = atoi(value);
+        else if (strcmp(item, "replay") == 0)
+            config.replay = strdup(value);
+        else if (strcmp(item, "speed") == 0)
+            config.speed = atof(value);
+        else
+            syslog(LOG_WARNING, "TRMC2_SIM: unknown setting: %s\n", item);
+    }
+    free(settings);     /* config.replay is a separate copy */
+    if (config.channels < 1) config.channels = 1;
+    if (config.boards < 1) config.boards = 1;
+    if (config.rate < 0) config.rate = 0;
+    if (config.speed <= 0) config.speed = 1;
+}
+
+/* Random number in [0, 1). */
+static double uniform(void)
+{
+    return rand_r(&config.seed) / (RAND_MAX + 1.0);
+}
+
+/* Seconds since StartTRMC(). */
+static double elapsed(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start_time.tv_sec)
+        + (now.tv_nsec - start_time.tv_nsec) * 1e-9;
+}
+
+/*
+ * Every API function starts with this: take the lock, simulate the
+ * duration of the call, and possibly inject an error. Returns the code
+ * to fail with, or 0. The lock has to be released in any case.
+ */
+static int begin_call(const char *function)
+{
+    pthread_mutex_lock(&lock);
+    if (!configured) configure();
+    long duration = config.latency;
+    if (config.jitter) duration += uniform() * config.jitter;
+    if (duration > 0) {
+        struct timespec ts = {duration / 1000000,
+            duration % 1000000 * 1000};
+        while (nanosleep(&ts, &ts) == -1)
+            ;
+    }
+    for (int i = 0; i < config.error_count; i++) {
+        error_rule *rule = &config.errors[i];
+        if (strcmp(rule->function, function) == 0
+                && uniform() < rule->probability) {
+            injected_errors++;
+            return rule->code;
+        }
+    }
+    return 0;
+}
+
+/* Release the lock and return the code. */
+static int end_call(int ret)
+{
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+
+/***********************************************************************
+ * Acquisition.
+ */
+
+/* Push a sample into the channel FIFO, dropping the oldest if full. */
+static void push_sample(sim_channel *ch, double time, double raw)
+{
+    AMEASURE *m;
+    int size = ch->param.FifoSize;
+
+    if (ch->count == size) {
+        ch->head = (ch->head + 1) % size;
+        ch->count--;
+    }
+    m = &ch->fifo[(ch->head + ch->count) % size];
+    ch->count++;
+    m->MeasureRaw = raw;
+    m->Measure = raw;
+    m->Status = 0;
+    if (ch->param.Etalon && ch->param.Etalon(&m->Measure))
+        m->Status = 1;      /* conversion failed */
+    m->ValueRangeI = ch->param.ValueRangeI;
+    m->ValueRangeV = ch->param.ValueRangeV;
+    m->Time = time * 1000;
+    m->Number = ++ch->number;
+    m->Nothing = 0;
+}
+
+/* Is the channel acquiring? */
+static int acquiring(const sim_channel *ch)
+{
+    return running && ch->param.Mode != _NOT_USED_MODE;
+}
+
+/* Add the synthetic samples that are due to the channel FIFO. */
+static void generate(sim_channel *ch, double now)
+{
+    if (!acquiring(ch) || config.rate == 0) return;
+
+    /* Only the last FifoSize samples would survive anyway. */
+    double period = 1 / config.rate;
+    double backlog = (now - ch->next_time) / period;
+    if (backlog > ch->param.FifoSize)
+        ch->next_time += floor(backlog - ch->param.FifoSize) * period;
+
+    for (; ch->next_time <= now; ch->next_time += period) {
+        double t = ch->next_time;
+        double base = 1000.0 * (ch->param.Index + 1);
+        double raw = base * (1 + 0.01 * sin(2 * M_PI * t / 600))
+            + base * 1e-4 * (uniform() - 0.5);
+        push_sample(ch, t, raw);
+    }
+}
+
+/* Push the replayed samples whose time has come. */
+static void advance_replay(double now)
+{
+    double t = now * config.speed;
+
+    while (replay_count) {
+        replay_sample *s = &replay[replay_next];
+        double due = s->time - replay[0].time + replay_offset;
+        if (due > t) break;
+        if (s->channel < config.channels
+                && acquiring(&channels[s->channel]))
+            push_sample(&channels[s->channel], due / config.speed, s->raw);
+        if (++replay_next == replay_count) {  /* loop */
+            replay_next = 0;
+            replay_offset = due + (replay_count > 1 ?
+                (replay[replay_count-1].time - replay[0].time)
+                / (replay_count - 1) : 1);
+        }
+    }
+}
+
+/* Bring the channel FIFO up to date. */
+static void update_fifo(sim_channel *ch)
+{
+    double now = elapsed();
+
+    if (config.replay)
+        advance_replay(now);
+    else
+        generate(ch, now);
+}
+
+/* Empty the channel FIFO and restart its acquisition. */
+static void reset_fifo(sim_channel *ch)
+{
+    ch->head = ch->count = 0;
+    ch->next_time = running ? elapsed() : 0;
+}
+
+/* Load the replay file. Returns -1 on error. */
+static int load_replay(void)
+{
+    FILE *f = fopen(config.replay, "r");
+    char line[256];
+    int allocated = 0;
+
+    if (!f) {
+        syslog(LOG_ERR, "TRMC2_SIM: %s: %m\n", config.replay);
+        return -1;
+    }
+    free(replay);
+    replay = NULL;
+    replay_count = replay_next = 0;
+    replay_offset = 0;
+    while (fgets(line, sizeof line, f)) {
+        replay_sample s;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%lf %d %lf", &s.time, &s.channel, &s.raw) != 3
+                || s.channel < 0)
+            continue;
+        if (replay_count == allocated) {
+            allocated = allocated ? 2 * allocated : 1024;
+            replay_sample *p = realloc(replay, allocated * sizeof *p);
+            if (!p) {
+                syslog(LOG_ERR, "realloc: %m\n");
+                fclose(f);
+                return -1;
+            }
+            replay = p;
+        }
+        replay[replay_count++] = s;
+    }
+    fclose(f);
+    return 0;
+}
+
+
+/***********************************************************************
+ * Initialization.
+ */
+
+/* Set all the simulated hardware to its power-on state. */
+static int reset_hardware(void)
+{
+    int board_count = _FIRSTBOARD + config.boards;
+    int per_board = (config.channels + config.boards - 1) / config.boards;
+
+    for (int i = 0; channels && i < config.channels; i++)
+        free(channels[i].fifo);
+    free(channels);
+    free(boards);
+    channels = calloc(config.channels, sizeof *channels);
+    boards = calloc(board_count, sizeof *boards);
+    if (!channels || !boards) return -1;
+
+    for (int i = 0; i < board_count; i++) {
+        BOARDPARAMETER *b = &boards[i];
+        b->TypeofBoard = i == _REGULMAINBOARD ? _TYPEREGULMAIN
+            : i == _REGULAUXBOARD ? _TYPEREGULAUX : _TYPEA;
+        b->AddressofBoard = i;
+        b->Index = i;
+        b->CalibrationStatus = _NORMAL_MODE;
+        b->NumberofVRanges = COUNT(vranges);
+        b->NumberofIRanges = COUNT(iranges);
+        memcpy(b->VRangesTable, vranges, sizeof vranges);
+        memcpy(b->IRangesTable, iranges, sizeof iranges);
+    }
+
+    for (int i = 0; i < config.channels; i++) {
+        CHANNELPARAMETER *p = &channels[i].param;
+        snprintf(p->name, sizeof p->name, "CHANNEL%d", i);
+        p->ValueRangeI = iranges[0];
+        p->ValueRangeV = vranges[2];
+        p->BoardAddress = _FIRSTBOARD + i / per_board;
+        p->SubAddress = i % per_board;
+        p->BoardType = _TYPEA;
+        p->Index = i;
+        p->Mode = _FIX_RANGE_MODE;
+        p->PreAveraging = 1;
+        p->ScrutationTime = 1;
+        p->PriorityFlag = _NO_PRIORITY;
+        p->FifoSize = 16;
+        p->Etalon = NULL;
+        channels[i].fifo = calloc(p->FifoSize, sizeof(AMEASURE));
+        if (!channels[i].fifo) return -1;
+    }
+
+    for (int i = 0; i < COUNT(regulations); i++) {
+        REGULPARAMETER *r = &regulations[i];
+        memset(r, 0, sizeof *r);
+        snprintf(r->name, sizeof r->name, "REGULATION%d", i);
+        r->Index = i;
+        r->HeatingResistor = 100;
+        for (int j = 0; j < _NB_REGULATING_CHANNEL; j++) {
+            r->IndexofChannel[j] = _EMPTY_CHANNEL;
+            r->WeightofChannel[j] = 1;
+        }
+    }
+    return 0;
+}
+
+int StartTRMC(INITSTRUCTURE *init)
+{
+    int ret = begin_call("Start");
+    if (ret) return end_call(ret);
+    if (init->Com != _COM1 && init->Com != _COM2)
+        return end_call(_INVALID_COM);
+    if (init->Frequency != _NOTBEATING && init->Frequency != _50HZ
+            && init->Frequency != _60HZ)
+        return end_call(_INVALID_FREQUENCY);
+    if (reset_hardware() == -1) {
+        syslog(LOG_ERR, "TRMC2_SIM: out of memory\n");
+        initialized = running = 0;
+        return end_call(_TRMC_NOT_INITIALIZED);
+    }
+    if (config.replay && load_replay() == -1) {
+        initialized = running = 0;
+        return end_call(_TRMC_NOT_INITIALIZED);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    initialized = running = 1;
+    return end_call(_RETURN_OK);
+}
+
+int StopTRMC(void)
+{
+    int ret = begin_call("Stop");
+    if (ret) return end_call(ret);
+    if (!running) return end_call(_TIMER_NOT_RUNNING);
+
+    /* Keep what was acquired until now. */
+    for (int i = 0; i < config.channels; i++)
+        update_fifo(&channels[i]);
+    running = 0;
+    return end_call(_RETURN_OK);
+}
+
+int GetSynchroneousErrorTRMC(ERRORS *errors)
+{
+    int ret = begin_call("GetError");
+    if (ret) return end_call(ret);
+    if (!initialized) return end_call(_TRMC_NOT_INITIALIZED);
+    errors->CommError = injected_errors;
+    errors->CalcError = 0;
+    errors->TimerError = 0;
+    errors->Date = elapsed() * 1000;
+    injected_errors = 0;
+    return end_call(_RETURN_OK);
+}
+
+
+/***********************************************************************
+ * Channels.
+ */
+
+int GetNumberOfChannelTRMC(int *count)
+{
+    int ret = begin_call("GetNumberOfChannel");
+    if (ret) return end_call(ret);
+    if (!initialized) return end_call(_TRMC_NOT_INITIALIZED);
+    *count = config.channels;
+    return end_call(_RETURN_OK);
+}
+
+/* Find a channel by index or by address. Returns NULL if none. */
+static sim_channel *find_channel(int bywhat, const CHANNELPARAMETER *p)
+{
+    for (int i = 0; i < config.channels; i++) {
+        const CHANNELPARAMETER *q = &channels[i].param;
+        if (bywhat == _BYINDEX ? q->Index == p->Index
+                : q->BoardAddress == p->BoardAddress
+                && q->SubAddress == p->SubAddress)
+            return &channels[i];
+    }
+    return NULL;
+}
+
+int GetChannelTRMC(int bywhat, CHANNELPARAMETER *channel)
+{
+    int ret = begin_call("GetChannel");
+    if (ret) return end_call(ret);
+    if (!initialized) return end_call(_TRMC_NOT_INITIALIZED);
+    if (bywhat != _BYINDEX && bywhat != _BYADDRESS)
+        return end_call(_INVALID_BYWHAT);
+    sim_channel *ch = find_channel(bywhat, channel);
+    if (!ch) return end_call(_NO_SUCH_CHANNEL);
+    *channel = ch->param;
+    return end_call(_RETURN_OK);
+}
+
+int SetChannelTRMC(CHANNELPARAMETER *channel)
+{
+    int ret = begin_call("SetChannel");
+    if (ret) return end_call(ret);
+    if (!initialized) return end_call(_TRMC_NOT_INITIALIZED);
+    sim_channel *ch = find_channel(_BYINDEX, channel);
+    if (!ch) return end_call(_NO_SUCH_CHANNEL);
+    if (channel->Mode < _INIT_MODE || channel->Mode > _SPECIAL_MODE)
+        return end_call(_INVALID_MODE);
+    if (channel->PriorityFlag < _NO_PRIORITY
+            || channel->PriorityFlag > _ALWAYS)
+        return end_call(_INVALID_PRIORITY);
+    if (channel->FifoSize < 1 || channel->PreAveraging < 1
+            || channel->ScrutationTime < 0
+            || channel->ValueRangeI <= 0 || channel->ValueRangeV <= 0)
+        return end_call(_INVALID_CHANNELPARAMETER);
+
+    if (channel->FifoSize != ch->param.FifoSize) {
+        AMEASURE *fifo = calloc(channel->FifoSize, sizeof *fifo);
+        if (!fifo) return end_call(_INVALID_CHANNELPARAMETER);
+        free(ch->fifo);
+        ch->fifo = fifo;
+    }
+
+    /* The address and type are those of the hardware. */
+    CHANNELPARAMETER old = ch->param;
+    ch->param = *channel;
+    ch->param.BoardAddress = old.BoardAddress;
+    ch->param.SubAddress = old.SubAddress;
+    ch->param.BoardType = old.BoardType;
+    reset_fifo(ch);
+    return end_call(_RETURN_OK);
+}
+
+int ReadValueTRMC(int index, AMEASURE *measure)
+{
+    int ret = begin_call("ReadValue");
+    if (ret) return end_call(ret);
+    if (!initialized) return end_call(_TRMC_NOT_INITIALIZED);
+    if (index < 0 || index >= config.channels)
+        return end_call(_NO_SUCH_CHANNEL);
+    sim_channel *ch = &channels[index];
+    update_fifo(ch);
+    if (!ch->count) return end_call(0);
+
+    /* Return the number of samples before the read. */
+    ret = ch->count;
+    *measure = ch->fifo[ch->head];
+    ch->head = (ch->head + 1) % ch->param.FifoSize;
+    ch->count--;
+    return end_call(ret);
+}
+
+int FlushFifoTRMC(int index)
+{
+    int ret = begin_call("FlushFifo");
+    if (ret) return end_call(ret);
+    if (!initialized) return end_call(_TRMC_NOT_INITIALIZED);
+    if (index < 0 || index >= config.channels)
+        return end_call(_NO_SUCH_CHANNEL);
+    update_fifo(&channels[index]);
+    channels[index].head = channels[index].count = 0;
+    return end_call(_RETURN_OK);
+}
+
+
+/***********************************************************************
+ * Regulations.
+ */
+
+int GetRegulationTRMC(REGULPARAMETER *regul)
+{
+    int ret = begin_call("GetRegulation");
+    if (ret) return end_call(ret);
+    if (!initialized) return end_call(_TRMC_NOT_INITIALIZED);
+    if (regul->Index < 0 || regul->Index >= COUNT(regulations))
+        return end_call(_NO_SUCH_REGULATION);
+    *regul = regulations[regul->Index];
+    return end_call(_RETURN_OK);
+}
+
+int SetRegulationTRMC(REGULPARAMETER *regul)
+{
+    int ret = begin_call("SetRegulation");
+    if (ret) return end_call(ret);
+    if (!initialized) return end_call(_TRMC_NOT_INITIALIZED);
+    if (regul->Index < 0 || regul->Index >= COUNT(regulations))
+        return end_call(_NO_SUCH_REGULATION);
+    if (regul->HeatingMax < 0 || regul->HeatingResistor <= 0)
+        return end_call(_INVALID_REGULPARAMETER);
+    for (int i = 0; i < _NB_REGULATING_CHANNEL; i++) {
+        int channel = regul->IndexofChannel[i];
+        if (channel != _EMPTY_CHANNEL
+                && (channel < 0 || channel >= config.channels))
+            return end_call(_INVALID_REGULPARAMETER);
+    }
+    regulations[regul->Index] = *regul;
+    return end_call(_RETURN_OK);
+}
+
+
+/***********************************************************************
+ * Boards.
+ */
+
+int GetNumberOfBoardTRMC(int *count)
+{
+    int ret = begin_call("GetNumberOfBoard");
+    if (ret) return end_call(ret);
+    if (!initialized) return end_call(_TRMC_NOT_INITIALIZED);
+    *count = _FIRSTBOARD + config.boards;
+    return end_call(_RETURN_OK);
+}
+
+/* Find a board by index or by address. Returns the error code, or 0. */
+static int find_board(int bywhat, const BOARDPARAMETER *board,
+        BOARDPARAMETER **found)
+{
+    int board_count = _FIRSTBOARD + config.boards;
+
+    if (bywhat != _BYINDEX && bywhat != _BYADDRESS)
+        return _INVALID_BYWHAT;
+    for (int i = 0; i < board_count; i++) {
+        if (bywhat == _BYINDEX ? boards[i].Index == board->Index
+                : boards[i].AddressofBoard == board->AddressofBoard) {
+            *found = &boards[i];
+            return 0;
+        }
+    }
+    return bywhat == _BYINDEX ? _NO_BOARD_WITH_THIS_INDEX
+        : _NO_BOARD_AT_THIS_ADDRESS;
+}
+
+int GetBoardTRMC(int bywhat, BOARDPARAMETER *board)
+{
+    BOARDPARAMETER *b;
+    int ret = begin_call("GetBoard");
+    if (ret) return end_call(ret);
+    if (!initialized) return end_call(_TRMC_NOT_INITIALIZED);
+    ret = find_board(bywhat, board, &b);
+    if (ret) return end_call(ret);
+    *board = *b;
+    return end_call(_RETURN_OK);
+}
+
+int SetBoardTRMC(BOARDPARAMETER *board)
+{
+    BOARDPARAMETER *b;
+    int ret = begin_call("SetBoard");
+    if (ret) return end_call(ret);
+    if (!initialized) return end_call(_TRMC_NOT_INITIALIZED);
+    ret = find_board(_BYINDEX, board, &b);
+    if (ret) return end_call(ret);
+    if (board->NumberofCalibrationMeasure < 0
+            || board->NumberofCalibrationMeasure > _NB_CALIBRATION_MEASURE)
+        return end_call(_INVALID_CALIBRATION_PARAMETER);
+
+    /* Only the calibration can be changed. */
+    b->CalibrationStatus = board->CalibrationStatus;
+    b->NumberofCalibrationMeasure = board->NumberofCalibrationMeasure;
+    memcpy(b->CalibrationTable, board->CalibrationTable,
+            board->NumberofCalibrationMeasure * sizeof *b->CalibrationTable);
+    return end_call(_RETURN_OK);
+}
@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Lock-free single-producer single-consumer queues.
+ *
+ * The queue is a ring of pointers. Only the producer writes `tail' and
+ * only the consumer writes `head', hence no lock: the release store of
+ * one side, paired with the acquire load of the other side, makes the
+ * slot contents visible. The two indices live on separate cache lines
+ * so that the threads do not fight for them.
+ *
+ * Waking up the consumer is the job of an eventfd: the producer rings
+ * it once per batch of items, and the consumer resets it before
+ * emptying the queue, so that no notification can be lost.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include "spsc.h"
+
+struct spsc_queue {
+    alignas(64) atomic_uint head;   /* next item to pop */
+    alignas(64) atomic_uint tail;   /* next free slot */
+    alignas(64) unsigned int mask;  /* size - 1 */
+    int fd;                         /* eventfd */
+    void *slots[];
+};
+
+spsc_queue *spsc_new(unsigned int size)
+{
+    spsc_queue *q;
+
+    if (size == 0 || (size & (size - 1))) {
+        syslog(LOG_ERR, "spsc_new: size not a power of two\n");
+        return NULL;
+    }
+    q = aligned_alloc(64, (sizeof *q + size * sizeof *q->slots + 63)
+            / 64 * 64);
+    if (!q) {
+        syslog(LOG_ERR, "aligned_alloc: %m\n");
+        return NULL;
+    }
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    q->mask = size - 1;
+    q->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->fd == -1) {
+        syslog(LOG_ERR, "eventfd: %m\n");
+        free(q);
+        return NULL;
+    }
+    return q;
+}
+
+int spsc_push(spsc_queue *q, void *item)
+{
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+    if (tail - head > q->mask) return 0;  /* full */
+    q->slots[tail & q->mask] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+void spsc_notify(spsc_queue *q)
+{
+    uint64_t one = 1;
+    if (write(q->fd, &one, sizeof one) == -1)
+        syslog(LOG_WARNING, "eventfd write: %m\n");
+}
+
+int spsc_fd(spsc_queue *q)
+{
+    return q->fd;
+}
+
+void spsc_clear(spsc_queue *q)
+{
+    uint64_t count;
+    if (read(q->fd, &count, sizeof count) == -1) {
+        /* EAGAIN: nothing was notified. */
+    }
+}
+
+void *spsc_pop(spsc_queue *q)
+{
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if (head == tail) return NULL;  /* empty */
+    void *item = q->slots[head & q->mask];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return item;
+}
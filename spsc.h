@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Lock-free single-producer single-consumer queues of pointers, used to
+ * pass work between the network thread and the acquisition thread.
+ * Each queue has a file descriptor the consumer can wait on with
+ * poll(), select() or epoll.
+ */
+
+typedef struct spsc_queue spsc_queue;
+
+/*
+ * Allocate a queue holding up to `size' items, which should be a power
+ * of two. Returns NULL on error.
+ */
+spsc_queue *spsc_new(unsigned int size);
+
+/* Producer side: append an item. Returns 0 if the queue is full. */
+int spsc_push(spsc_queue *q, void *item);
+
+/* Producer side: wake the consumer up after pushing some items. */
+void spsc_notify(spsc_queue *q);
+
+/*
+ * Consumer side: the file descriptor becomes readable when items are
+ * notified. Call spsc_clear() before popping the items.
+ */
+int spsc_fd(spsc_queue *q);
+void spsc_clear(spsc_queue *q);
+
+/* Consumer side: remove the oldest item. Returns NULL if empty. */
+void *spsc_pop(spsc_queue *q);
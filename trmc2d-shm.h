@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Shared-memory table of the latest measurement of each channel.
+ *
+ * When started with the -m option, trmc2d publishes a POSIX shared
+ * memory object holding one slot per channel. Every time the daemon
+ * reads a measurement, it stores it in the channel's slot. Local
+ * processes can map the object and read the slots without ever talking
+ * to the daemon or blocking it.
+ *
+ * Each slot is protected by a sequence lock: the writer makes the
+ * `lock' field odd while it updates the slot, and even when it is done.
+ * A reader retries when it sees an odd value, or when the value changed
+ * while it was copying the slot.
+ *
+ * This header is self-contained and can be used without the rest of
+ * the trmc2d sources. Example:
+ *
+ *      const trmc2d_shm *shm = trmc2d_shm_open(TRMC2D_SHM_DEFAULT_NAME);
+ *      trmc2d_sample s;
+ *      if (shm && trmc2d_shm_read(shm, 2, &s) > 0)
+ *          printf("%g\n", s.raw);
+ *
+ * Link with -lrt on older systems.
+ */
+
+#ifndef TRMC2D_SHM_H
+#define TRMC2D_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define TRMC2D_SHM_DEFAULT_NAME "/trmc2d"
+#define TRMC2D_SHM_MAGIC   0x32434d54   /* "TMC2" */
+#define TRMC2D_SHM_VERSION 1
+#define TRMC2D_SHM_CHANNELS 64          /* channels 0 .. 63 */
+
+/* A measurement, as in the AMEASURE structure of Trmc.h. */
+typedef struct {
+    double raw;             /* MeasureRaw */
+    double converted;       /* Measure */
+    double range_i;         /* ValueRangeI */
+    double range_v;         /* ValueRangeV */
+    int32_t time;           /* Time */
+    int32_t status;         /* Status */
+    int32_t number;         /* Number */
+    uint32_t sequence;      /* number of updates of this slot */
+} trmc2d_sample;
+
+/* A slot of the table. */
+typedef struct {
+    _Atomic uint32_t lock;  /* odd while the slot is being written */
+    uint32_t padding;
+    trmc2d_sample sample;
+} trmc2d_shm_slot;
+
+/* Layout of the shared memory object. */
+typedef struct {
+    uint32_t magic;         /* TRMC2D_SHM_MAGIC */
+    uint32_t version;       /* TRMC2D_SHM_VERSION */
+    uint32_t channel_count; /* TRMC2D_SHM_CHANNELS */
+    uint32_t slot_size;     /* sizeof(trmc2d_shm_slot) */
+    trmc2d_shm_slot slot[TRMC2D_SHM_CHANNELS];
+} trmc2d_shm;
+
+/*
+ * Map the table published by trmc2d under the given name. Returns NULL
+ * on failure, e.g. if the daemon is not running with this name.
+ */
+static inline const trmc2d_shm *trmc2d_shm_open(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) return NULL;
+    void *p = mmap(NULL, sizeof(trmc2d_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    const trmc2d_shm *shm = p;
+    if (shm->magic != TRMC2D_SHM_MAGIC
+            || shm->version != TRMC2D_SHM_VERSION
+            || shm->slot_size != sizeof(trmc2d_shm_slot)) {
+        munmap(p, sizeof(trmc2d_shm));
+        return NULL;
+    }
+    return shm;
+}
+
+/* Unmap the table. */
+static inline void trmc2d_shm_close(const trmc2d_shm *shm)
+{
+    munmap((void *) shm, sizeof(trmc2d_shm));
+}
+
+/*
+ * Copy the latest measurement of the channel. Returns its sequence
+ * number, which is 0 if the channel has never been read, or -1 if the
+ * channel is out of range. This never blocks, but may spin while the
+ * daemon is updating the slot.
+ */
+static inline long trmc2d_shm_read(const trmc2d_shm *shm, int channel,
+        trmc2d_sample *sample)
+{
+    if (channel < 0 || (uint32_t) channel >= shm->channel_count)
+        return -1;
+    const trmc2d_shm_slot *slot = &shm->slot[channel];
+    uint32_t before, after;
+    do {
+        before = atomic_load_explicit(&slot->lock, memory_order_acquire);
+        if (before & 1) continue;
+        *sample = *(const volatile trmc2d_sample *) &slot->sample;
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&slot->lock, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return sample->sequence;
+}
+
+#endif  /* TRMC2D_SHM_H */
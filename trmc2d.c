@@ -14,20 +14,27 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
+#include <signal.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
-#include <sys/un.h>
-#include <netinet/ip.h>
+#include <Trmc.h>
 #include "constants.h"
 #include "parse.h"
 #include "io.h"
 #include "interpreter.h"
 #include "shell.h"
+#include "shm.h"
+#include "ring.h"
+#include "history.h"
+#include "archive.h"
 
 static const char cmdline_help[] =
-"Usage: trmc2d [-h] [-s] [-p port] [-u name] [-d]\n"
+"Usage: trmc2d [-h] [-s] [-p port] [-u name] [-n count] [-b backlog]\n"
+"              [-m name] [-r size] [-H size] [-a dir] [-d]\n"
 "Options:\n"
 "    -h       print this message\n"
 "    -s       shell mode (talk to stdin/stdout)\n"
@@ -35,13 +42,88 @@ static const char cmdline_help[] =
 "    -p port  bind to the specified TCP port\n"
 "    -u name  bind to a Unix domain socket with the given name\n"
 "    -n count accept that many simultaneous clients (default: 1)\n"
+"    -b len   length of the queue of pending connections (default: 16)\n"
+"    -m name  publish the latest measurements in shared memory\n"
+"             (e.g. /trmc2d, see trmc2d-shm.h)\n"
+"    -r size  keep the last `size' measurements of every channel, so\n"
+"             that clients read them without interfering (default\n"
+"             with -m, -H or -a: 1024)\n"
+"    -H size  keep the history of every channel, compressed, in at most\n"
+"             `size' bytes of memory (suffixes k, M, G allowed)\n"
+"    -a dir   append every measurement to a log in that directory\n"
 "    -d       go to the background\n"
 "Default is to bind to TCP port 5025 (aka scpi-raw).\n";
 
-static const char optstring[] = "hscp:u:n:d";
+static const char optstring[] = "hscp:u:n:b:m:r:H:a:d";
 
-#define FD_SET_M(fd, set, max_fd) do { FD_SET(fd, set); \
-        max_fd = fd>max_fd ? fd : max_fd; } while (0)
+/* Maximum number of events handled per epoll_wait(). */
+#define MAX_EVENTS 64
+
+/*
+ * Size of the rings when the FIFOs are drained periodically, and -r is
+ * not given: well above the size of the hardware FIFOs.
+ */
+#define DEFAULT_RING_SIZE 1024
+
+/* epoll data pointer standing for the results of the acquisition thread. */
+static char acquisition_event;
+
+static int client_count;
+
+/*
+ * Read and execute everything the client has sent. The client socket is
+ * edge-triggered, thus we have to read until it would block, unless the
+ * client does not read its replies, or waits for the acquisition
+ * thread: then we leave its commands pending until its output backlog
+ * drains, or until resume_client().
+ */
+static void serve_input(client_t *cl)
+{
+    char *command;
+    int ret;
+
+    cl->throttled = 0;
+    for (;;) {
+        while (!cl->quitting && !client_waiting(cl)
+                && (command = get_command(cl))) {
+            execute_command(cl, command);
+            if (output_congested(cl)) {
+                process_output(cl);
+                if (output_congested(cl)) {
+                    cl->throttled = 1;
+                    return;
+                }
+            }
+        }
+        if (cl->quitting || client_waiting(cl)) return;
+        ret = process_input(cl);
+        if (ret == 0) {      /* client disconnected */
+            cl->quitting = 1;
+            return;
+        }
+        if (ret < 0) return; /* nothing more to read */
+    }
+}
+
+/*
+ * Called when commands of the client complete: it may have been
+ * waiting for them to go on, or to be deleted.
+ */
+static void resume_client(client_t *cl)
+{
+    if (cl->retired) {
+        if (!cl->in_flight) {
+            delete_client(cl);
+            client_count--;
+        }
+        return;
+    }
+    if (!cl->throttled || !output_congested(cl)) {
+        serve_input(cl);
+        if (cl->output_pending) process_output(cl);
+    }
+    if (cl->quitting) retire_client(cl);
+}
 
 int main(int argc, char *argv[])
 {
@@ -50,18 +132,15 @@ int main(int argc, char *argv[])
     int shell_mode = 0;
     const char *socket_name = NULL;
     int max_client_count = 1;
-    int client_count = 0;
-    int i;
-    client_t *cl;
-    int ls;                         /* listening socket */
-    union {                         /* client socket:   */
-        struct sockaddr    any;     /*  - generic       */
-        struct sockaddr_un un;      /*  - Unix domain   */
-        struct sockaddr_in in;      /*  - TCP           */
-    } peer_addr;
+    int backlog = DEFAULT_BACKLOG;
+    const char *shm_name = NULL;
+    long ring_size = 0;
+    size_t history_size = 0;
+    const char *archive_dir = NULL;
     int domain = AF_INET;
-    socklen_t peer_lg = sizeof(struct sockaddr_in);
-    fd_set rfds, wfds;
+    int ls;                         /* listening socket */
+    int ep;                         /* epoll instance */
+    struct epoll_event ev, events[MAX_EVENTS];
 
     /* Process options. */
     while ((opt=getopt(argc, argv, optstring)) != -1) switch(opt) {
@@ -83,7 +162,6 @@ int main(int argc, char *argv[])
             break;
         case 'u':
             domain = AF_UNIX;
-            peer_lg = sizeof(struct sockaddr_un);
             socket_name = optarg;
             break;
         case 'n':
@@ -100,6 +178,40 @@ int main(int argc, char *argv[])
                 max_client_count = 1;
             }
             break;
+        case 'b':
+            backlog = atoi(optarg);
+            if (backlog < 1) {
+                fprintf(stderr, "Invalid backlog, using 1\n");
+                backlog = 1;
+            }
+            break;
+        case 'm':
+            shm_name = optarg;
+            break;
+        case 'r':
+            ring_size = atol(optarg);
+            if (ring_size < 1) {
+                fprintf(stderr, "Invalid ring size, using 1\n");
+                ring_size = 1;
+            }
+            break;
+        case 'H':;
+            char *suffix;
+            double size = strtod(optarg, &suffix);
+            switch (*suffix) {
+                case 'k': size *= 1e3; break;
+                case 'M': size *= 1e6; break;
+                case 'G': size *= 1e9; break;
+            }
+            if (size < 1) {
+                fprintf(stderr, "Invalid history size, using 1M\n");
+                size = 1e6;
+            }
+            history_size = size;
+            break;
+        case 'a':
+            archive_dir = optarg;
+            break;
         case 'd':
             if (fork()) _exit(EXIT_SUCCESS);
             fclose(stdin);
@@ -111,82 +223,137 @@ int main(int argc, char *argv[])
             fputs(cmdline_help, stderr);
             return EXIT_FAILURE;
     }
-    if (shell_mode)
-        return shell();
 
     /* Log messages via syslog. */
-    openlog("trmc2d", 0, LOG_DAEMON);
+    openlog("trmc2d", shell_mode ? LOG_PERROR : 0, LOG_DAEMON);
+
+    /* Publish the measurements for local readers. */
+    if (shm_name && shm_init(shm_name) == -1)
+        return EXIT_FAILURE;
+
+    /*
+     * Keep the measurements for the clients to read at their pace.
+     * Publishing them, or keeping their history or archive, drains the
+     * FIFOs every 100 ms: the clients would find them empty, thus they
+     * read the rings instead.
+     */
+    if (!ring_size && (shm_name || history_size || archive_dir))
+        ring_size = DEFAULT_RING_SIZE;
+    if (ring_size)
+        ring_init(ring_size);
+
+    /* Keep a compressed history of the measurements. */
+    if (history_size)
+        history_init(history_size);
+
+    /* Archive the measurements on disk. */
+    if (archive_dir && archive_init(archive_dir) == -1)
+        return EXIT_FAILURE;
+
+    /* Build the dispatch tables of the language. */
+    if (compile_syntax(trmc2_syntax) == -1)
+        syslog(LOG_WARNING, "compile_syntax: out of memory");
+
+    /* All the libtrmc2 calls happen in the acquisition thread. */
+    if (start_acquisition() == -1)
+        return EXIT_FAILURE;
+
+    if (shell_mode) {
+        int ret = shell();
+        stop_acquisition();
+        archive_stop();
+        return ret;
+    }
+
+    /* A client going away should not kill us in the middle of a write. */
+    signal(SIGPIPE, SIG_IGN);
 
     /* Get a listening socket. */
-    ls = get_socket(domain, port, socket_name);
+    ls = get_socket(domain, port, socket_name, backlog);
     if (ls == -1) return EXIT_FAILURE;
 
+    /* Watch it: a NULL data pointer stands for the listening socket. */
+    ep = epoll_create1(0);
+    if (ep == -1) {
+        syslog(LOG_ERR, "epoll_create1: %m\n");
+        return EXIT_FAILURE;
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, ls, &ev) == -1) {
+        syslog(LOG_ERR, "epoll_ctl: %m\n");
+        return EXIT_FAILURE;
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &acquisition_event;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, acquisition_fd(), &ev) == -1) {
+        syslog(LOG_ERR, "epoll_ctl: %m\n");
+        return EXIT_FAILURE;
+    }
+
     do {
 
-        /* select() loop. */
-        FD_ZERO(&rfds);
-        FD_ZERO(&wfds);
-        int max_fd = 0;
-        for (i=0; i<MAX_CLIENTS; i++) {
-            cl = &client[i];
-            if (cl->active) {
-                FD_SET_M(cl->in, &rfds, max_fd);
-                if (cl->output_pending)
-                    FD_SET_M(cl->out, &wfds, max_fd);
-            }
-        }
-        cl = get_client_slot();
-        if (cl) FD_SET_M(ls, &rfds, max_fd);
-        int ret = select(max_fd + 1, &rfds, &wfds, NULL, NULL);
-        if (ret == -1) {
+        /* epoll() loop. */
+        int n = epoll_wait(ep, events, MAX_EVENTS, -1);
+        if (n == -1) {
             if (errno == EINTR)    /* Interrupted system call */
                 continue;
-            syslog(LOG_ERR, "select: %m\n");
+            syslog(LOG_ERR, "epoll_wait: %m\n");
             return EXIT_FAILURE;
         }
 
-        /* accept() connection. */
-        if (FD_ISSET(ls, &rfds)) {
-            cl->in = cl->out =
-                accept(ls, &peer_addr.any, &peer_lg);
-            if (cl->in == -1) {
-                syslog(LOG_ERR, "accept: %m\n");
-                return EXIT_FAILURE;
-            }
-            if (client_count >= max_client_count) {
-                close(cl->in);
-            } else {
-                cl->active++;
-                client_count++;
+        int results_ready = 0;
+        for (int i = 0; i < n; i++) {
+            client_t *cl = events[i].data.ptr;
+
+            /*
+             * Results may delete clients: deliver them after the other
+             * events, which may refer to those clients.
+             */
+            if (events[i].data.ptr == &acquisition_event) {
+                results_ready = 1;
+                continue;
             }
-        }
 
-        /* Do I/O. */
-        for (i=0; i<MAX_CLIENTS; i++) {
-            cl = &client[i];
-            if (!cl->active) continue;
-            if (cl->in > max_fd) continue;   /* this is the new client */
-            if (FD_ISSET(cl->out, &wfds)) process_output(cl);
-            if (FD_ISSET(cl->in, &rfds)) {
-                if (process_input(cl)) {
-                    char command[COMMAND_LENGTH];
-                    while (get_command(cl, command)) {
-                        ret = parse(command, trmc2_syntax, cl);
-                        if (ret < 0)
-                            report_error(cl, const_name(ret, parse_errors));
+            /* accept() connections. */
+            if (!cl) {
+                int s;
+                while ((s = accept_connection(ls)) != -1) {
+                    if (client_count >= max_client_count
+                            || !(cl = new_client(s, s))) {
+                        close(s);
+                        continue;
                     }
-                } else {         /* client disconnected */
-                    client->quitting = 1;
-                }
-                if (client->quitting) {
-                    close(cl->in);
-                    cl->active = 0;
-                    client_count--;
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    ev.data.ptr = cl;
+                    if (epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev) == -1) {
+                        syslog(LOG_ERR, "epoll_ctl: %m\n");
+                        delete_client(cl);
+                        continue;
+                    }
+                    client_count++;
                 }
+                continue;
             }
+
+            /* Do I/O. */
+            uint32_t e = events[i].events;
+            if (e & EPOLLOUT) process_output(cl);
+            if (cl->throttled ? !output_congested(cl)
+                    : (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                serve_input(cl);
+                if (cl->output_pending) process_output(cl);
+            }
+            if (cl->quitting && !cl->retired)
+                retire_client(cl);   /* deleted by resume_client() */
         }
 
+        if (results_ready)
+            deliver_results(resume_client);
+
     } while (!should_quit);
 
+    stop_acquisition();
+    archive_stop();
     return EXIT_SUCCESS;
 }